@@ -0,0 +1,18 @@
+#pragma once
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// what the MADT says about the processors, capped at CPU_MAX of them
+struct AcpiMadtInfo {
+  uintptr_t lapic_addr;
+  size_t num_cpus;
+  uint32_t apic_ids[CPU_MAX];
+};
+
+// finds the MADT through the root pointer the bootloader handed over, false
+// if there's no root pointer, no MADT or a table fails its checksum
+bool ACPI_read_madt(struct AcpiMadtInfo *info);
@@ -5,3 +5,12 @@
 void init_alloc();
 void *kmalloc(size_t size);
 void kfree(void *addr);
+// contents are kept up to the smaller of the two sizes, on failure NULL is
+// returned and the old allocation is left alone
+void *krealloc(void *addr, size_t size);
+// usable size of an allocation, at least what was asked for
+size_t ksize(void *addr);
+
+#ifdef KMALLOC_BENCH
+void kmalloc_bench();
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// interrupt command register bits for APIC_send_ipi
+#define APIC_ICR_FIXED 0x000
+#define APIC_ICR_INIT 0x500
+#define APIC_ICR_STARTUP 0x600
+#define APIC_ICR_LEVEL_ASSERT 0x4000
+#define APIC_ICR_ALL_BUT_SELF (3u << 18)
+
+// where the spurious interrupts the local APIC generates go, never EOI'd
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// maps the local APIC registers, every CPU shares the same physical address
+void APIC_init(uintptr_t base);
+// turns on the calling CPU's local APIC
+void APIC_enable();
+uint32_t APIC_id();
+void APIC_eoi();
+// icr is a delivery mode from above or'd with a vector or startup page
+void APIC_send_ipi(uint32_t apic_id, uint32_t icr);
+void APIC_send_ipi_others(uint32_t icr);
+
+// times the local APIC timer against TIMER_HZ ticks, on the boot CPU with
+// the PIT already running
+void APIC_timer_calibrate();
+// periodic interrupts on vector at TIMER_HZ on the calling CPU
+void APIC_timer_start(uint8_t vector);
+// a single interrupt on vector once TIMER_ns() reaches deadline_ns, off the
+// TSC deadline when the CPU has one. It may come early if the deadline is
+// further than the counter reaches, never late
+void APIC_timer_oneshot(uint8_t vector, uint64_t deadline_ns);
+void APIC_timer_stop();
+bool APIC_has_tsc_deadline();
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "interrupts.h"
 #include "processes.h"
+#include "sync.h"
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -12,7 +14,6 @@ struct BlockDevice {
 
 struct ATARequest {
   uint64_t blk_num;
-  struct ProcessQueue block_queue;
   struct ATARequest *next;
 };
 
@@ -20,7 +21,16 @@ struct ATABlockDevice {
   struct BlockDevice dev;
   uint16_t ata_base, ata_master;
   uint8_t slave, irq;
+  // one read on the drive at a time
+  struct KMutex lock;
   struct ATARequest *req_head, *req_tail;
+  // the reader waits here rather than on its request, so a completion that
+  // arrives after it gave up never touches a freed one
+  struct ProcessQueue block_queue;
+  // when the drive's interrupt said the current read was done
+  volatile uint64_t completed_at;
+  // wakes the reader once the interrupt is acked
+  struct Softirq done;
 };
 
 #define PRIM_IO_BASE 0x1F0
@@ -39,4 +49,7 @@ enum ATADevType detect_devtype(uint8_t slavebit, uint16_t base,
 struct BlockDevice *ata_probe(uint16_t base, uint16_t master, uint8_t slave,
                               uint8_t irq);
 
+void BLK_init();
+// ATA completion interrupt to the reader having the data
+void BLK_print_latency();
 int BLK_register(struct BlockDevice *dev);
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// per-CPU data is sized for this many CPUs
+#define CPU_MAX 8
+
+#define MSR_GS_BASE 0xC0000101
+
+struct ProcNode;
+
+/**
+ * Each CPU's own state, reached through the gs base so it's a single load
+ * from anywhere. isr_handler.asm uses the first three fields, preempt_count
+ * and irq_depth at fixed offsets, keep them where they are.
+ */
+struct Cpu {
+  struct Cpu *self;
+  // the thread running here and the one the interrupt return switches to
+  struct ProcNode *cur_proc;
+  struct ProcNode *next_proc;
+  unsigned id;
+  uint32_t apic_id;
+  int preempt_count;
+  int irq_depth;
+  volatile bool online;
+};
+
+_Static_assert(__builtin_offsetof(struct Cpu, cur_proc) == 8 &&
+                   __builtin_offsetof(struct Cpu, next_proc) == 16 &&
+                   __builtin_offsetof(struct Cpu, preempt_count) == 32 &&
+                   __builtin_offsetof(struct Cpu, irq_depth) == 36,
+               "isr_handler.asm expects these offsets");
+
+#define CPUID_EXT_FEATURES 0x80000001
+#define CPUID_EXT_EDX_PDPE1GB (1u << 26)
+
+struct CpuidRegs {
+  uint32_t eax, ebx, ecx, edx;
+};
+
+static inline struct CpuidRegs cpuid(uint32_t leaf, uint32_t subleaf) {
+  struct CpuidRegs regs;
+  asm volatile("cpuid"
+               : "=a"(regs.eax), "=b"(regs.ebx), "=c"(regs.ecx), "=d"(regs.edx)
+               : "a"(leaf), "c"(subleaf));
+  return regs;
+}
+
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value),
+               "d"((uint32_t)(value >> 32)));
+}
+
+// points the gs base at cpu, once per CPU before anything uses CPU_this
+static inline void CPU_set_local(struct Cpu *cpu) {
+  cpu->self = cpu;
+  wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+// a thread can move CPUs whenever it's preemptible, so the answer is only
+// stable with preemption or interrupts off
+static inline struct Cpu *CPU_this() {
+  struct Cpu *cpu;
+  asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+// the running thread, in one gs relative load so it can't be preempted
+// between finding the CPU and reading it
+static inline struct ProcNode *CPU_cur_proc() {
+  struct ProcNode *proc;
+  asm volatile("mov %%gs:%c1, %0"
+               : "=r"(proc)
+               : "i"(__builtin_offsetof(struct Cpu, cur_proc)));
+  return proc;
+}
+
+static inline unsigned CPU_id() {
+  unsigned id;
+  asm volatile("movl %%gs:%c1, %0"
+               : "=r"(id)
+               : "i"(__builtin_offsetof(struct Cpu, id)));
+  return id;
+}
+
+// whether the PDP level can map 1 GiB pages directly
+static inline bool CPU_has_pdpe1gb() {
+  if (cpuid(0x80000000, 0).eax < CPUID_EXT_FEATURES) {
+    return false;
+  }
+  return (cpuid(CPUID_EXT_FEATURES, 0).edx & CPUID_EXT_EDX_PDPE1GB) != 0;
+}
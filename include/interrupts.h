@@ -66,6 +66,39 @@ enum IRQLine {
 };
 
 void IRQ_init();
+// loads the GDT, the CPU's own TSS and the shared IDT on an AP, with
+// interrupts still off
+void IRQ_init_ap(unsigned cpu);
 void IRQ_handler_set(int number, irq_handler_t handler, void *arg);
+// true while running an interrupt handler or softirq, where a switch
+// happens on iretq
+bool IRQ_in_interrupt();
 void IRQ_set_mask(uint8_t IRQline);
 void IRQ_clear_mask(uint8_t IRQline);
+
+/**
+ * Work an interrupt handler leaves for after it's acked the device, so the
+ * handler itself only has to do what can't wait. Softirqs raised on a CPU
+ * run once its outermost interrupt handler returns, with interrupts back on
+ * but still before the interrupted thread resumes. They can't block and
+ * aren't switched away from, and one raised again while still queued only
+ * runs once.
+ */
+struct Softirq {
+  struct Softirq *next;
+  void (*fn)(void *arg);
+  void *arg;
+  volatile bool pending;
+};
+
+void IRQ_softirq_init(struct Softirq *softirq, void (*fn)(void *arg),
+                      void *arg);
+// from an interrupt handler, queues it on this CPU
+void IRQ_raise_softirq(struct Softirq *softirq);
+// true while this CPU is running softirqs
+bool IRQ_in_softirq();
+
+#ifdef IRQ_STATS
+// how long interrupt handlers kept interrupts off and how long softirqs ran
+void IRQ_print_stats();
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Opt-in accounting of the kernel heap by call site, built in with
+ * KMALLOC_PROFILE. Every live allocation is looked up by address so frees
+ * are charged back to whoever made them, all in fixed tables so the
+ * profiler never allocates itself.
+ */
+#ifdef KMALLOC_PROFILE
+void kmalloc_profile_alloc(void *addr, size_t size, void *caller);
+void kmalloc_profile_free(void *addr);
+// an allocation that changed size without moving
+void kmalloc_profile_resize(void *addr, size_t size);
+// the num sites holding the most live bytes, with their allocation rates
+// since the last dump
+void kmalloc_profile_print(size_t num);
+#else
+static inline void kmalloc_profile_alloc(void *addr, size_t size,
+                                         void *caller) {}
+static inline void kmalloc_profile_free(void *addr) {}
+static inline void kmalloc_profile_resize(void *addr, size_t size) {}
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+enum MemStat {
+  // frames holding page table levels
+  MEMSTAT_PAGE_TABLES,
+  // frames backing faulted in kernel heap pages
+  MEMSTAT_HEAP_RESIDENT,
+  // frames owned by slab caches, and bytes of live objects in them
+  MEMSTAT_SLAB,
+  MEMSTAT_SLAB_ACTIVE,
+  // frames handed out whole by kmalloc
+  MEMSTAT_KMALLOC_PAGES,
+  // heap pages reserved by vmalloc, resident or not
+  MEMSTAT_VMALLOC_PAGES,
+  MEMSTAT_PAGE_CACHE,
+  MEMSTAT_TMPFS,
+  // free frames already zeroed and waiting in the zero pool
+  MEMSTAT_ZERO_POOL,
+  MEMSTAT_NUM,
+};
+
+void MEMINFO_add(enum MemStat stat, long delta);
+size_t MEMINFO_get(enum MemStat stat);
+void MEMINFO_print();
@@ -1,14 +1,16 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct MemRegion {
   void *start;
   void *end;
-  void *next;
 };
 
 #define MEM_REGIONS_LEN 16
+// memory below this never goes to the allocator, APs start executing in it
+#define MEM_LOW_RESERVED_END 0x10000
 struct MemRegions {
   struct MemRegion d[MEM_REGIONS_LEN];
   size_t size;
@@ -16,3 +18,8 @@ struct MemRegions {
 
 void multiboot_tags_parse_to_mem_regions();
 struct MemRegions *multiboot_get_mem_regions();
+// the bootloader's copy of the ACPI root pointer, NULL if it didn't pass one
+void *multiboot_get_rsdp();
+// name of the kernel function containing addr from the ELF symbol table the
+// bootloader loaded, NULL if there's no table or no function covers it
+const char *multiboot_symbolize(uintptr_t addr, uintptr_t *offset);
@@ -1,21 +1,96 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 // 4 KiB pages
 #define MMU_PAGE_SIZE 0x1000
+// buddy blocks go from a single frame up to 2^MMU_MAX_ORDER frames (4 MiB)
+#define MMU_MAX_ORDER 10
+// order of the blocks behind a 2 MiB page
+#define MMU_HUGE_PAGE_ORDER 9
+#define MMU_HUGE_PAGE_SIZE (MMU_PAGE_SIZE << MMU_HUGE_PAGE_ORDER)
+
+// background reclaim starts below the low watermark and runs until the high
+// one, both in frames
+#define MMU_WATERMARK_LOW 256
+#define MMU_WATERMARK_HIGH 512
+
+// frames the idle loop keeps zeroed ahead of time, and how many it zeroes
+// before checking for runnable threads again
+#define MMU_ZERO_POOL_TARGET 128
+#define MMU_ZERO_POOL_BATCH 8
+
+// a heap fault also backs the other untouched pages in its aligned window of
+// this many pages, as long as memory isn't tight
+#define MMU_FAULT_AROUND_PAGES 16
+
+#define PF_FLAG_FREE (1 << 0)
+// part of a slab, slab_cache says which cache owns it
+#define PF_FLAG_SLAB (1 << 1)
+// first frame of a multi-page kmalloc allocation
+#define PF_FLAG_KMALLOC (1 << 2)
+
+struct KmemCache;
+
+// one per physical frame, indexed by frame number
+struct PageFrame {
+  union {
+    // free list links, only meaningful while the block is free
+    struct {
+      struct PageFrame *next;
+      struct PageFrame *prev;
+    };
+    struct KmemCache *slab_cache;
+    size_t kmalloc_pages;
+  };
+  // order of the block this frame heads, if it heads one
+  uint8_t order;
+  uint8_t flags;
+};
 
 size_t get_free_memory();
+size_t MMU_free_frames();
+size_t MMU_total_frames();
+size_t MMU_free_blocks(int order);
+void MMU_pf_print_stats();
+
+// sets up the buddy allocator over the multiboot memory regions
+void MMU_pf_init();
+struct PageFrame *MMU_pf_frame(void *pf);
+void *MMU_pf_frame_addr(struct PageFrame *frame);
 
 // TODO: should these be exported nowadays
+// returns NULL only once every shrinker has been given a chance
 void *MMU_pf_alloc();
 void MMU_pf_free(void *pf);
+// 2^order physically contiguous frames, aligned to their size
+void *MMU_pf_alloc_order(int order);
+// fails straight away instead of reclaiming, for callers with a fallback
+void *MMU_pf_try_alloc_order(int order);
+void MMU_pf_free_order(void *pf, int order);
+// num physically contiguous frames, the rest of the power of two block they
+// were cut from goes straight back to the free lists
+void *MMU_pf_alloc_exact(size_t num);
+void MMU_pf_free_exact(void *pf, size_t num);
+// a single zero filled frame, from the pool if the idle loop got ahead
+void *MMU_pf_alloc_zeroed();
+// zeroes up to batch frames into the pool, returns false once it's full or
+// memory is too tight to spare any
+bool MMU_zero_pool_refill(size_t batch);
 
 void MMU_alloc_init();
-void *MMU_alloc_page();
-void *MMU_alloc_pages(int num);
-void MMU_free_page(void *addr);
+// backs every page of a range marked for demand paging right away, returns
+// false if frames ran out part way
+bool MMU_populate_pages(void *addr, int num);
+// gives back the frames behind num demand paged pages and unmaps them
 void MMU_free_pages(void *addr, int num);
+// heap page faults taken so far
+size_t MMU_num_faults();
+// window in pages a fault fills in, 1 turns fault-around off. At most
+// MMU_FAULT_AROUND_PAGES
+void MMU_set_fault_around(size_t pages);
 
 #ifdef MMU_MEMTEST
 void MMU_memtest();
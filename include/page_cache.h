@@ -0,0 +1,20 @@
+#pragma once
+
+#include "vfs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Page cache shared by every filesystem that provides readpage. Pages are
+ * MMU_PAGE_SIZE frames keyed by (superblock, inode number, page index), so
+ * the cached data outlives the struct Inode that first read it.
+ */
+void page_cache_init();
+void *page_cache_get_page(struct Inode *inode, uint64_t index);
+int page_cache_read(struct Inode *inode, off_t *cursor, char *dst, int len);
+int page_cache_mmap(struct Inode *inode, void *addr);
+
+// CLOCK scan, returns the number of pages actually freed
+size_t page_cache_reclaim(size_t nr_pages);
+size_t page_cache_num_pages();
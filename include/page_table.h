@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define ADDR_SPACE_PHYSICAL_PAGE_BASE (void *)0x0
@@ -31,8 +32,10 @@ struct PDPEntry {
   bool page_write_through : 1;
   bool page_cache_disable : 1;
   bool accessed : 1;
-  bool ignored : 1;
-  uint8_t must_be_zero : 2;
+  bool ignored1 : 1;
+  // maps a 1 GiB page instead of pointing at a page directory
+  bool page_size : 1;
+  bool ignored2 : 1;
   uint8_t available1 : 3;
   uint64_t pd_addr : 40;
   uint16_t available2 : 11;
@@ -47,7 +50,8 @@ struct PDEntry {
   bool page_cache_disable : 1;
   bool accessed : 1;
   bool ignored1 : 1;
-  uint8_t must_be_zero : 1;
+  // maps a 2 MiB page instead of pointing at a page table
+  bool page_size : 1;
   bool ignored2 : 1;
   uint8_t available1 : 3;
   uint64_t pt_addr : 40;
@@ -75,7 +79,10 @@ struct PageEntry {
   bool present : 1;
   bool read_write : 1;
   bool user_supervisor : 1;
-  uint8_t : 6;
+  uint8_t : 4;
+  // huge page at the PDP and PD levels, PAT in a PT entry
+  bool page_size : 1;
+  uint8_t : 1;
   uint8_t available : 3;
   uint64_t addr : 40;
   uint16_t : 12;
@@ -109,9 +116,51 @@ static inline void *get_cr2() {
   return cr2;
 }
 
+static inline void invlpg(void *virt_addr) {
+  asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+}
+
+// entries are looked up through 4 KiB leaves, so any huge page covering
+// virt_addr is split when allocate is set and treated as missing otherwise
 struct PTEntry *page_table_get_entry(struct PageEntry *table, void *virt_addr,
                                      bool allocate);
 
-typedef void (*entry_callback_t)(void *addr, struct PTEntry *entry);
-void page_table_walk(struct PageEntry *table, void *start_addr, void *end_addr,
-                     entry_callback_t callback);
+// invalidations are collected while page tables are edited and flushed once
+// done, individually up to TLB_BATCH_MAX pages and by reloading CR3 past that
+#define TLB_BATCH_MAX 32
+
+struct TlbBatch {
+  size_t count;
+  void *addrs[TLB_BATCH_MAX];
+};
+
+static inline void tlb_batch_init(struct TlbBatch *batch) { batch->count = 0; }
+void tlb_batch_add(struct TlbBatch *batch, void *virt_addr);
+void tlb_batch_flush(struct TlbBatch *batch);
+
+// calls callback on the leaf entry of every page in [start_addr, end_addr),
+// descending into each table once. Missing tables are created if allocate is
+// set and skipped otherwise, huge pages in the range are split. Returns false
+// if a table couldn't be allocated
+typedef void (*entry_callback_t)(void *addr, struct PTEntry *entry, void *arg);
+bool page_table_walk(struct PageEntry *table, void *start_addr, void *end_addr,
+                     bool allocate, entry_callback_t callback, void *arg);
+
+bool page_table_map(struct PageEntry *table, void *virt_start, void *virt_end,
+                    void *phys_start, bool writable, struct TlbBatch *batch);
+bool page_table_unmap(struct PageEntry *table, void *virt_start, void *virt_end,
+                      struct TlbBatch *batch);
+bool page_table_protect(struct PageEntry *table, void *virt_start,
+                        void *virt_end, bool writable, struct TlbBatch *batch);
+// maps the pages covering [phys_addr, phys_addr + size) onto themselves, for
+// firmware tables and device registers the direct map doesn't reach
+bool page_table_map_phys(struct PageEntry *table, void *phys_addr, size_t size,
+                         bool writable);
+// maps the 2 MiB aligned virt_addr to phys_addr with a single 2 MiB page. An
+// empty page table already there is freed, one still in use makes it fail
+bool page_table_map_huge(struct PageEntry *table, void *virt_addr,
+                         void *phys_addr, struct TlbBatch *batch);
+// unmaps the 2 MiB page at virt_addr, returns the frames it mapped or NULL if
+// there's no 2 MiB page there
+void *page_table_unmap_huge(struct PageEntry *table, void *virt_addr,
+                            struct TlbBatch *batch);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "cpu.h"
+
+#include <stddef.h>
+
+/**
+ * The timer only switches threads while this CPU's count is zero. Code using
+ * per-CPU state (magazines, run queues) bumps it for as long as it would be
+ * unsafe to be switched out or moved to another CPU, and every spinlock
+ * holder does too. It nests, and must never be held across a yield or block.
+ * Each update is a single gs relative instruction, so it always lands on the
+ * CPU the thread is running on.
+ */
+static inline void preempt_disable() {
+  asm volatile("incl %%gs:%c0"
+               :
+               : "i"(offsetof(struct Cpu, preempt_count))
+               : "memory");
+}
+
+static inline void preempt_enable() {
+  asm volatile("decl %%gs:%c0"
+               :
+               : "i"(offsetof(struct Cpu, preempt_count))
+               : "memory");
+}
+
+static inline int preempt_count() {
+  int count;
+  asm volatile("movl %%gs:%c1, %0"
+               : "=r"(count)
+               : "i"(offsetof(struct Cpu, preempt_count)));
+  return count;
+}
@@ -15,28 +15,117 @@ struct ProcNode {
   struct ProcContext *context;
   struct ProcNode *next;
   struct ProcNode *prev;
+  // when it last became ready to run, for scheduling latency
+  uint64_t runnable_since;
+  // run queue it's on, and the one it sinks back to after a wakeup boost
+  int prio;
+  int base_prio;
+  // CPU whose run queue it's on, or goes back to when woken
+  unsigned cpu;
+  // never stolen by another CPU
+  bool pinned;
+  // wait queue it's on, under the wait lock
+  struct ProcessQueue *blocked_on;
+  // only one exclusive waiter is woken at a time by PROC_wake
+  bool exclusive;
 };
 
 struct ProcessQueue {
   struct ProcNode *head;
 };
 
-extern struct ProcNode *cur_proc;
-extern struct ProcNode *next_proc;
+// ticks a thread runs before the timer hands the CPU to the next one
+#define PROC_DEFAULT_TIME_SLICE 10
 
+// lower is more urgent. Woken threads jump a few levels above their base
+// priority and sink back one level for every whole slice they use up
+#define PROC_NUM_PRIOS 32
+#define PROC_PRIO_HIGHEST 0
+#define PROC_PRIO_LOWEST (PROC_NUM_PRIOS - 1)
+#define PROC_PRIO_DEFAULT 16
+#define PROC_WAKE_BOOST 4
+
+void PROC_init();
 void PROC_run();
+// called from the timer interrupt on every tick
+void PROC_tick();
+void PROC_set_time_slice(unsigned ticks);
+void PROC_set_wake_boost(int levels);
+void PROC_print_sched_stats();
 
 typedef void (*kproc_t)(void *);
 size_t PROC_create_kthread(kproc_t entry_point, void *arg);
+size_t PROC_create_kthread_prio(kproc_t entry_point, void *arg, int prio);
+// runs only ever on cpu
+size_t PROC_create_kthread_pinned(kproc_t entry_point, void *arg,
+                                  unsigned cpu);
+// changes the base priority of the calling thread
+void PROC_set_priority(int prio);
 
 void PROC_reschedule();
+// called from the reschedule IPI another CPU sends after queueing something
+// here
+void PROC_kick();
+// once an interrupt's softirqs are done, switches to whatever they woke
+// that was handed this CPU, or anything else they made more urgent
+void PROC_softirq_exit();
+// switch.asm and isr_handler.asm call into these around a switch
+void PROC_switch_from_irq();
+void PROC_finish_switch();
 
+/**
+ * Every wait queue, and the condition a thread checks before waiting on one,
+ * is guarded by a single wait lock. Taking it turns interrupts off. A waiter
+ * checks its condition with it held and PROC_block_on drops it once the
+ * thread is on the queue, so a wakeup from another CPU can't slip in between.
+ * The unblock calls take it themselves and mustn't be called with it held.
+ */
+void PROC_wait_lock();
+void PROC_wait_unlock();
 void PROC_block_on(struct ProcessQueue *, int enable_ints);
+// for waiters where only one can make use of each wakeup, like readers of a
+// ring buffer
+void PROC_block_on_exclusive(struct ProcessQueue *, int enable_ints);
+// the same, but gives up after timeout_ns. Returns false if it timed out
+// rather than being unblocked
+bool PROC_block_on_timeout(struct ProcessQueue *, int enable_ints,
+                           uint64_t timeout_ns);
 void PROC_unblock_all(struct ProcessQueue *);
 void PROC_unblock_head(struct ProcessQueue *);
+// like PROC_unblock_head, but an empty queue is fine. Returns whether it woke
+// anything
+bool PROC_unblock_one(struct ProcessQueue *);
+
+// every exclusive waiter too, not just the first
+#define PROC_WAKE_ALL 0x1
+// from an interrupt, switches to the first thread woken as soon as the
+// interrupt returns rather than leaving it to wait its turn
+#define PROC_WAKE_HANDOFF 0x2
+// wakes every waiter that isn't exclusive and the first one that is.
+// Returns how many it woke
+size_t PROC_wake(struct ProcessQueue *, int flags);
+
+// cycles from an interrupt making something available to the thread it woke
+// taking it
+struct WakeLatency {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+};
+
+void PROC_latency_record(struct WakeLatency *, uint64_t since);
+void PROC_latency_print(const char *name, struct WakeLatency *);
 void PROC_init_queue(struct ProcessQueue *);
 bool PROC_has_unblocked();
 
 void yield();
 
 void kexit();
+
+#ifdef SCHED_BENCH
+void PROC_sched_bench();
+#endif
+
+#ifdef SWITCH_BENCH
+void PROC_switch_bench();
+#endif
@@ -67,3 +67,5 @@ void ps2_initialize();
 void ps2_echo();
 
 int getc();
+// keystroke to getc
+void ps2_print_latency();
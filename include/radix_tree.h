@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 64-way nodes, each level consumes 6 bits of the index
+#define RADIX_TREE_SHIFT 6
+#define RADIX_TREE_SLOTS (1 << RADIX_TREE_SHIFT)
+#define RADIX_TREE_MASK (RADIX_TREE_SLOTS - 1)
+#define RADIX_TREE_MAX_HEIGHT ((64 + RADIX_TREE_SHIFT - 1) / RADIX_TREE_SHIFT)
+
+struct RadixTreeNode {
+  void *slots[RADIX_TREE_SLOTS];
+  uint32_t count;
+};
+
+/**
+ * Sparse index from 64 bit keys to non-null pointers. The tree only grows as
+ * tall as the largest key needs, so small files stay a single node deep.
+ */
+struct RadixTree {
+  struct RadixTreeNode *root;
+  uint32_t height;
+};
+
+void radix_tree_init(struct RadixTree *tree);
+void *radix_tree_lookup(struct RadixTree *tree, uint64_t index);
+// fails if index is already taken or a node can't be allocated. A failed
+// insert may leave empty nodes behind, which destroy still frees
+bool radix_tree_insert(struct RadixTree *tree, uint64_t index, void *item);
+void *radix_tree_delete(struct RadixTree *tree, uint64_t index);
+
+typedef void (*radix_tree_cb)(uint64_t index, void *item, void *arg);
+void radix_tree_for_each(struct RadixTree *tree, radix_tree_cb cb, void *arg);
+// frees the interior nodes, items are left to the caller
+void radix_tree_destroy(struct RadixTree *tree);
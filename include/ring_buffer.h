@@ -3,14 +3,18 @@
 #include "processes.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define BUFF_SIZE 16
 
 struct RingBuffer {
   char buff[BUFF_SIZE];
+  // when each character went in, for how long blocked consumers took to it
+  uint64_t stamps[BUFF_SIZE];
   char *consumer;
   char *producer;
   struct ProcessQueue *blocked;
+  struct WakeLatency latency;
 };
 
 void ring_init(struct RingBuffer *state, bool blockable);
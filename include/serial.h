@@ -2,3 +2,7 @@
 
 void SER_init(void);
 int SER_write(const char *buff, int len);
+// input needs threads to block on, so it's set up separately once they exist
+void SER_input_init(void);
+// blocks until a character comes in
+int SER_getc(void);
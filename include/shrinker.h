@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Caches that can give memory back register a shrinker. The frame allocator
+ * runs them synchronously when it runs dry, and the background reclaim
+ * thread runs them whenever free frames fall below MMU_WATERMARK_LOW.
+ */
+struct Shrinker {
+  const char *name;
+  // pages that could be freed right now
+  size_t (*count)(struct Shrinker *this);
+  // try to free nr_pages pages, returns how many were actually freed
+  size_t (*scan)(struct Shrinker *this, size_t nr_pages);
+  struct Shrinker *next;
+};
+
+void SHRINK_register(struct Shrinker *shrinker);
+void SHRINK_unregister(struct Shrinker *shrinker);
+size_t SHRINK_run(size_t nr_pages);
+
+void SHRINK_init();
+void SHRINK_wake();
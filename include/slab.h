@@ -0,0 +1,90 @@
+#pragma once
+
+#include "cpu.h"
+#include "page_allocator.h"
+#include "spinlock.h"
+
+#include <stddef.h>
+
+// every slab is one naturally aligned buddy block, so the slab an object
+// belongs to is found by masking its address
+#define SLAB_ORDER 2
+#define SLAB_SIZE (MMU_PAGE_SIZE << SLAB_ORDER)
+// empty slabs a cache holds on to before handing them back to the frame
+// allocator, the rest are only kept until the shrinker asks for them
+#define SLAB_MAX_EMPTY 1
+
+// objects a magazine holds at most, caches of bigger objects use fewer
+#define MAGAZINE_MAX_ROUNDS 32
+// full or empty magazines a depot keeps, more go back to the slabs
+#define DEPOT_MAX_MAGAZINES 8
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+/**
+ * Magazines are small stacks of free objects that sit in front of the slab
+ * lists. Each CPU keeps a loaded and a previous one per cache, so most
+ * allocations and frees only touch that CPU's magazines. Full and empty
+ * magazines are exchanged with the cache's depot when both run out.
+ */
+struct Magazine {
+  struct Magazine *next;
+  size_t rounds;
+  void *objs[MAGAZINE_MAX_ROUNDS];
+};
+
+struct KmemCpuCache {
+  struct Magazine *loaded;
+  struct Magazine *previous;
+};
+
+struct Slab {
+  struct KmemCache *cache;
+  struct Slab *next;
+  struct Slab *prev;
+  // free objects are chained through cache->free_offset
+  void *free;
+  size_t inuse;
+};
+
+struct KmemCache {
+  // guards the slab lists and the depot, the magazines are per-CPU
+  struct Spinlock lock;
+  const char *name;
+  size_t size;
+  // distance between objects in a slab, and the first one's offset
+  size_t stride;
+  size_t first_offset;
+  // where the free list pointer lives, past the object if it has a ctor so
+  // freed objects stay constructed
+  size_t free_offset;
+  size_t objs_per_slab;
+  kmem_ctor_t ctor;
+  struct Slab *full, *partial, *empty;
+  size_t num_slabs, num_empty, active_objs;
+  // rounds per magazine, 0 skips magazines entirely
+  size_t magazine_size;
+  struct KmemCpuCache cpu[CPU_MAX];
+  struct Magazine *depot_full, *depot_empty;
+  size_t depot_num_full, depot_num_empty;
+  struct KmemCache *next;
+};
+
+void slab_init();
+
+struct KmemCache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                    kmem_ctor_t ctor);
+void kmem_cache_destroy(struct KmemCache *cache);
+void *kmem_cache_alloc(struct KmemCache *cache);
+void kmem_cache_free(struct KmemCache *cache, void *obj);
+// releases the cache's empty slabs, returns the number of frames freed
+size_t kmem_cache_shrink(struct KmemCache *cache);
+// the cache an object handed out by kmem_cache_alloc came from
+struct KmemCache *kmem_cache_of(void *obj);
+void kmem_cache_print_stats();
+
+#ifdef SLAB_BENCH
+// spawns a thread comparing alloc/free throughput with and without
+// magazines for a growing number of threads
+void kmem_cache_bench();
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// has to match AP_BASE in ap_trampoline.asm, and sit below
+// MEM_LOW_RESERVED_END so the allocator leaves it alone
+#define SMP_TRAMPOLINE_ADDR 0x8000
+#define SMP_AP_STACK_SIZE 16384
+
+// vectors for the interrupts CPUs send each other and the local APIC timer
+#define SMP_RESCHED_VECTOR 0xF0
+#define SMP_TLB_VECTOR 0xF1
+#define SMP_TIMER_VECTOR 0xF2
+
+// sets up the boot CPU's per-CPU data, before anything else runs
+void SMP_early_init();
+// starts every other CPU the MADT lists, each one ends up in SMP_idle
+void SMP_init();
+unsigned SMP_num_cpus();
+struct Cpu *SMP_cpu(unsigned id);
+
+// tells cpu something more urgent than what it's running was queued there
+void SMP_send_resched(unsigned cpu);
+// drops the TLB on every other CPU and waits until they all have, for when
+// mappings they may have cached are taken away or write protected
+void SMP_tlb_shootdown();
+
+// runs threads until none are left, then zeroes frames or halts until
+// there's more to do. Never returns
+void SMP_idle();
+
+#ifdef SMP_BENCH
+void SMP_bench();
+#endif
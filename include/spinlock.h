@@ -0,0 +1,54 @@
+#pragma once
+
+#include "interrupts.h"
+#include "preempt.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Test and test-and-set lock. Waiters spin on a plain read so the line isn't
+ * bounced between CPUs until it looks free. Holding one keeps preemption off,
+ * since a holder switched out would leave everyone else spinning for a whole
+ * time slice. State interrupt handlers touch as well needs the GUARD forms,
+ * which also turn interrupts off.
+ */
+struct Spinlock {
+  volatile uint32_t locked;
+};
+
+#define SPINLOCK_INIT {0}
+
+static inline void spin_lock_init(struct Spinlock *lock) { lock->locked = 0; }
+
+static inline void spin_lock(struct Spinlock *lock) {
+  preempt_disable();
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    while (lock->locked) {
+      asm volatile("pause");
+    }
+  }
+}
+
+static inline bool spin_trylock(struct Spinlock *lock) {
+  preempt_disable();
+  if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    preempt_enable();
+    return false;
+  }
+  return true;
+}
+
+static inline void spin_unlock(struct Spinlock *lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+  preempt_enable();
+}
+
+// pair up within a scope like CLI_GUARD and STI_GUARD, which they expand to
+#define SPIN_LOCK_GUARD(lock)                                                  \
+  CLI_GUARD;                                                                   \
+  spin_lock(lock)
+
+#define SPIN_UNLOCK_GUARD(lock)                                                \
+  spin_unlock(lock);                                                           \
+  STI_GUARD
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "processes.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Sleeping locks for threads, built on the wait lock and ProcessQueue. The
+ * uncontended paths are a single atomic and never touch the wait lock. A
+ * thread that has to wait counts itself in before its last try, and
+ * whoever releases checks that count afterwards, so one of them always sees
+ * the other and no wakeup is lost. None of them can be taken from an
+ * interrupt.
+ *
+ * Every lock belongs to a class, usually one per place locks are declared,
+ * which with LOCK_STATS built in gathers how often its locks are taken,
+ * how long they're waited on and how long they're held.
+ */
+struct LockClass {
+  const char *name;
+#ifdef LOCK_STATS
+  uint64_t acquisitions;
+  uint64_t contentions;
+  uint64_t wait_cycles;
+  uint64_t wait_max;
+  // only exclusive holders, readers aren't timed
+  uint64_t holds;
+  uint64_t hold_cycles;
+  uint64_t hold_max;
+  // classes join the list the first time one of their locks is taken
+  bool registered;
+  struct LockClass *next;
+#endif
+};
+
+#define LOCK_CLASS_INIT(lock_name) {.name = (lock_name)}
+
+// spins while the owner is running on another CPU, and only blocks once it
+// isn't or it's taking too long
+struct KMutex {
+  struct ProcNode *volatile owner;
+  volatile uint32_t waiters;
+  struct ProcessQueue queue;
+  struct LockClass *class;
+#ifdef LOCK_STATS
+  uint64_t acquired_at;
+#endif
+};
+
+struct KSemaphore {
+  volatile int64_t count;
+  volatile uint32_t waiters;
+  struct ProcessQueue queue;
+  struct LockClass *class;
+};
+
+// waits are Mesa style, a woken waiter has to check its condition again
+struct KCondVar {
+  volatile uint64_t seq;
+  struct ProcessQueue queue;
+};
+
+// writers go first, readers wait while one is waiting
+struct KRWLock {
+  // number of readers, or KRWLOCK_WRITER while a writer holds it
+  volatile int64_t state;
+  volatile uint32_t readers_waiting;
+  volatile uint32_t writers_waiting;
+  struct ProcessQueue readers;
+  struct ProcessQueue writers;
+  struct LockClass *class;
+#ifdef LOCK_STATS
+  uint64_t acquired_at;
+#endif
+};
+
+#define KRWLOCK_WRITER (-1)
+
+void kmutex_init(struct KMutex *mutex, struct LockClass *class);
+void kmutex_lock(struct KMutex *mutex);
+bool kmutex_trylock(struct KMutex *mutex);
+void kmutex_unlock(struct KMutex *mutex);
+
+void ksem_init(struct KSemaphore *sem, int64_t count, struct LockClass *class);
+void ksem_down(struct KSemaphore *sem);
+bool ksem_trydown(struct KSemaphore *sem);
+void ksem_up(struct KSemaphore *sem);
+
+void kcond_init(struct KCondVar *cond);
+// drops mutex while it waits, and has it again on return
+void kcond_wait(struct KCondVar *cond, struct KMutex *mutex);
+void kcond_signal(struct KCondVar *cond);
+void kcond_broadcast(struct KCondVar *cond);
+
+void krwlock_init(struct KRWLock *lock, struct LockClass *class);
+void krwlock_read_lock(struct KRWLock *lock);
+void krwlock_read_unlock(struct KRWLock *lock);
+void krwlock_write_lock(struct KRWLock *lock);
+void krwlock_write_unlock(struct KRWLock *lock);
+
+#ifdef LOCK_STATS
+// every class that's been used, most waited on first
+void lock_stats_print();
+#endif
+
+#ifdef SYNC_BENCH
+void sync_bench();
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "processes.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void *(*pool_task_fn_t)(void *arg);
+// runs over [begin, end), a grain's worth or the last of the range
+typedef void (*pool_range_fn_t)(size_t begin, size_t end, void *arg);
+
+/**
+ * A worker per CPU, pinned there, taking tasks off a shared queue. Tasks run
+ * on the workers' stacks, so they should keep to small frames like any
+ * kthread. A task lives wherever its submitter likes and is its own future:
+ * it has to stay put until POOL_join returns, and isn't touched again by
+ * the pool after that.
+ */
+struct PoolTask {
+  struct PoolTask *next;
+  pool_task_fn_t fn;
+  void *arg;
+  void *result;
+  volatile int state;
+  struct ProcessQueue waiters;
+};
+
+// starts the workers, once every CPU is online
+void POOL_init();
+size_t POOL_num_workers();
+
+void POOL_task_init(struct PoolTask *task, pool_task_fn_t fn, void *arg);
+void POOL_submit(struct PoolTask *task);
+bool POOL_done(struct PoolTask *task);
+// waits for task to finish and returns what it returned. Runs other queued
+// tasks while it waits, so it's fine from inside a task too
+void *POOL_join(struct PoolTask *task);
+
+// splits [begin, end) into grain sized pieces and runs fn over them on as
+// many workers as are free and the calling thread, returning once every
+// piece is done
+void POOL_parallel_for(size_t begin, size_t end, size_t grain,
+                       pool_range_fn_t fn, void *arg);
+
+#ifdef POOL_BENCH
+void POOL_bench();
+#endif
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// the PIT interrupts on IRQ0 this many times a second, each one a tick
+#define TIMER_HZ 1000
+#define TIMER_NS_PER_SEC 1000000000ull
+#define TIMER_NS_PER_TICK (TIMER_NS_PER_SEC / TIMER_HZ)
+
+typedef void (*timer_fn_t)(void *arg);
+
+// a one shot callback. Lives wherever its owner likes, the wheel only links
+// it in while it's pending
+struct Timer {
+  struct Timer *next;
+  // the pointer that points at this one, NULL while it isn't pending
+  struct Timer **pprev;
+  // tick it fires on
+  uint64_t expires;
+  timer_fn_t fn;
+  void *arg;
+};
+
+void TIMER_init();
+uint64_t TIMER_ticks();
+// nanoseconds since boot off the TSC, calibrated against the PIT
+uint64_t TIMER_ns();
+// the TSC value at TIMER_ns() == ns
+uint64_t TIMER_ns_to_tsc(uint64_t ns);
+// called on every tick, from whichever timer is ticking on the calling CPU
+void TIMER_tick();
+
+// moves the boot CPU's tick from the PIT to its local APIC timer on vector,
+// which lets every CPU stop ticking while it idles
+void TIMER_use_apic(uint8_t vector);
+// with interrupts off just before the idle loop halts, sets the timer for
+// the next thing due or stops it. TIMER_idle_exit puts the tick back
+void TIMER_idle_enter();
+void TIMER_idle_exit();
+
+void TIMER_setup(struct Timer *timer, timer_fn_t fn, void *arg);
+// fires fn(arg) from the timer softirq at least delay_ns from now, with
+// tick resolution. Rearming a pending timer moves it
+void TIMER_arm(struct Timer *timer, uint64_t delay_ns);
+// returns whether it was still pending. Once it returns the callback isn't
+// running anywhere either, so it mustn't be called from the callback itself
+// or an interrupt handler that could have cut in on it
+bool TIMER_cancel(struct Timer *timer);
+
+// sleeps for at least ns. Anything under a tick spins on the TSC instead
+void ksleep_ns(uint64_t ns);
+
+#ifdef TIMER_BENCH
+void TIMER_bench();
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "vfs.h"
+
+void tmpfs_init();
+struct SuperBlock *tmpfs_mount();
+
+#ifdef TMPFS_TEST
+void tmpfs_test();
+#endif
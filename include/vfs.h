@@ -2,7 +2,17 @@
 
 #include <stdint.h>
 
+typedef uint32_t ino_t;
+typedef uint16_t mode_t;
+typedef uint16_t uid_t;
+typedef uint16_t gid_t;
+typedef uint64_t off_t;
+
+#define VFS_MODE_DIR 0x4000
+#define VFS_MODE_REG 0x8000
+
 struct Inode;
+struct SuperBlock;
 typedef int (*readdir_cb)(const char *, struct Inode *, void *);
 
 struct File {
@@ -19,9 +29,13 @@ struct Inode {
   uid_t st_uid;
   gid_t st_gid;
   off_t st_size;
+  struct SuperBlock *sb;
   struct File *(*open)(struct Inode *inode);
   int (*readdir)(struct Inode *inode, readdir_cb cb, void *p);
   int (*unlink)(struct Inode *inode, const char *name);
+  struct Inode *(*create)(struct Inode *inode, const char *name, mode_t mode);
+  // fill one MMU_PAGE_SIZE page of file data, used by the page cache
+  int (*readpage)(struct Inode *inode, uint64_t index, void *dst);
 };
 
 struct SuperBlock {
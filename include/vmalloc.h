@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Virtually contiguous allocations on the kernel heap. Areas are carved out
+ * of a tree of free ranges, so freed address space gets reused, and each one
+ * is followed by an unmapped guard page. Pages are only backed by frames
+ * once they're touched, unless VMALLOC_POPULATE asks for them all up front.
+ * VMALLOC_HUGE areas start 2 MiB aligned and back every whole 2 MiB of
+ * themselves with a single page right away, any chunk that can't get one
+ * falls back to 4 KiB demand paging.
+ */
+#define VMALLOC_POPULATE (1 << 0)
+#define VMALLOC_HUGE (1 << 1)
+
+void vmalloc_init();
+void *vmalloc(size_t size);
+void *vmalloc_flags(size_t size, int flags);
+void vfree(void *addr);
+// size of the area starting at addr, 0 if there isn't one
+size_t vmalloc_size(void *addr);
+// grows the area at addr to size without moving it, only possible when the
+// address space after it is free
+bool vmalloc_grow(void *addr, size_t size);
+size_t vmalloc_num_free_ranges();
+
+#ifdef VMALLOC_TEST
+void vmalloc_test();
+#endif
+
+#ifdef VMALLOC_BENCH
+void vmalloc_bench();
+#endif
@@ -0,0 +1,154 @@
+#include "acpi.h"
+#include "multiboot_tags.h"
+#include "page_table.h"
+#include "printk.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct AcpiRsdp {
+  char signature[8];
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt_addr;
+  // the rest only exists from revision 2 on
+  uint32_t length;
+  uint64_t xsdt_addr;
+  uint8_t ext_checksum;
+  uint8_t reserved[3];
+} __attribute__((packed));
+
+struct AcpiSdtHeader {
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed));
+
+struct AcpiMadt {
+  struct AcpiSdtHeader header;
+  uint32_t lapic_addr;
+  uint32_t flags;
+  // variable length entries follow
+} __attribute__((packed));
+
+#define MADT_LOCAL_APIC 0
+#define MADT_LAPIC_ADDR_OVERRIDE 5
+#define MADT_LOCAL_APIC_ENABLED (1u << 0)
+
+struct MadtEntryHeader {
+  uint8_t type;
+  uint8_t length;
+} __attribute__((packed));
+
+struct MadtLocalApic {
+  struct MadtEntryHeader header;
+  uint8_t processor_id;
+  uint8_t apic_id;
+  uint32_t flags;
+} __attribute__((packed));
+
+struct MadtLapicAddrOverride {
+  struct MadtEntryHeader header;
+  uint16_t reserved;
+  uint64_t lapic_addr;
+} __attribute__((packed));
+
+static bool checksum_ok(const void *data, size_t len) {
+  uint8_t sum = 0;
+  for (size_t i = 0; i < len; ++i) {
+    sum += ((const uint8_t *)data)[i];
+  }
+  return sum == 0;
+}
+
+static bool signature_is(const char *signature, const char *expected,
+                         size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (signature[i] != expected[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// firmware tables usually sit just past the usable memory the direct map
+// ends at, so each one is mapped before it's read. Its length is only known
+// once the header is
+static struct AcpiSdtHeader *map_table(uint64_t addr) {
+  struct PageEntry *table = (struct PageEntry *)get_current_page_table();
+  struct AcpiSdtHeader *header = (struct AcpiSdtHeader *)addr;
+  if (!page_table_map_phys(table, header, sizeof(*header), false) ||
+      !page_table_map_phys(table, header, header->length, false)) {
+    return NULL;
+  }
+  if (!checksum_ok(header, header->length)) {
+    printk("acpi: bad checksum on %lx\n", addr);
+    return NULL;
+  }
+  return header;
+}
+
+// looks through the XSDT if there is one and the RSDT otherwise
+static struct AcpiSdtHeader *find_table(const char *signature) {
+  struct AcpiRsdp *rsdp = multiboot_get_rsdp();
+  if (rsdp == NULL || !signature_is(rsdp->signature, "RSD PTR ", 8)) {
+    return NULL;
+  }
+  bool extended = rsdp->revision >= 2 && rsdp->xsdt_addr != 0;
+  struct AcpiSdtHeader *root =
+      map_table(extended ? rsdp->xsdt_addr : rsdp->rsdt_addr);
+  if (root == NULL) {
+    return NULL;
+  }
+  size_t entry_size = extended ? sizeof(uint64_t) : sizeof(uint32_t);
+  size_t num_entries = (root->length - sizeof(*root)) / entry_size;
+  uint8_t *entries = (uint8_t *)(root + 1);
+  for (size_t i = 0; i < num_entries; ++i) {
+    uint64_t addr = extended ? ((uint64_t *)entries)[i]
+                             : ((uint32_t *)entries)[i];
+    struct AcpiSdtHeader *header = map_table(addr);
+    if (header != NULL && signature_is(header->signature, signature, 4)) {
+      return header;
+    }
+  }
+  return NULL;
+}
+
+bool ACPI_read_madt(struct AcpiMadtInfo *info) {
+  struct AcpiMadt *madt = (struct AcpiMadt *)find_table("APIC");
+  if (madt == NULL) {
+    return false;
+  }
+  info->lapic_addr = madt->lapic_addr;
+  info->num_cpus = 0;
+  uint8_t *entry = (uint8_t *)(madt + 1);
+  uint8_t *end = (uint8_t *)madt + madt->header.length;
+  while (entry + sizeof(struct MadtEntryHeader) <= end) {
+    struct MadtEntryHeader *header = (struct MadtEntryHeader *)entry;
+    if (header->length == 0) {
+      break;
+    }
+    if (header->type == MADT_LOCAL_APIC) {
+      struct MadtLocalApic *lapic = (struct MadtLocalApic *)entry;
+      if ((lapic->flags & MADT_LOCAL_APIC_ENABLED) &&
+          info->num_cpus < CPU_MAX) {
+        info->apic_ids[info->num_cpus++] = lapic->apic_id;
+      }
+    } else if (header->type == MADT_LAPIC_ADDR_OVERRIDE) {
+      info->lapic_addr =
+          ((struct MadtLapicAddrOverride *)entry)->lapic_addr;
+    }
+    entry += header->length;
+  }
+  printk("acpi: MADT lists %lu usable CPUs, local APIC at %lx\n",
+         info->num_cpus, info->lapic_addr);
+  return true;
+}
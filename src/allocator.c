@@ -1,88 +1,215 @@
 #include "allocator.h"
+#include "cpu.h"
+#include "kmalloc_profile.h"
+#include "meminfo.h"
 #include "page_allocator.h"
+#include "page_table.h"
+#include "slab.h"
 #include "smolassert.h"
+#include "vmalloc.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-struct FreeList {
-  struct FreeList *next;
-};
-
-struct KmallocPool {
-  size_t max_size;
-  struct FreeList *head;
-};
-
-struct KmallocHeader {
-  struct KmallocPool *pool;
-  size_t size;
-} __attribute__((packed));
-
-static void pool_allocate_page(struct KmallocPool *pool) {
-  void *page = MMU_alloc_page();
-  assert(MMU_PAGE_SIZE % (pool->max_size + sizeof(struct KmallocHeader)) == 0 &&
-         "pool size must be a multiple of block size");
-  for (void *block = page; block < page + MMU_PAGE_SIZE;
-       block += pool->max_size + sizeof(struct KmallocHeader)) {
-    struct FreeList *free_node = (struct FreeList *)block;
-    free_node->next = pool->head;
-    pool->head = free_node;
-  }
-}
+// multiples of 8 up to 64, then 8 steps per doubling up to the largest class,
+// which keeps the worst case waste of a class to about 1/8th
+#define KMALLOC_ALIGN 8
+#define KMALLOC_LINEAR_MAX 64
+#define KMALLOC_STEPS_PER_DOUBLING 8
+#define KMALLOC_MAX_CLASS_SIZE 2048
+#define KMALLOC_MAX_CLASSES 64
+// allocations up to this many pages come straight from the frame allocator,
+// anything bigger is stitched together on the heap by vmalloc
+#define KMALLOC_MAX_EXACT_PAGES 16
 
-size_t block_sizes[] = {32, 64, 128, 512, 1024, 2048};
-#define BLOCK_SIZES_LEN (sizeof(block_sizes) / sizeof(*block_sizes))
+static size_t kmalloc_sizes[KMALLOC_MAX_CLASSES];
+static struct KmemCache *kmalloc_caches[KMALLOC_MAX_CLASSES];
+static size_t kmalloc_num_classes = 0;
+// class index for every size rounded up to KMALLOC_ALIGN
+static uint8_t size_to_class[KMALLOC_MAX_CLASS_SIZE / KMALLOC_ALIGN + 1];
 
-static struct KmallocPool pools[BLOCK_SIZES_LEN];
+static void add_class(size_t size) {
+  assert(kmalloc_num_classes < KMALLOC_MAX_CLASSES && "Too many size classes");
+  size_t i = kmalloc_num_classes++;
+  kmalloc_sizes[i] = size;
+  kmalloc_caches[i] = kmem_cache_create("kmalloc", size, 0, NULL);
+  assert(kmalloc_caches[i] != NULL && "Out of memory for kmalloc caches");
+}
 
 void init_alloc() {
-  for (size_t i = 0; i < BLOCK_SIZES_LEN; ++i) {
-    struct KmallocPool *pool = &pools[i];
-    pool->max_size = block_sizes[i] - sizeof(struct KmallocHeader);
-    pool->head = NULL;
+  slab_init();
+  vmalloc_init();
+  for (size_t size = KMALLOC_ALIGN; size <= KMALLOC_LINEAR_MAX;
+       size += KMALLOC_ALIGN) {
+    add_class(size);
+  }
+  for (size_t base = KMALLOC_LINEAR_MAX; base < KMALLOC_MAX_CLASS_SIZE;
+       base *= 2) {
+    for (size_t step = 1; step <= KMALLOC_STEPS_PER_DOUBLING; ++step) {
+      add_class(base + step * (base / KMALLOC_STEPS_PER_DOUBLING));
+    }
+  }
+  size_t class = 0;
+  for (size_t i = 0; i <= KMALLOC_MAX_CLASS_SIZE / KMALLOC_ALIGN; ++i) {
+    while (kmalloc_sizes[class] < i * KMALLOC_ALIGN) {
+      ++class;
+    }
+    size_to_class[i] = class;
   }
 }
 
+static void *kmalloc_untracked(size_t size) {
+  if (size <= KMALLOC_MAX_CLASS_SIZE) {
+    size_t class = size_to_class[(size + KMALLOC_ALIGN - 1) / KMALLOC_ALIGN];
+    return kmem_cache_alloc(kmalloc_caches[class]);
+  }
+
+  size_t num_pages = size / MMU_PAGE_SIZE + !!(size % MMU_PAGE_SIZE);
+  if (num_pages <= KMALLOC_MAX_EXACT_PAGES) {
+    void *addr = MMU_pf_alloc_exact(num_pages);
+    if (addr == NULL) {
+      return NULL;
+    }
+    struct PageFrame *frame = MMU_pf_frame(addr);
+    frame->flags |= PF_FLAG_KMALLOC;
+    frame->kmalloc_pages = num_pages;
+    MEMINFO_add(MEMSTAT_KMALLOC_PAGES, num_pages);
+    return addr;
+  }
+
+  // buffers this big are worth a TLB entry per 2 MiB instead of per page
+  return vmalloc_flags(size, size >= MMU_HUGE_PAGE_SIZE ? VMALLOC_HUGE : 0);
+}
+
 void *kmalloc(size_t size) {
-  // find pool
-  size_t i;
-  struct KmallocPool *pool;
-  for (i = 0, pool = pools; i < BLOCK_SIZES_LEN && size > pool->max_size;
-       ++i, ++pool)
-    ;
-  // one of the pools is large enough, otherwise dedicated allocation
-  if (i < BLOCK_SIZES_LEN) {
-    if (pool->head == NULL) {
-      pool_allocate_page(pool);
+  void *addr = kmalloc_untracked(size);
+  kmalloc_profile_alloc(addr, size, __builtin_return_address(0));
+  return addr;
+}
+
+size_t ksize(void *addr) {
+  if (addr < ADDR_SPACE_KERNEL_HEAP_BASE) {
+    struct PageFrame *frame = MMU_pf_frame(addr);
+    if (frame->flags & PF_FLAG_SLAB) {
+      return frame->slab_cache->size;
     }
-    void *addr = pool->head;
-    pool->head = pool->head->next;
-    struct KmallocHeader *header = addr;
-    header->pool = pool;
-    header->size = 0;
-    return addr + sizeof(struct KmallocHeader);
-  } else {
-    size += sizeof(struct KmallocHeader);
-    size_t num_pages = size / MMU_PAGE_SIZE + !!(size % MMU_PAGE_SIZE);
-    void *addr = MMU_alloc_pages(num_pages);
-    struct KmallocHeader *header = addr;
-    header->pool = NULL;
-    header->size = size;
-    return addr + sizeof(struct KmallocHeader);
+    return frame->kmalloc_pages * MMU_PAGE_SIZE;
   }
+  return vmalloc_size(addr);
 }
 
 void kfree(void *addr) {
-  void *block = (addr - sizeof(struct KmallocHeader));
-  struct KmallocHeader header = *(struct KmallocHeader *)block;
-  if (header.pool != NULL) {
-    struct FreeList *free_node = (struct FreeList *)block;
-    free_node->next = header.pool->head;
-    header.pool->head = free_node;
-  } else {
-    size_t num_pages =
-        header.size / MMU_PAGE_SIZE + !!(header.size % MMU_PAGE_SIZE);
-    MMU_free_pages(addr, num_pages);
+  if (addr == NULL) {
+    return;
+  }
+  kmalloc_profile_free(addr);
+  // objects in the direct map know their owner from the frame table
+  if (addr < ADDR_SPACE_KERNEL_HEAP_BASE) {
+    struct PageFrame *frame = MMU_pf_frame(addr);
+    if (frame->flags & PF_FLAG_SLAB) {
+      kmem_cache_free(frame->slab_cache, addr);
+      return;
+    }
+    assert((frame->flags & PF_FLAG_KMALLOC) && "kfree of a foreign pointer");
+    size_t num_pages = frame->kmalloc_pages;
+    frame->flags &= ~PF_FLAG_KMALLOC;
+    MMU_pf_free_exact(addr, num_pages);
+    MEMINFO_add(MEMSTAT_KMALLOC_PAGES, -(long)num_pages);
+    return;
+  }
+  vfree(addr);
+}
+
+void *krealloc(void *addr, size_t size) {
+  void *caller = __builtin_return_address(0);
+  if (addr == NULL) {
+    void *new_addr = kmalloc_untracked(size);
+    kmalloc_profile_alloc(new_addr, size, caller);
+    return new_addr;
+  }
+  if (size == 0) {
+    kfree(addr);
+    return NULL;
+  }
+  size_t old_size = ksize(addr);
+  // heap allocations can often just take over the address space after them
+  if (size <= old_size ||
+      (addr >= ADDR_SPACE_KERNEL_HEAP_BASE && vmalloc_grow(addr, size))) {
+    kmalloc_profile_resize(addr, size);
+    return addr;
+  }
+  void *new_addr = kmalloc_untracked(size);
+  if (new_addr == NULL) {
+    return NULL;
   }
+  kmalloc_profile_alloc(new_addr, size, caller);
+  memcpy(new_addr, addr, old_size);
+  kfree(addr);
+  return new_addr;
+}
+
+#ifdef KMALLOC_BENCH
+#define BENCH_SLOTS 512
+#define BENCH_ROUNDS 200000
+static void *bench_ptrs[BENCH_SLOTS];
+static uint64_t bench_state = 88172645463325252lu;
+
+// sizes the kernel itself asks for while booting and reading files: thread
+// and ATA request nodes, page cache and radix tree nodes, dir entry names,
+// ext2 blocks and inodes, the MBR, read buffers and thread stacks
+static const size_t bench_trace[] = {
+    24, 24, 24, 40, 40, 80, 80, 80, 520, 520, 16, 16,
+    48, 128, 512, 1024, 1024, 7000, 8192, 8, 12, 20, 6};
+#define BENCH_TRACE_LEN (sizeof(bench_trace) / sizeof(*bench_trace))
+
+static uint64_t bench_rand() {
+  bench_state ^= bench_state << 13;
+  bench_state ^= bench_state >> 7;
+  bench_state ^= bench_state << 17;
+  return bench_state;
+}
+
+static size_t bench_size(bool from_trace) {
+  if (from_trace) {
+    return bench_trace[bench_rand() % BENCH_TRACE_LEN];
+  }
+  // log uniform over the slab classes, 8 bytes to 2 KiB
+  int shift = 3 + bench_rand() % 8;
+  return (1lu << shift) + bench_rand() % (1lu << shift);
+}
+
+static void bench_run(const char *name, bool from_trace) {
+  uint64_t requested = 0, allocated = 0, num_allocs = 0;
+  uint64_t start = rdtsc();
+  for (int round = 0; round < BENCH_ROUNDS; ++round) {
+    size_t slot = bench_rand() % BENCH_SLOTS;
+    if (bench_ptrs[slot] != NULL) {
+      kfree(bench_ptrs[slot]);
+      bench_ptrs[slot] = NULL;
+    } else {
+      size_t size = bench_size(from_trace);
+      bench_ptrs[slot] = kmalloc(size);
+      assert(bench_ptrs[slot] != NULL && "Benchmark ran out of memory");
+      requested += size;
+      allocated += ksize(bench_ptrs[slot]);
+      num_allocs += 1;
+    }
+  }
+  uint64_t cycles = rdtsc() - start;
+  for (size_t slot = 0; slot < BENCH_SLOTS; ++slot) {
+    kfree(bench_ptrs[slot]);
+    bench_ptrs[slot] = NULL;
+  }
+  uint64_t waste = (allocated - requested) * 1000 / allocated;
+  printk("kmalloc bench (%s): %lu allocations, %lu cycles/op, internal "
+         "fragmentation %lu.%lu%%\n",
+         name, num_allocs, cycles / BENCH_ROUNDS, waste / 10, waste % 10);
+}
+
+void kmalloc_bench() {
+  bench_run("kernel trace", true);
+  bench_run("log uniform", false);
 }
+#endif
@@ -0,0 +1,100 @@
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_cr3
+global ap_trampoline_stack
+global ap_trampoline_entry
+global ap_trampoline_arg
+
+extern p4_table
+
+;; the BSP copies everything between start and end to AP_BASE, and the
+;; startup IPI points the APs at that page in real mode
+AP_BASE equ 0x8000
+%define AP_ADDR(label) (AP_BASE + (label) - ap_trampoline_start)
+
+section .text
+bits 16
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [AP_ADDR(ap_gdt.pointer)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword ap_gdt.code32:AP_ADDR(ap_protected_mode)
+
+bits 32
+ap_protected_mode:
+    mov ax, ap_gdt.data
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; PAE
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+
+    ; the boot page tables are below 4 GiB so they fit in a 32 bit cr3, and
+    ; identity map the first GiB this code and the kernel run from
+    mov eax, p4_table
+    mov cr3, eax
+
+    ; long mode
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, 1 << 8
+    wrmsr
+
+    mov eax, cr0
+    or eax, 1 << 31
+    mov cr0, eax
+
+    jmp ap_gdt.code64:AP_ADDR(ap_long_mode)
+
+bits 64
+ap_long_mode:
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; now the kernel's own tables, which can live anywhere
+    mov rax, [AP_ADDR(ap_trampoline_cr3)]
+    mov cr3, rax
+    mov rsp, [AP_ADDR(ap_trampoline_stack)]
+    mov rdi, [AP_ADDR(ap_trampoline_arg)]
+    mov rax, [AP_ADDR(ap_trampoline_entry)]
+    call rax
+.hang:
+    hlt
+    jmp .hang
+
+align 8
+;; the 64 bit code segment sits where the kernel GDT has its own, so cs stays
+;; valid once the AP loads that one
+ap_gdt:
+    dq 0
+.code64: equ $ - ap_gdt
+    dq (1<<43) | (1<<44) | (1<<47) | (1<<53)
+.code32: equ $ - ap_gdt
+    dq 0x00CF9A000000FFFF
+.data: equ $ - ap_gdt
+    dq 0x00CF92000000FFFF
+.pointer:
+    dw $ - ap_gdt - 1
+    dd AP_ADDR(ap_gdt)
+
+;; filled in by the BSP before each AP is started
+align 8
+ap_trampoline_cr3:
+    dq 0
+ap_trampoline_stack:
+    dq 0
+ap_trampoline_entry:
+    dq 0
+ap_trampoline_arg:
+    dq 0
+ap_trampoline_end:
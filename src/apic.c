@@ -0,0 +1,140 @@
+#include "apic.h"
+#include "cpu.h"
+#include "page_table.h"
+#include "printk.h"
+#include "smolassert.h"
+#include "timer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define APIC_REG_ID 0x20
+#define APIC_REG_TPR 0x80
+#define APIC_REG_EOI 0xB0
+#define APIC_REG_SPURIOUS 0xF0
+#define APIC_REG_ICR_LOW 0x300
+#define APIC_REG_ICR_HIGH 0x310
+#define APIC_REG_LVT_TIMER 0x320
+#define APIC_REG_TIMER_INITIAL 0x380
+#define APIC_REG_TIMER_CURRENT 0x390
+#define APIC_REG_TIMER_DIVIDE 0x3E0
+
+#define APIC_SPURIOUS_ENABLE 0x100
+#define APIC_ICR_PENDING (1u << 12)
+#define APIC_LVT_MASKED (1u << 16)
+#define APIC_TIMER_PERIODIC (1u << 17)
+#define APIC_TIMER_TSC_DEADLINE (2u << 17)
+#define MSR_TSC_DEADLINE 0x6E0
+#define CPUID_ECX_TSC_DEADLINE (1u << 24)
+#define APIC_TIMER_DIVIDE_16 0x3
+#define APIC_REGS_SIZE 0x1000
+// ticks the calibration runs for
+#define APIC_CALIBRATE_TICKS 10
+
+static volatile uint32_t *regs = NULL;
+static uint32_t timer_count_per_tick = 0;
+static bool tsc_deadline = false;
+
+static inline uint32_t apic_read(uint32_t reg) { return regs[reg / 4]; }
+
+static inline void apic_write(uint32_t reg, uint32_t value) {
+  regs[reg / 4] = value;
+}
+
+void APIC_init(uintptr_t base) {
+  // firmware sets the MTRRs so the register window is uncached
+  bool mapped = page_table_map_phys(
+      (struct PageEntry *)get_current_page_table(), (void *)base,
+      APIC_REGS_SIZE, true);
+  assert(mapped && "Couldn't map the local APIC");
+  regs = (volatile uint32_t *)base;
+  APIC_enable();
+}
+
+void APIC_enable() {
+  apic_write(APIC_REG_TPR, 0);
+  apic_write(APIC_REG_SPURIOUS, APIC_SPURIOUS_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+uint32_t APIC_id() { return apic_read(APIC_REG_ID) >> 24; }
+
+void APIC_eoi() { apic_write(APIC_REG_EOI, 0); }
+
+static void wait_icr_idle() {
+  while (apic_read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING) {
+    asm volatile("pause");
+  }
+}
+
+void APIC_send_ipi(uint32_t apic_id, uint32_t icr) {
+  wait_icr_idle();
+  apic_write(APIC_REG_ICR_HIGH, apic_id << 24);
+  // writing the low half sends it
+  apic_write(APIC_REG_ICR_LOW, icr);
+  wait_icr_idle();
+}
+
+void APIC_send_ipi_others(uint32_t icr) {
+  wait_icr_idle();
+  apic_write(APIC_REG_ICR_LOW, icr | APIC_ICR_ALL_BUT_SELF);
+  wait_icr_idle();
+}
+
+void APIC_timer_calibrate() {
+  apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+  apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED);
+  // start on a tick edge so the whole window is measured
+  uint64_t start = TIMER_ticks();
+  while (TIMER_ticks() == start) {
+    asm volatile("pause");
+  }
+  apic_write(APIC_REG_TIMER_INITIAL, UINT32_MAX);
+  while (TIMER_ticks() < start + 1 + APIC_CALIBRATE_TICKS) {
+    asm volatile("pause");
+  }
+  uint32_t elapsed = UINT32_MAX - apic_read(APIC_REG_TIMER_CURRENT);
+  apic_write(APIC_REG_TIMER_INITIAL, 0);
+  timer_count_per_tick = elapsed / APIC_CALIBRATE_TICKS;
+  tsc_deadline = cpuid(1, 0).ecx & CPUID_ECX_TSC_DEADLINE;
+  printk("apic: timer runs %u counts a tick%s\n", timer_count_per_tick,
+         tsc_deadline ? ", has a TSC deadline" : "");
+}
+
+bool APIC_has_tsc_deadline() { return tsc_deadline; }
+
+void APIC_timer_start(uint8_t vector) {
+  assert(timer_count_per_tick > 0 && "APIC timer wasn't calibrated");
+  apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+  apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_PERIODIC | vector);
+  apic_write(APIC_REG_TIMER_INITIAL, timer_count_per_tick);
+}
+
+void APIC_timer_oneshot(uint8_t vector, uint64_t deadline_ns) {
+  if (tsc_deadline) {
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_TSC_DEADLINE | vector);
+    // the mode switch has to be seen before the MSR write arms it
+    asm volatile("mfence" : : : "memory");
+    wrmsr(MSR_TSC_DEADLINE, TIMER_ns_to_tsc(deadline_ns));
+    return;
+  }
+  uint64_t now = TIMER_ns();
+  uint64_t delay = deadline_ns > now ? deadline_ns - now : 0;
+  uint64_t max_delay = UINT32_MAX / timer_count_per_tick * TIMER_NS_PER_TICK;
+  if (delay > max_delay) {
+    delay = max_delay;
+  }
+  uint64_t count = delay * timer_count_per_tick / TIMER_NS_PER_TICK;
+  apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+  apic_write(APIC_REG_LVT_TIMER, vector);
+  // a count of 0 never fires
+  apic_write(APIC_REG_TIMER_INITIAL, count > 0 ? count : 1);
+}
+
+void APIC_timer_stop() {
+  apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED);
+  apic_write(APIC_REG_TIMER_INITIAL, 0);
+  if (tsc_deadline) {
+    wrmsr(MSR_TSC_DEADLINE, 0);
+  }
+}
@@ -4,8 +4,10 @@
 #include "portio.h"
 #include "printk.h"
 #include "processes.h"
+#include "slab.h"
 #include "smolassert.h"
 #include "string.h"
+#include "timer.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -39,6 +41,25 @@
 
 #define BLOCK_SIZE 512
 
+// how long a drive gets to drop BSY, and to answer a read
+#define ATA_BUSY_TIMEOUT_NS (TIMER_NS_PER_SEC / 10)
+#define ATA_READ_TIMEOUT_NS TIMER_NS_PER_SEC
+
+// polls status_port until BSY clears, returns the last status or 0 if it
+// never did
+static uint8_t ata_wait_not_busy(uint16_t status_port) {
+  uint64_t deadline = TIMER_ns() + ATA_BUSY_TIMEOUT_NS;
+  uint8_t status = inb(status_port);
+  while (status & STATUS_BSY) {
+    if (TIMER_ns() >= deadline) {
+      printk("ATA drive stayed busy\n");
+      return 0;
+    }
+    status = inb(status_port);
+  }
+  return status;
+}
+
 void ata_soft_reset(uint16_t ctl_base, bool interrupts) {
   outb(ctl_base + REG_DEV_CTL, 0x4);
   outb(ctl_base + REG_DEV_CTL, 0x0 | !interrupts);
@@ -77,8 +98,9 @@ uint64_t dev_identify(uint16_t base) {
   outw(base + REG_CMD, CMD_IDENTIFY);
   uint8_t status = inb(base + REG_STATUS);
   assert(status != 0 && "ATA Device wasn't present actually");
-  while (status & STATUS_BSY) {
-    status = inb(base + REG_STATUS);
+  status = ata_wait_not_busy(base + REG_STATUS);
+  if (status == 0) {
+    return 0;
   }
   /* assert(inw(base + REG_CYL_LO) == 0 && inw(base + REG_CYL_HI) == 0 && */
   /*        "This isn't a real ATA device"); */
@@ -97,6 +119,10 @@ uint64_t dev_identify(uint16_t base) {
   return sectors;
 }
 
+static struct KmemCache *ata_request_cache;
+static struct LockClass ata_lock_class = LOCK_CLASS_INIT("ata");
+static struct WakeLatency ata_latency;
+
 void ata_req_queue(struct ATABlockDevice *ata, struct ATARequest *req) {
   req->next = NULL;
   if (ata->req_tail != NULL) {
@@ -122,14 +148,13 @@ struct ATARequest *ata_req_unqueue(struct ATABlockDevice *ata) {
   return req;
 }
 
-void ata_req_execute(struct ATABlockDevice *ata, struct ATARequest *req) {
+bool ata_req_execute(struct ATABlockDevice *ata, struct ATARequest *req) {
   /* printk("reading: %lu\n", req->blk_num); */
   /* printk("next req: %lx\n", ata->req_head); */
   uint16_t sector_count = 1;
   outb(ata->ata_base + REG_DEVSEL, 0x40 | ata->slave << 4);
-  uint8_t status = inb(ata->ata_base + REG_ALT_STS);
-  while (status & STATUS_BSY) {
-    status = inb(ata->ata_base + REG_ALT_STS);
+  if (ata_wait_not_busy(ata->ata_base + REG_ALT_STS) == 0) {
+    return false;
   }
   outb(ata->ata_base + REG_SEC_CNT, sector_count >> 8);
   outb(ata->ata_base + REG_SEC_NUM, (req->blk_num >> 24) & 0xFF);
@@ -140,45 +165,78 @@ void ata_req_execute(struct ATABlockDevice *ata, struct ATARequest *req) {
   outb(ata->ata_base + REG_CYL_LO, (req->blk_num >> 8) & 0xFF);
   outb(ata->ata_base + REG_CYL_HI, (req->blk_num >> 16) & 0xFF);
   outb(ata->ata_base + REG_CMD, CMD_READ_SECTORS_EXT);
+  return true;
 }
 
-void ata_req_queue_execute(struct ATABlockDevice *ata, struct ATARequest *req) {
+bool ata_req_queue_execute(struct ATABlockDevice *ata, struct ATARequest *req) {
   if (ata->req_head == NULL) {
     ata_req_queue(ata, req);
-    ata_req_execute(ata, req);
+    return ata_req_execute(ata, req);
   } else {
     ata_req_queue(ata, req);
+    return true;
   }
 }
 
+// a late or stray completion only makes the reader look at the status again
+static void read_block_done(void *arg) {
+  struct ATABlockDevice *ata = (struct ATABlockDevice *)arg;
+  PROC_wake(&ata->block_queue, PROC_WAKE_HANDOFF);
+}
+
 void read_block_handler(int number, int error_code, void *arg) {
   struct ATABlockDevice *ata = (struct ATABlockDevice *)arg;
   (void)inb(ata->ata_base + REG_STATUS);
-  if (ata->req_head->block_queue.head) {
-    PROC_unblock_head(&ata->req_head->block_queue);
-  }
+  ata->completed_at = rdtsc();
   PIC_sendEOI(number);
+  IRQ_raise_softirq(&ata->done);
 }
 
 int ata_48_read_block(struct BlockDevice *this, uint64_t blk_num, void *dst) {
   struct ATABlockDevice *ata = (struct ATABlockDevice *)this;
-  struct ATARequest *req = kmalloc(sizeof(*req));
+  struct ATARequest *req = kmem_cache_alloc(ata_request_cache);
+  if (req == NULL) {
+    return 0;
+  }
   req->blk_num = blk_num;
-  PROC_init_queue(&req->block_queue);
-  CLI;
-  ata_req_queue_execute(ata, req);
+  kmutex_lock(&ata->lock);
+  ata->completed_at = 0;
+  // the busy poll can take a while, so only the drive's own lock is held for
+  // it. The status is checked again under the wait lock before blocking, so
+  // a completion in between isn't missed
+  if (!ata_req_queue_execute(ata, req)) {
+    kmem_cache_free(ata_request_cache, ata_req_unqueue(ata));
+    kmutex_unlock(&ata->lock);
+    return 0;
+  }
+  PROC_wait_lock();
   uint8_t status = inb(ata->ata_master + REG_ALT_STS);
   while ((status & STATUS_BSY) || !(status & (STATUS_DRQ | STATUS_ERR))) {
-    PROC_block_on(&ata->req_head->block_queue, true);
-    CLI;
+    if (!PROC_block_on_timeout(&ata->block_queue, true,
+                               ATA_READ_TIMEOUT_NS)) {
+      printk("ATA read of block %lu timed out\n", blk_num);
+      // the command may still be in flight, so the drive is reset before
+      // the next reader can issue one of its own
+      ata_soft_reset(ata->ata_master, true);
+      ata_wait_not_busy(ata->ata_master + REG_ALT_STS);
+      kmem_cache_free(ata_request_cache, ata_req_unqueue(ata));
+      kmutex_unlock(&ata->lock);
+      return 0;
+    }
+    PROC_wait_lock();
     status = inb(ata->ata_master + REG_ALT_STS);
   }
-  STI;
+  PROC_wait_unlock();
   for (size_t i = 0; i < ata->dev.blk_size / sizeof(uint16_t); ++i) {
     ((uint16_t *)dst)[i] = inw(ata->ata_base + REG_DATA);
   }
+  // the drive can be done before the reader ever blocks
+  if (ata->completed_at != 0) {
+    PROC_latency_record(&ata_latency, ata->completed_at);
+  }
 
-  kfree(ata_req_unqueue(ata));
+  kmem_cache_free(ata_request_cache, ata_req_unqueue(ata));
+  kmutex_unlock(&ata->lock);
   /* if (ata->req_head != NULL) { */
   /*   ata_req_execute(ata, ata->req_head); */
   /* } */
@@ -194,7 +252,8 @@ struct BlockDevice *ata_probe(uint16_t base, uint16_t master, uint8_t slave,
     return NULL;
   }
   uint64_t sectors = dev_identify(base);
-  assert(sectors > 0 && "ATA device might not support 48 bit addressing");
+  assert(sectors > 0 &&
+         "ATA device timed out or might not support 48 bit addressing");
   printk("Found ATA device with %lx sectors\n", sectors);
   struct ATABlockDevice *ata = kmalloc(sizeof(*ata));
   memset(ata, 0, sizeof(*ata));
@@ -202,6 +261,9 @@ struct BlockDevice *ata_probe(uint16_t base, uint16_t master, uint8_t slave,
   ata->slave = slave;
   ata->ata_master = master;
   ata->irq = irq;
+  PROC_init_queue(&ata->block_queue);
+  kmutex_init(&ata->lock, &ata_lock_class);
+  IRQ_softirq_init(&ata->done, &read_block_done, ata);
   ata->dev.read_block = &ata_48_read_block;
   ata->dev.blk_size = BLOCK_SIZE;
   ata->dev.tot_length = sectors;
@@ -219,6 +281,13 @@ struct BlockDeviceRegistration {
 
 static struct BlockDeviceRegistration *registered_devs;
 
+void BLK_init() {
+  ata_request_cache =
+      kmem_cache_create("ata_request", sizeof(struct ATARequest), 0, NULL);
+}
+
+void BLK_print_latency() { PROC_latency_print("ata", &ata_latency); }
+
 int BLK_register(struct BlockDevice *dev) {
   struct BlockDeviceRegistration *dev_reg = kmalloc(sizeof(*dev_reg));
   dev_reg->dev = dev;
@@ -1,5 +1,6 @@
 global start
 global multiboot_tag_addr
+global p4_table
 extern long_mode_start
 
 section .text
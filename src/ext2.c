@@ -4,7 +4,11 @@
 #include "block_device.h"
 #include "fs.h"
 #include "mbr.h"
+#include "page_allocator.h"
+#include "page_cache.h"
 #include "printk.h"
+#include "slab.h"
+#include "smolassert.h"
 #include "vfs.h"
 
 #include <stdint.h>
@@ -146,29 +150,40 @@ struct Ext2VfsInode {
   struct Ext2VfsSuperBlock *vsb;
 };
 
-void read_inode_block(struct Ext2VfsInode *vino, uint64_t block, void *dst) {
+static struct KmemCache *ext2_inode_cache;
+
+// false if it or any indirect block on the way couldn't be read
+bool read_inode_block(struct Ext2VfsInode *vino, uint64_t block, void *dst) {
   uint64_t num_indirect_per = vino->vsb->block_size / sizeof(uint32_t);
   if (block < NUM_DIRECT_BLOCKS) {
-    ext2_read_block(vino->vsb, vino->ext_in->direct_blocks[block], dst);
+    return ext2_read_block(vino->vsb, vino->ext_in->direct_blocks[block], dst);
   } else if (block - NUM_DIRECT_BLOCKS < num_indirect_per) {
     uint32_t *indirect_block = kmalloc(vino->vsb->block_size);
-    ext2_read_block(vino->vsb, vino->ext_in->singly_indirect_block,
-                    indirect_block);
-    ext2_read_block(vino->vsb, indirect_block[block - NUM_DIRECT_BLOCKS], dst);
+    bool success =
+        indirect_block != NULL &&
+        ext2_read_block(vino->vsb, vino->ext_in->singly_indirect_block,
+                        indirect_block) &&
+        ext2_read_block(vino->vsb, indirect_block[block - NUM_DIRECT_BLOCKS],
+                        dst);
     kfree(indirect_block);
+    return success;
   } else if (block - NUM_DIRECT_BLOCKS - num_indirect_per <
              num_indirect_per * num_indirect_per) {
     uint64_t off = block - NUM_DIRECT_BLOCKS - num_indirect_per;
     uint64_t single_off = off / num_indirect_per;
     uint64_t double_off = off % num_indirect_per;
     uint32_t *indirect_block = kmalloc(vino->vsb->block_size);
-    ext2_read_block(vino->vsb, vino->ext_in->singly_indirect_block,
-                    indirect_block);
     uint32_t *indirecter_block = kmalloc(vino->vsb->block_size);
-    ext2_read_block(vino->vsb, indirect_block[single_off], indirecter_block);
-    ext2_read_block(vino->vsb, indirect_block[double_off], dst);
+    bool success =
+        indirect_block != NULL && indirecter_block != NULL &&
+        ext2_read_block(vino->vsb, vino->ext_in->doubly_indirect_block,
+                        indirect_block) &&
+        ext2_read_block(vino->vsb, indirect_block[single_off],
+                        indirecter_block) &&
+        ext2_read_block(vino->vsb, indirecter_block[double_off], dst);
     kfree(indirect_block);
     kfree(indirecter_block);
+    return success;
   } else if (block - NUM_DIRECT_BLOCKS - num_indirect_per -
                  num_indirect_per * num_indirect_per <
              num_indirect_per * num_indirect_per * num_indirect_per) {
@@ -179,22 +194,29 @@ void read_inode_block(struct Ext2VfsInode *vino, uint64_t block, void *dst) {
     uint64_t triple_off = double_off / num_indirect_per;
     uint64_t quad_off = double_off % num_indirect_per;
     uint32_t *indirect_block = kmalloc(vino->vsb->block_size);
-    ext2_read_block(vino->vsb, vino->ext_in->doubly_indirect_block,
-                    indirect_block);
     uint32_t *indirecter_block = kmalloc(vino->vsb->block_size);
-    ext2_read_block(vino->vsb, indirect_block[single_off], indirecter_block);
     uint32_t *indirecterer_block = kmalloc(vino->vsb->block_size);
-    ext2_read_block(vino->vsb, indirecter_block[triple_off], indirecter_block);
-    ext2_read_block(vino->vsb, indirect_block[quad_off], dst);
+    bool success =
+        indirect_block != NULL && indirecter_block != NULL &&
+        indirecterer_block != NULL &&
+        ext2_read_block(vino->vsb, vino->ext_in->triply_indirect_block,
+                        indirect_block) &&
+        ext2_read_block(vino->vsb, indirect_block[single_off],
+                        indirecter_block) &&
+        ext2_read_block(vino->vsb, indirecter_block[triple_off],
+                        indirecterer_block) &&
+        ext2_read_block(vino->vsb, indirecterer_block[quad_off], dst);
     kfree(indirect_block);
     kfree(indirecter_block);
     kfree(indirecterer_block);
+    return success;
   }
+  return false;
 }
 
 int readdir(struct Inode *inode, readdir_cb cb, void *arg) {
   struct Ext2VfsInode *vino = (struct Ext2VfsInode *)inode;
-  if (!(inode->st_mode & 0x4000)) {
+  if (!(inode->st_mode & VFS_MODE_DIR)) {
     return false;
   }
 
@@ -202,7 +224,10 @@ int readdir(struct Inode *inode, readdir_cb cb, void *arg) {
                         !!(vino->in.st_size % vino->vsb->block_size);
   void *content_block = kmalloc(vino->vsb->block_size);
   for (int i = 0; i < num_blocks; ++i) {
-    read_inode_block(vino, i, content_block);
+    if (!read_inode_block(vino, i, content_block)) {
+      kfree(content_block);
+      return false;
+    }
     struct Ext2DirEntryHeader *header = content_block;
     while ((void *)header < content_block + vino->vsb->block_size &&
            header->ino != 0) {
@@ -226,9 +251,30 @@ int readdir(struct Inode *inode, readdir_cb cb, void *arg) {
 
 struct File *ext2_file_open(struct Inode *inode);
 
+// reads the blocks backing one page of the file, zeroing past the end
+int ext2_readpage(struct Inode *inode, uint64_t index, void *dst) {
+  struct Ext2VfsInode *vino = (struct Ext2VfsInode *)inode;
+  uint64_t block_size = vino->vsb->block_size;
+  uint64_t blocks_per_page = MMU_PAGE_SIZE / block_size;
+  uint64_t num_blocks =
+      inode->st_size / block_size + !!(inode->st_size % block_size);
+  for (uint64_t i = 0; i < blocks_per_page; ++i) {
+    uint64_t block = index * blocks_per_page + i;
+    if (block < num_blocks) {
+      // a failed read mustn't be cached as the file's data
+      if (!read_inode_block(vino, block, dst + i * block_size)) {
+        return false;
+      }
+    } else {
+      memset(dst + i * block_size, 0, block_size);
+    }
+  }
+  return true;
+}
+
 struct Ext2VfsInode *ext2_vfs_inode_init(struct Ext2Inode *ext_in, ino_t ino,
                                          struct Ext2VfsSuperBlock *vsb) {
-  struct Ext2VfsInode *vin = kmalloc(sizeof(*vin));
+  struct Ext2VfsInode *vin = kmem_cache_alloc(ext2_inode_cache);
   vin->in.ino = ino;
   vin->in.st_mode = ext_in->mode;
   vin->in.st_uid = ext_in->uid;
@@ -237,6 +283,9 @@ struct Ext2VfsInode *ext2_vfs_inode_init(struct Ext2Inode *ext_in, ino_t ino,
   vin->in.open = ext2_file_open;
   vin->in.readdir = &readdir;
   vin->in.unlink = NULL;
+  vin->in.create = NULL;
+  vin->in.readpage = &ext2_readpage;
+  vin->in.sb = (struct SuperBlock *)vsb;
   vin->ext_in = ext_in;
   vin->vsb = vsb;
   return vin;
@@ -287,6 +336,8 @@ ext2_vfs_superblock_init(struct Ext2SuperBlock *ext_sb,
   vsb->sb.put_super = NULL;
   vsb->ext_sb = ext_sb;
   vsb->block_size = pow2(vsb->ext_sb->log_sub_10_block_size + 10);
+  assert(vsb->block_size <= MMU_PAGE_SIZE &&
+         "readpage expects blocks no larger than a page");
   vsb->num_groups = vsb->ext_sb->num_blocks / vsb->ext_sb->num_group_blocks +
                     !!(vsb->ext_sb->num_blocks % vsb->ext_sb->num_group_blocks);
   vsb->grp_table = grp_table;
@@ -318,48 +369,46 @@ struct SuperBlock *ext2_probe(struct BlockDevice *dev) {
 struct Ext2File {
   struct File f;
   struct Ext2VfsInode *inode;
-  int cursor;
+  off_t cursor;
 };
 
 int ext2_file_read(struct File *file, char *dst, int len) {
   struct Ext2File *exfi = (struct Ext2File *)file;
-  int bytes_read = 0;
-  int block = exfi->cursor / exfi->inode->vsb->block_size;
-  void *content_block = kmalloc(exfi->inode->vsb->block_size);
-  /* printk("%d, %d\n", start_offset, last_block_end); */
-  while (bytes_read < len && exfi->cursor < exfi->inode->in.st_size) {
-    read_inode_block(exfi->inode, block, content_block);
-    int copied;
-    if (exfi->cursor % exfi->inode->vsb->block_size != 0) {
-      int start_offset = exfi->cursor % exfi->inode->vsb->block_size;
-      memcpy(dst, content_block + start_offset,
-             exfi->inode->vsb->block_size - start_offset);
-      copied = exfi->inode->vsb->block_size - start_offset;
-    } else if (bytes_read + exfi->inode->vsb->block_size >= len) {
-      memcpy(dst, content_block, len - bytes_read);
-      copied = len - bytes_read;
-    } else if (exfi->cursor + exfi->inode->vsb->block_size >=
-               exfi->inode->in.st_size) {
-      memcpy(dst, content_block, exfi->inode->in.st_size - exfi->cursor);
-      copied = exfi->inode->in.st_size - exfi->cursor;
-    } else {
-      memcpy(dst, content_block, exfi->inode->vsb->block_size);
-      copied = exfi->inode->vsb->block_size;
-    }
-    bytes_read += copied;
-    exfi->cursor += copied;
-    dst += copied;
-    block += 1;
-  }
-  return bytes_read;
+  return page_cache_read((struct Inode *)exfi->inode, &exfi->cursor, dst, len);
+}
+
+int ext2_file_lseek(struct File *file, off_t offset) {
+  struct Ext2File *exfi = (struct Ext2File *)file;
+  exfi->cursor = offset;
+  return offset;
+}
+
+int ext2_file_mmap(struct File *file, void *addr) {
+  struct Ext2File *exfi = (struct Ext2File *)file;
+  return page_cache_mmap((struct Inode *)exfi->inode, addr);
+}
+
+int ext2_file_close(struct File **file) {
+  kfree(*file);
+  *file = NULL;
+  return true;
 }
 
 struct File *ext2_file_open(struct Inode *inode) {
   struct Ext2File *file = kmalloc(sizeof(*file));
+  file->f.close = ext2_file_close;
   file->f.read = ext2_file_read;
+  // read only for now
+  file->f.write = NULL;
+  file->f.lseek = ext2_file_lseek;
+  file->f.mmap = ext2_file_mmap;
   file->inode = (struct Ext2VfsInode *)inode;
   file->cursor = 0;
   return (struct File *)file;
 }
 
-void ext2_init() { FS_register(ext2_probe); }
+void ext2_init() {
+  ext2_inode_cache =
+      kmem_cache_create("ext2_inode", sizeof(struct Ext2VfsInode), 0, NULL);
+  FS_register(ext2_probe);
+}
@@ -1,4 +1,5 @@
 #include "gdt.h"
+#include "cpu.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -10,7 +11,8 @@
 #define DESCRIPTOR_FLAG_PRESENT (1lu << 47)
 #define DESCRIPTOR_FLAG_LONG_MODE (1lu << 53)
 
-#define GDT_SIZE 8
+// null, kernel code, then a two slot TSS descriptor per CPU
+#define GDT_SIZE (2 + 2 * CPU_MAX)
 static struct {
   uint64_t table[GDT_SIZE];
   size_t top;
@@ -1,7 +1,11 @@
 #include "interrupts.h"
+#include "cpu.h"
 #include "gdt.h"
 #include "portio.h"
+#include "preempt.h"
 #include "printk.h"
+#include "processes.h"
+#include "smolassert.h"
 
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -63,22 +67,158 @@ void unhandled_irq_handler(int number, int error_code) {
   printk("unhandled interrupt: 0x%x, code: %d\n", number, error_code);
 }
 
+// softirqs raised on each CPU and not run yet, most recent first
+static struct Softirq *softirq_pending[CPU_MAX];
+static bool softirq_running[CPU_MAX];
+
+#ifdef IRQ_STATS
+// by the power of two just above the cycles taken
+#define IRQ_STATS_BUCKETS 24
+
+struct IrqStats {
+  uint64_t off_count;
+  uint64_t off_max;
+  uint64_t off_buckets[IRQ_STATS_BUCKETS];
+  uint64_t softirqs;
+  uint64_t softirq_cycles;
+  uint64_t softirq_max;
+};
+
+static struct IrqStats irq_stats[CPU_MAX];
+
+static void record_irq_off(unsigned cpu, uint64_t cycles) {
+  struct IrqStats *stats = &irq_stats[cpu];
+  unsigned bucket = cycles == 0 ? 0 : 64 - __builtin_clzll(cycles);
+  if (bucket >= IRQ_STATS_BUCKETS) {
+    bucket = IRQ_STATS_BUCKETS - 1;
+  }
+  stats->off_count += 1;
+  stats->off_buckets[bucket] += 1;
+  if (cycles > stats->off_max) {
+    stats->off_max = cycles;
+  }
+}
+
+static void record_softirq(unsigned cpu, uint64_t cycles) {
+  struct IrqStats *stats = &irq_stats[cpu];
+  stats->softirqs += 1;
+  stats->softirq_cycles += cycles;
+  if (cycles > stats->softirq_max) {
+    stats->softirq_max = cycles;
+  }
+}
+
+void IRQ_print_stats() {
+  struct IrqStats total = {0};
+  for (unsigned cpu = 0; cpu < CPU_MAX; ++cpu) {
+    struct IrqStats *stats = &irq_stats[cpu];
+    total.off_count += stats->off_count;
+    for (unsigned i = 0; i < IRQ_STATS_BUCKETS; ++i) {
+      total.off_buckets[i] += stats->off_buckets[i];
+    }
+    if (stats->off_max > total.off_max) {
+      total.off_max = stats->off_max;
+    }
+    total.softirqs += stats->softirqs;
+    total.softirq_cycles += stats->softirq_cycles;
+    if (stats->softirq_max > total.softirq_max) {
+      total.softirq_max = stats->softirq_max;
+    }
+  }
+  printk("interrupts off, %lu handlers, max %lu cycles:\n", total.off_count,
+         total.off_max);
+  for (unsigned i = 0; i < IRQ_STATS_BUCKETS; ++i) {
+    if (total.off_buckets[i] != 0) {
+      printk("  under %lu cycles: %lu\n", 1ul << i, total.off_buckets[i]);
+    }
+  }
+  printk("softirqs: %lu, avg %lu max %lu cycles with interrupts on\n",
+         total.softirqs, total.softirq_cycles / (total.softirqs | 1),
+         total.softirq_max);
+}
+#endif
+
+void IRQ_softirq_init(struct Softirq *softirq, void (*fn)(void *arg),
+                      void *arg) {
+  softirq->next = NULL;
+  softirq->fn = fn;
+  softirq->arg = arg;
+  softirq->pending = false;
+}
+
+void IRQ_raise_softirq(struct Softirq *softirq) {
+  assert(IRQ_in_interrupt() && "softirq raised outside an interrupt");
+  // already queued, maybe on another CPU, and not started yet
+  if (__atomic_exchange_n(&softirq->pending, true, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  unsigned cpu = CPU_id();
+  softirq->next = softirq_pending[cpu];
+  softirq_pending[cpu] = softirq;
+}
+
+bool IRQ_in_softirq() { return softirq_running[CPU_id()]; }
+
+// with interrupts on for each one and preemption off throughout, so an
+// interrupt nesting in here only queues more for this loop and can't switch
+// away from it
+static void run_softirqs(unsigned cpu) {
+  softirq_running[cpu] = true;
+  preempt_disable();
+  while (softirq_pending[cpu] != NULL) {
+    struct Softirq *softirq = softirq_pending[cpu];
+    softirq_pending[cpu] = softirq->next;
+    // cleared first, so raising it from here on runs it again
+    __atomic_store_n(&softirq->pending, false, __ATOMIC_RELEASE);
+#ifdef IRQ_STATS
+    uint64_t start = rdtsc();
+#endif
+    STI;
+    softirq->fn(softirq->arg);
+    CLI;
+#ifdef IRQ_STATS
+    record_softirq(cpu, rdtsc() - start);
+#endif
+  }
+  preempt_enable();
+  softirq_running[cpu] = false;
+  PROC_softirq_exit();
+}
+
+// every vector is an interrupt gate so handlers run with interrupts off, and
+// should do no more than ack the device and raise a softirq for the rest.
+// Interrupts stay off again from the end of the softirqs until iretq, so the
+// timer can't nest inside a context switch
 void irq_handler(int number, int error_code) {
-  CLI;
   if (number < 0 || number >= IDT_MAX_DESCRIPTORS) {
     printk("irq_handler called with invalid interrupt number: %x\n", number);
-    STI;
     return;
   }
 
+#ifdef IRQ_STATS
+  uint64_t start = rdtsc();
+#endif
   struct IRQTableEntry *entry = &irq_table[number];
+  struct Cpu *cpu = CPU_this();
+  cpu->irq_depth += 1;
   if (entry->handler == NULL) {
     unhandled_irq_handler(number, error_code);
   } else {
     entry->handler(number, error_code, entry->arg);
   }
-  STI;
+#ifdef IRQ_STATS
+  record_irq_off(cpu->id, rdtsc() - start);
+#endif
+  // still counted as in an interrupt while they run, and anything nested
+  // leaves its softirqs to this loop. Not after exceptions, a fault nested
+  // in a softirq would reuse its stack
+  if (number >= IRQ_BASE && cpu->irq_depth == 1 &&
+      softirq_pending[cpu->id] != NULL) {
+    run_softirqs(cpu->id);
+  }
+  cpu->irq_depth -= 1;
 }
+bool IRQ_in_interrupt() { return CPU_this()->irq_depth > 0; }
 
 #define ICW1_ICW4 0x01      /* Indicates that ICW4 will be present */
 #define ICW1_SINGLE 0x02    /* Single (cascade) mode */
@@ -118,16 +258,13 @@ void PIC_remap(int offset) {
 #define IST_CURRENT_STACK 0
 #define DF_INT 0x8
 #define DF_IST_IDX 1
-static uint8_t DF_stack[CRITICAL_STACK_SIZE];
+static uint8_t DF_stack[CPU_MAX][CRITICAL_STACK_SIZE];
 #define PF_INT 0xE
 #define PF_IST_IDX 2
-static uint8_t PF_stack[CRITICAL_STACK_SIZE];
+static uint8_t PF_stack[CPU_MAX][CRITICAL_STACK_SIZE];
 #define GP_INT 0xD
 #define GP_IST_IDX 3
-static uint8_t GP_stack[CRITICAL_STACK_SIZE];
-#define EX_INT 0x81
-#define EX_INT_IDX 4
-static uint8_t EX_stack[CRITICAL_STACK_SIZE];
+static uint8_t GP_stack[CPU_MAX][CRITICAL_STACK_SIZE];
 
 struct TaskStateSegment {
   uint32_t reserved1;
@@ -139,7 +276,9 @@ struct TaskStateSegment {
   uint16_t io_map_base_addr;
 } __attribute__((packed));
 
-static struct TaskStateSegment tss;
+// every CPU has its own TSS so its IST stacks aren't shared
+static struct TaskStateSegment tss[CPU_MAX];
+static size_t tss_offsets[CPU_MAX];
 
 struct TaskStateSegmentDescriptor {
   uint16_t limit_low;
@@ -158,9 +297,10 @@ struct TaskStateSegmentDescriptor {
 } __attribute__((packed));
 
 static inline void
-tss_set_descriptor(struct TaskStateSegmentDescriptor *tss_desc) {
-  uint64_t base = (uint64_t)&tss;
-  tss_desc->limit_low = sizeof(tss) - 1;
+tss_set_descriptor(struct TaskStateSegmentDescriptor *tss_desc,
+                   struct TaskStateSegment *tss) {
+  uint64_t base = (uint64_t)tss;
+  tss_desc->limit_low = sizeof(*tss) - 1;
   tss_desc->base_low = base & 0xFFFFFF;
   tss_desc->type = 0x9;
   tss_desc->zero = 0;
@@ -175,20 +315,24 @@ tss_set_descriptor(struct TaskStateSegmentDescriptor *tss_desc) {
   tss_desc->reserved = 0;
 }
 
+// the stacks grow down, so the IST wants the end of each one
+#define STACK_TOP(stack) ((uint64_t)(stack) + CRITICAL_STACK_SIZE)
+
 void IRQ_init_tss() {
-  memset(&tss, 0, sizeof(tss));
-  tss.interrupt_stack_table[DF_IST_IDX - 1] = (uint64_t)DF_stack;
-  tss.interrupt_stack_table[PF_IST_IDX - 1] = (uint64_t)PF_stack;
-  tss.interrupt_stack_table[GP_IST_IDX - 1] = (uint64_t)GP_stack;
-  tss.interrupt_stack_table[EX_INT_IDX - 1] = (uint64_t)EX_stack;
-
-  struct TaskStateSegmentDescriptor tss_desc;
-  tss_set_descriptor(&tss_desc);
-  size_t tss_offset =
-      GDT_push((uint64_t *)&tss_desc, sizeof(tss_desc) / sizeof(uint64_t));
+  for (size_t cpu = 0; cpu < CPU_MAX; ++cpu) {
+    memset(&tss[cpu], 0, sizeof(tss[cpu]));
+    tss[cpu].interrupt_stack_table[DF_IST_IDX - 1] = STACK_TOP(DF_stack[cpu]);
+    tss[cpu].interrupt_stack_table[PF_IST_IDX - 1] = STACK_TOP(PF_stack[cpu]);
+    tss[cpu].interrupt_stack_table[GP_IST_IDX - 1] = STACK_TOP(GP_stack[cpu]);
+
+    struct TaskStateSegmentDescriptor tss_desc;
+    tss_set_descriptor(&tss_desc, &tss[cpu]);
+    tss_offsets[cpu] =
+        GDT_push((uint64_t *)&tss_desc, sizeof(tss_desc) / sizeof(uint64_t));
+  }
   GDT_load();
 
-  asm volatile("ltr %0" : : "rm"(tss_offset));
+  asm volatile("ltr %0" : : "rm"((uint16_t)tss_offsets[0]));
 }
 
 void IRQ_init() {
@@ -206,9 +350,6 @@ void IRQ_init() {
     case GP_INT:
       idt_set_descriptor(&idt[i], isr_stub_table[i], GP_IST_IDX);
       break;
-    case EX_INT:
-      idt_set_descriptor(&idt[i], isr_stub_table[i], EX_INT_IDX);
-      break;
     default:
       idt_set_descriptor(&idt[i], isr_stub_table[i], 0);
     }
@@ -225,6 +366,12 @@ void IRQ_init() {
   STI;
 }
 
+void IRQ_init_ap(unsigned cpu) {
+  GDT_load();
+  asm volatile("ltr %0" : : "rm"((uint16_t)tss_offsets[cpu]));
+  asm volatile("lidt %0" : : "rm"(idtr));
+}
+
 void IRQ_handler_set(int number, irq_handler_t handler, void *arg) {
   // trusting the user (me) doesn't throw a stupid interrupt number at this
   irq_table[number] = (struct IRQTableEntry){
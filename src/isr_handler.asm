@@ -1,9 +1,13 @@
 global isr_stub_table
 
 extern irq_handler
-extern PROC_resume_source
-extern cur_proc
-extern next_proc
+extern PROC_switch_from_irq
+
+;; offsets of fields in struct Cpu, which gs points at
+%define CPU_CUR_PROC 8
+%define CPU_NEXT_PROC 16
+%define CPU_PREEMPT_COUNT 32
+%define CPU_IRQ_DEPTH 36
 
 %macro push_scratch_regs 0
     push rax
@@ -60,75 +64,24 @@ shift_stack:
     add rsp, 8
 isr_no_err:
     call irq_handler
-    mov rax, [rel cur_proc]
-    mov rcx, [rel next_proc]
-    cmp rax, rcx
+    ;; the stub already saved the scratch registers, switch_to saves the rest
+    ;; and the interrupt frame stays on the old thread's stack until it's
+    ;; switched back to and returns through here
+    mov rax, [gs:CPU_CUR_PROC]
+    cmp rax, [gs:CPU_NEXT_PROC]
     je no_ctx_switch
-    cmp rax, 0
-    je no_cur_proc
-    ;; push all the registers (that we haven't yet)!
-    ;; callee saved
-    push rbx
-    push r12
-    push r13
-    push r14
-    push r15
-    ;; 16 bit segment stuff (not really used)
-    xor rax, rax
-    mov rax, ds
-    push rax
-    xor rcx, rcx
-    mov rcx, es
-    push rcx
-    xor rdx, rdx
-    mov rdx, fs
-    push rdx
-    xor rsi, rsi
-    mov rsi, gs
-    push rsi
-    ;; stack base pointer
-    push rbp
-    ;; switch to the new context
-    ;; store current rsp
-    mov rax, [rel cur_proc]
-    mov rcx, [rax]
-    mov [rcx], rsp
-no_cur_proc:
-    ;; pull rsp out of context
-    mov rax, [rel next_proc]
-    cmp rax, 0
-    je invalid_next_proc
-valid_next_proc:
-    mov rax, [rel next_proc]
-    mov rcx, [rax]
-    mov rsp, [rcx]
-    ;; set cur_proc to next_proc
-    mov [rel cur_proc], rax
-    ;; now we can just pop the whole state
-    pop rbp
-    ;; segment garbage again
-    pop rsi
-    mov ds, rsi
-    pop rdx
-    mov fs, rdx
-    pop rcx
-    mov es, rcx
-    pop rax
-    mov gs, rax
-    ;; callee saved
-    pop r15
-    pop r14
-    pop r13
-    pop r12
-    pop rbx
+    ;; only from the outermost interrupt with preemption on. One nested in a
+    ;; softirq leaves the switch to the interrupt it cut in on, which makes
+    ;; it once the softirqs are done
+    cmp dword [gs:CPU_IRQ_DEPTH], 0
+    jne no_ctx_switch
+    cmp dword [gs:CPU_PREEMPT_COUNT], 0
+    jne no_ctx_switch
+    call PROC_switch_from_irq
 no_ctx_switch:
     pop_scratch_regs
     iretq
 
-invalid_next_proc:
-    call PROC_resume_source
-    jmp valid_next_proc
-
 isr_no_err_stub 0
 isr_no_err_stub 1
 isr_no_err_stub 2
@@ -4,19 +4,30 @@
 #include "fs.h"
 #include "gdt.h"
 #include "interrupts.h"
+#include "kmalloc_profile.h"
 #include "mbr.h"
 #include "md5.h"
+#include "meminfo.h"
 #include "multiboot_tags.h"
 #include "page_allocator.h"
+#include "page_cache.h"
 #include "page_table.h"
 #include "portio.h"
 #include "printk.h"
 #include "processes.h"
 #include "ps2.h"
 #include "serial.h"
+#include "shrinker.h"
+#include "slab.h"
+#include "smp.h"
+#include "sync.h"
+#include "thread_pool.h"
+#include "timer.h"
+#include "tmpfs.h"
 #include "smolassert.h" // just macros so clangd thinks it's unused
 #include "vfs.h"
 #include "vga.h"
+#include "vmalloc.h"
 
 #include <limits.h>
 #include <stdbool.h>
@@ -52,6 +63,64 @@ void keyboard_io(void *arg) {
   }
 }
 
+#define CONSOLE_LINE_LEN 64
+#define KPROF_DEFAULT_SITES 10
+
+static void run_command(char *line) {
+  char *arg = line;
+  while (*arg != '\0' && *arg != ' ') {
+    ++arg;
+  }
+  if (*arg == ' ') {
+    *arg++ = '\0';
+  }
+  if (strcmp(line, "meminfo") == 0) {
+    MEMINFO_print();
+  } else if (strcmp(line, "sched") == 0) {
+    PROC_print_sched_stats();
+  } else if (strcmp(line, "latency") == 0) {
+    ps2_print_latency();
+    BLK_print_latency();
+#ifdef KMALLOC_PROFILE
+  } else if (strcmp(line, "kprof") == 0) {
+    size_t num = 0;
+    for (; *arg >= '0' && *arg <= '9'; ++arg) {
+      num = num * 10 + (*arg - '0');
+    }
+    kmalloc_profile_print(num == 0 ? KPROF_DEFAULT_SITES : num);
+#endif
+#ifdef LOCK_STATS
+  } else if (strcmp(line, "locks") == 0) {
+    lock_stats_print();
+#endif
+#ifdef IRQ_STATS
+  } else if (strcmp(line, "irqs") == 0) {
+    IRQ_print_stats();
+#endif
+  } else if (*line != '\0') {
+    printk("unknown command: %s\n", line);
+  }
+}
+
+// line based commands over the serial port, echoed back as they're typed
+void serial_console(void *arg) {
+  SER_input_init();
+  char line[CONSOLE_LINE_LEN];
+  size_t len = 0;
+  while (true) {
+    char c = SER_getc();
+    if (c == '\r' || c == '\n') {
+      printk("\n");
+      line[len] = '\0';
+      run_command(line);
+      len = 0;
+    } else if (len < CONSOLE_LINE_LEN - 1) {
+      printk("%c", c);
+      line[len++] = c;
+    }
+  }
+}
+
 int readdir_boot(const char *filename, struct Inode *inode, void *arg) {
   unsigned long *ino = arg;
   if (strcmp(filename, "boot") == 0) {
@@ -87,14 +156,16 @@ void drive_init(void *arg) {
   MD5_CTX ctx;
   MD5Init(&ctx);
   struct File *file = inode->open(inode);
+  char *data = kmalloc(7000);
   while (true) {
-    char *data = kmalloc(7000);
     int len = file->read(file, data, 7000);
-    if (len == 0) {
+    if (len <= 0) {
       break;
     }
     MD5Update(&ctx, (unsigned char *)data, len);
   }
+  kfree(data);
+  file->close(&file);
   unsigned char digest[16];
   MD5Final(digest, &ctx);
   for (int i = 0; i < 16; ++i) {
@@ -104,9 +175,12 @@ void drive_init(void *arg) {
     printk("%x", digest[i]);
   }
   printk("\n");
+  MEMINFO_print();
 }
 
 void kmain(void) {
+  // per-CPU data is behind everything that touches preemption or locks
+  SMP_early_init();
   disable_cursor();
   VGA_clear();
   GDT_setup();
@@ -115,6 +189,7 @@ void kmain(void) {
   SER_init();
 
   multiboot_tags_parse_to_mem_regions();
+  MMU_pf_init();
 
 #ifdef MMU_MEMTEST
   MMU_memtest();
@@ -123,19 +198,59 @@ void kmain(void) {
   init_page_table();
   MMU_alloc_init();
   init_alloc();
+  PROC_init();
+  TIMER_init();
+  SMP_init();
+  POOL_init();
+  BLK_init();
+  tmpfs_init();
+  page_cache_init();
+
+#ifdef TMPFS_TEST
+  tmpfs_test();
+#endif
+
+#ifdef KMALLOC_BENCH
+  kmalloc_bench();
+#endif
+
+#ifdef VMALLOC_TEST
+  vmalloc_test();
+#endif
+
+#ifdef VMALLOC_BENCH
+  vmalloc_bench();
+#endif
 
   /* PROC_create_kthread(&spinwaiter, NULL); */
   /* int *fish = kmalloc(sizeof(int)); */
   /* *fish = 420; */
   /* PROC_create_kthread(&test_thread2, &fish); */
+  SHRINK_init();
+#ifdef SLAB_BENCH
+  kmem_cache_bench();
+#endif
+#ifdef SCHED_BENCH
+  PROC_sched_bench();
+#endif
+#ifdef SWITCH_BENCH
+  PROC_switch_bench();
+#endif
+#ifdef TIMER_BENCH
+  TIMER_bench();
+#endif
+#ifdef SYNC_BENCH
+  sync_bench();
+#endif
+#ifdef SMP_BENCH
+  SMP_bench();
+#endif
+#ifdef POOL_BENCH
+  POOL_bench();
+#endif
   PROC_create_kthread(&keyboard_io, NULL);
+  PROC_create_kthread(&serial_console, NULL);
   PROC_create_kthread(&drive_init, NULL);
 
-  while (true) {
-    PROC_run();
-    if (!PROC_has_unblocked()) {
-      STI;
-      HLT;
-    }
-  }
+  SMP_idle();
 }
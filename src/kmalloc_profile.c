@@ -0,0 +1,200 @@
+#include "kmalloc_profile.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "multiboot_tags.h"
+#include "printk.h"
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef KMALLOC_PROFILE
+// both tables are open addressed with linear probing, sized in powers of two
+#define PROFILE_SITE_BITS 10
+#define PROFILE_OBJECT_BITS 15
+#define PROFILE_MAX_SITES (1 << PROFILE_SITE_BITS)
+#define PROFILE_MAX_OBJECTS (1 << PROFILE_OBJECT_BITS)
+#define PROFILE_MAX_PRINT 32
+
+struct ProfileSite {
+  uintptr_t caller;
+  size_t live_bytes;
+  size_t live_objs;
+  size_t allocs;
+  size_t allocs_at_dump;
+};
+
+struct ProfileObject {
+  uintptr_t addr;
+  size_t size;
+  uint16_t site;
+};
+
+static struct ProfileSite sites[PROFILE_MAX_SITES];
+static struct ProfileObject objects[PROFILE_MAX_OBJECTS];
+static size_t num_sites = 0;
+static size_t num_objects = 0;
+// allocations that found a table full and went unrecorded
+static size_t num_dropped = 0;
+static uint64_t last_dump_tsc = 0;
+// interrupts stay off too, the heap can be used from a page fault
+static struct Spinlock profile_lock = SPINLOCK_INIT;
+
+static inline size_t hash(uintptr_t key, int bits) {
+  return (key * 0x9E3779B97F4A7C15lu) >> (64 - bits);
+}
+
+static struct ProfileSite *site_get(uintptr_t caller) {
+  size_t i = hash(caller, PROFILE_SITE_BITS);
+  while (sites[i].caller != 0 && sites[i].caller != caller) {
+    i = (i + 1) % PROFILE_MAX_SITES;
+  }
+  if (sites[i].caller == 0) {
+    // keep a slot free so lookups always end
+    if (num_sites + 1 >= PROFILE_MAX_SITES) {
+      return NULL;
+    }
+    sites[i].caller = caller;
+    num_sites += 1;
+  }
+  return &sites[i];
+}
+
+static size_t object_find(uintptr_t addr) {
+  size_t i = hash(addr, PROFILE_OBJECT_BITS);
+  while (objects[i].addr != 0 && objects[i].addr != addr) {
+    i = (i + 1) % PROFILE_MAX_OBJECTS;
+  }
+  return i;
+}
+
+// backward shift deletion, so probes never need tombstones
+static void object_remove(size_t hole) {
+  objects[hole].addr = 0;
+  num_objects -= 1;
+  size_t i = hole;
+  while (true) {
+    i = (i + 1) % PROFILE_MAX_OBJECTS;
+    if (objects[i].addr == 0) {
+      return;
+    }
+    size_t home = hash(objects[i].addr, PROFILE_OBJECT_BITS);
+    // entries whose home lies cyclically in (hole, i] are still reachable
+    bool reachable = hole <= i ? hole < home && home <= i
+                               : hole < home || home <= i;
+    if (!reachable) {
+      objects[hole] = objects[i];
+      objects[i].addr = 0;
+      hole = i;
+    }
+  }
+}
+
+void kmalloc_profile_alloc(void *addr, size_t size, void *caller) {
+  if (addr == NULL) {
+    return;
+  }
+  SPIN_LOCK_GUARD(&profile_lock);
+  struct ProfileSite *site = site_get((uintptr_t)caller);
+  if (site == NULL || num_objects + 1 >= PROFILE_MAX_OBJECTS) {
+    num_dropped += 1;
+  } else {
+    size_t i = object_find((uintptr_t)addr);
+    objects[i].addr = (uintptr_t)addr;
+    objects[i].size = size;
+    objects[i].site = site - sites;
+    num_objects += 1;
+    site->live_bytes += size;
+    site->live_objs += 1;
+    site->allocs += 1;
+  }
+  SPIN_UNLOCK_GUARD(&profile_lock);
+}
+
+void kmalloc_profile_free(void *addr) {
+  if (addr == NULL) {
+    return;
+  }
+  SPIN_LOCK_GUARD(&profile_lock);
+  size_t i = object_find((uintptr_t)addr);
+  // untracked when it was dropped or allocated before anything was recorded
+  if (objects[i].addr != 0) {
+    struct ProfileSite *site = &sites[objects[i].site];
+    site->live_bytes -= objects[i].size;
+    site->live_objs -= 1;
+    object_remove(i);
+  }
+  SPIN_UNLOCK_GUARD(&profile_lock);
+}
+
+void kmalloc_profile_resize(void *addr, size_t size) {
+  SPIN_LOCK_GUARD(&profile_lock);
+  size_t i = object_find((uintptr_t)addr);
+  if (objects[i].addr != 0) {
+    struct ProfileSite *site = &sites[objects[i].site];
+    site->live_bytes += size - objects[i].size;
+    objects[i].size = size;
+  }
+  SPIN_UNLOCK_GUARD(&profile_lock);
+}
+
+static bool site_before(struct ProfileSite *a, struct ProfileSite *b) {
+  return a->live_bytes > b->live_bytes ||
+         (a->live_bytes == b->live_bytes && a->allocs > b->allocs);
+}
+
+void kmalloc_profile_print(size_t num) {
+  if (num > PROFILE_MAX_PRINT) {
+    num = PROFILE_MAX_PRINT;
+  }
+  // copied out so nothing is printed with the lock held
+  struct ProfileSite top[PROFILE_MAX_PRINT];
+  size_t num_top = 0;
+  SPIN_LOCK_GUARD(&profile_lock);
+  // insertion into a short sorted list beats sorting every site
+  for (size_t i = 0; i < PROFILE_MAX_SITES; ++i) {
+    struct ProfileSite *site = &sites[i];
+    if (site->caller == 0) {
+      continue;
+    }
+    size_t pos = num_top;
+    while (pos > 0 && site_before(site, &top[pos - 1])) {
+      if (pos < num) {
+        top[pos] = top[pos - 1];
+      }
+      --pos;
+    }
+    if (pos < num) {
+      top[pos] = *site;
+      if (num_top < num) {
+        ++num_top;
+      }
+    }
+    site->allocs_at_dump = site->allocs;
+  }
+  size_t total_sites = num_sites, total_objects = num_objects;
+  size_t dropped = num_dropped;
+  uint64_t now = rdtsc();
+  uint64_t elapsed = now - last_dump_tsc;
+  last_dump_tsc = now;
+  SPIN_UNLOCK_GUARD(&profile_lock);
+
+  printk("kmalloc profile: %lu sites, %lu live objects, %lu dropped\n",
+         total_sites, total_objects, dropped);
+  for (size_t i = 0; i < num_top; ++i) {
+    struct ProfileSite *site = &top[i];
+    uint64_t rate =
+        (site->allocs - site->allocs_at_dump) * 1000000000lu / (elapsed | 1);
+    printk("  %lu bytes in %lu objects, %lu allocs, %lu/Gcycle: ",
+           site->live_bytes, site->live_objs, site->allocs, rate);
+    uintptr_t offset;
+    const char *name = multiboot_symbolize(site->caller, &offset);
+    if (name != NULL) {
+      printk("%s+0x%lx\n", name, offset);
+    } else {
+      printk("%lx\n", site->caller);
+    }
+  }
+}
+#endif
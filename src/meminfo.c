@@ -0,0 +1,48 @@
+#include "meminfo.h"
+#include "page_allocator.h"
+#include "printk.h"
+#include "slab.h"
+#include "vmalloc.h"
+
+#include <stddef.h>
+
+static size_t stats[MEMSTAT_NUM];
+
+void MEMINFO_add(enum MemStat stat, long delta) {
+  __atomic_fetch_add(&stats[stat], delta, __ATOMIC_RELAXED);
+}
+
+size_t MEMINFO_get(enum MemStat stat) { return stats[stat]; }
+
+#define PAGES_KIB(pages) ((pages) * (MMU_PAGE_SIZE / 1024))
+
+void MEMINFO_print() {
+  size_t total = MMU_total_frames();
+  size_t free = MMU_free_frames();
+  size_t accounted = stats[MEMSTAT_PAGE_TABLES] + stats[MEMSTAT_SLAB] +
+                     stats[MEMSTAT_KMALLOC_PAGES] +
+                     stats[MEMSTAT_HEAP_RESIDENT] +
+                     stats[MEMSTAT_PAGE_CACHE] + stats[MEMSTAT_TMPFS] +
+                     stats[MEMSTAT_ZERO_POOL];
+  size_t used = total - free;
+  printk("meminfo:\n");
+  printk("  total:            %lu KiB\n", PAGES_KIB(total));
+  printk("  free:             %lu KiB\n", PAGES_KIB(free));
+  printk("  page tables:      %lu KiB\n",
+         PAGES_KIB(stats[MEMSTAT_PAGE_TABLES]));
+  printk("  slab:             %lu KiB (%lu KiB in objects)\n",
+         PAGES_KIB(stats[MEMSTAT_SLAB]), stats[MEMSTAT_SLAB_ACTIVE] / 1024);
+  printk("  kmalloc pages:    %lu KiB\n",
+         PAGES_KIB(stats[MEMSTAT_KMALLOC_PAGES]));
+  printk("  heap resident:    %lu KiB\n",
+         PAGES_KIB(stats[MEMSTAT_HEAP_RESIDENT]));
+  printk("    vmalloc:        %lu KiB reserved, %lu free ranges\n",
+         PAGES_KIB(stats[MEMSTAT_VMALLOC_PAGES]), vmalloc_num_free_ranges());
+  printk("  page cache:       %lu KiB\n", PAGES_KIB(stats[MEMSTAT_PAGE_CACHE]));
+  printk("  tmpfs:            %lu KiB\n", PAGES_KIB(stats[MEMSTAT_TMPFS]));
+  printk("  zero pool:        %lu KiB\n", PAGES_KIB(stats[MEMSTAT_ZERO_POOL]));
+  printk("  other:            %lu KiB\n",
+         PAGES_KIB(used > accounted ? used - accounted : 0));
+  MMU_pf_print_stats();
+  kmem_cache_print_stats();
+}
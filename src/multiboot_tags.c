@@ -18,6 +18,9 @@ struct TagsHeader {
 
 #define TAG_MEM_MAP 6
 #define TAG_ELF_HEADER 9
+// copies of the ACPI 1.0 and 2.0+ root pointers follow the tag header
+#define TAG_ACPI_OLD_RSDP 14
+#define TAG_ACPI_NEW_RSDP 15
 
 struct TagCommonHeader {
   uint32_t type;
@@ -69,7 +72,23 @@ struct TagElfEntries {
   size_t size;
 };
 
+#define ELF_SECTION_SYMTAB 2
+#define ELF_SYMBOL_FUNC 2
+
+struct ElfSymbol {
+  uint32_t name;
+  uint8_t info;
+  uint8_t other;
+  uint16_t section_index;
+  uint64_t value;
+  uint64_t size;
+} __attribute__((__packed__));
+
 static struct MemRegions mem_regions;
+static struct ElfSymbol *symbols = NULL;
+static size_t num_symbols = 0;
+static const char *symbol_names = NULL;
+static void *rsdp = NULL;
 
 static bool is_tags_terminator(struct TagCommonHeader *tag) {
   return tag->type == 0 && tag->size == 8;
@@ -90,7 +109,6 @@ static void add_region(void *start, void *end) {
     struct MemRegion *region = &mem_regions.d[mem_regions.size++];
     region->start = (void *)start;
     region->end = (void *)end;
-    region->next = (void *)start;
   }
 }
 
@@ -108,9 +126,10 @@ static void build_mem_regions(struct TagMemMapEntries mem_entries,
     }
 
     uint64_t start = mem_entries.d[i].starting_addr;
-    // null is not a valid address
-    if (start == (uint64_t)NULL) {
-      ++start;
+    // null is not a valid address, and the rest of low memory is kept for
+    // the AP startup trampoline
+    if (start < MEM_LOW_RESERVED_END) {
+      start = MEM_LOW_RESERVED_END;
     }
 
     uint64_t end = (mem_entries.d[i].starting_addr + mem_entries.d[i].length);
@@ -148,6 +167,34 @@ static void build_mem_regions(struct TagMemMapEntries mem_entries,
   }
 }
 
+// the bootloader places the non-allocated sections, the symbol table among
+// them, in memory too and fills in their addresses
+static void find_symbols(struct TagElfEntries elf_entries) {
+  for (size_t i = 0; i < elf_entries.size; ++i) {
+    struct TagELFEntry *e = &elf_entries.d[i];
+    if (e->section_type == ELF_SECTION_SYMTAB && e->segment_address != 0 &&
+        e->table_index_link < elf_entries.size) {
+      symbols = (struct ElfSymbol *)e->segment_address;
+      num_symbols = e->segment_size / sizeof(struct ElfSymbol);
+      symbol_names =
+          (const char *)elf_entries.d[e->table_index_link].segment_address;
+      return;
+    }
+  }
+}
+
+const char *multiboot_symbolize(uintptr_t addr, uintptr_t *offset) {
+  for (size_t i = 0; i < num_symbols && symbol_names != NULL; ++i) {
+    struct ElfSymbol *sym = &symbols[i];
+    if ((sym->info & 0xF) == ELF_SYMBOL_FUNC && sym->value <= addr &&
+        addr < sym->value + sym->size) {
+      *offset = addr - sym->value;
+      return symbol_names + sym->name;
+    }
+  }
+  return NULL;
+}
+
 void multiboot_tags_parse_to_mem_regions() {
   struct TagsHeader *header = multiboot_tag_addr;
   printk("multiboot headaer size: %u\n", header->size);
@@ -170,6 +217,9 @@ void multiboot_tags_parse_to_mem_regions() {
       struct TagELFHeader *elfheader = (struct TagELFHeader *)curtag;
       elf_entries.d = (struct TagELFEntry *)(elfheader + 1);
       elf_entries.size = elfheader->num_entries;
+    } else if (curtag->type == TAG_ACPI_NEW_RSDP ||
+               (curtag->type == TAG_ACPI_OLD_RSDP && rsdp == NULL)) {
+      rsdp = curtag + 1;
     }
     // align to next 8-byte boundary (if needed)
     curtag = (struct TagCommonHeader *)align_pointer(
@@ -194,6 +244,7 @@ void multiboot_tags_parse_to_mem_regions() {
   /* } */
 
   build_mem_regions(mem_entries, elf_entries);
+  find_symbols(elf_entries);
   printk("Num regions: %lu\n", mem_regions.size);
   for (size_t i = 0; i < mem_regions.size; ++i) {
     struct MemRegion *r = &mem_regions.d[i];
@@ -203,3 +254,5 @@ void multiboot_tags_parse_to_mem_regions() {
 }
 
 struct MemRegions *multiboot_get_mem_regions() { return &mem_regions; }
+
+void *multiboot_get_rsdp() { return rsdp; }
@@ -1,68 +1,339 @@
 #include "page_allocator.h"
+#include "alignment.h"
 #include "exit.h"
 #include "interrupts.h"
+#include "meminfo.h"
 #include "multiboot_tags.h"
 #include "page_table.h"
 #include "printk.h"
+#include "shrinker.h"
 #include "smolassert.h"
+#include "spinlock.h"
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-struct FreeNode {
-  struct FreeNode *next;
-};
+static struct PageFrame *frames = NULL;
+static size_t num_frames = 0;
+static struct PageFrame *free_area[MMU_MAX_ORDER + 1];
+static size_t free_blocks[MMU_MAX_ORDER + 1];
+static size_t free_frames = 0;
+static size_t total_frames = 0;
+// guards the buddy lists and their counters
+static struct Spinlock frame_lock = SPINLOCK_INIT;
+// zeroed frames linked through their next pointers
+static struct Spinlock zero_pool_lock = SPINLOCK_INIT;
+static struct PageFrame *zero_pool = NULL;
+static size_t zero_pool_size = 0;
+static size_t num_faults = 0;
+// two CPUs can fault on the same page at once, only one of them backs it
+static struct Spinlock fault_lock = SPINLOCK_INIT;
+static size_t fault_around_pages = MMU_FAULT_AROUND_PAGES;
 
-static struct FreeNode *free_list = NULL;
+static inline size_t frame_pfn(struct PageFrame *frame) {
+  return frame - frames;
+}
 
-size_t get_free_memory() {
-  struct MemRegions *regions = multiboot_get_mem_regions();
-  size_t free = 0;
-  for (size_t i = 0; i < regions->size; ++i) {
-    struct MemRegion *region = &regions->d[i];
-    free += region->end - region->next;
+struct PageFrame *MMU_pf_frame(void *pf) {
+  return &frames[(uintptr_t)pf / MMU_PAGE_SIZE];
+}
+
+void *MMU_pf_frame_addr(struct PageFrame *frame) {
+  return (void *)(frame_pfn(frame) * MMU_PAGE_SIZE);
+}
+
+static void free_area_push(struct PageFrame *frame, int order) {
+  frame->order = order;
+  frame->flags = PF_FLAG_FREE;
+  frame->prev = NULL;
+  frame->next = free_area[order];
+  if (frame->next != NULL) {
+    frame->next->prev = frame;
+  }
+  free_area[order] = frame;
+  free_blocks[order] += 1;
+  free_frames += 1lu << order;
+}
+
+static void free_area_remove(struct PageFrame *frame) {
+  int order = frame->order;
+  if (frame->prev != NULL) {
+    frame->prev->next = frame->next;
+  } else {
+    free_area[order] = frame->next;
+  }
+  if (frame->next != NULL) {
+    frame->next->prev = frame->prev;
+  }
+  frame->flags &= ~PF_FLAG_FREE;
+  free_blocks[order] -= 1;
+  free_frames -= 1lu << order;
+}
+
+size_t get_free_memory() { return free_frames * MMU_PAGE_SIZE; }
+
+size_t MMU_free_frames() { return free_frames; }
+
+size_t MMU_total_frames() { return total_frames; }
+
+size_t MMU_free_blocks(int order) { return free_blocks[order]; }
+
+void MMU_pf_print_stats() {
+  printk("free frames: %lu (", free_frames);
+  for (int order = 0; order <= MMU_MAX_ORDER; ++order) {
+    printk("%s%lu", order == 0 ? "" : " ", free_blocks[order]);
+  }
+  printk(")\n");
+}
+
+static void *pf_alloc_block(int order) {
+  int cur = order;
+  while (cur <= MMU_MAX_ORDER && free_area[cur] == NULL) {
+    ++cur;
+  }
+  if (cur > MMU_MAX_ORDER) {
+    return NULL;
+  }
+
+  struct PageFrame *frame = free_area[cur];
+  free_area_remove(frame);
+  // split, handing the upper halves back until the block is small enough
+  while (cur > order) {
+    --cur;
+    free_area_push(frame + (1lu << cur), cur);
+  }
+  frame->order = order;
+  return MMU_pf_frame_addr(frame);
+}
+
+static void pf_free_block(size_t pfn, int order) {
+  // merge with the buddy for as long as it's free and whole
+  while (order < MMU_MAX_ORDER) {
+    size_t buddy_pfn = pfn ^ (1lu << order);
+    if (buddy_pfn >= num_frames) {
+      break;
+    }
+    struct PageFrame *buddy = &frames[buddy_pfn];
+    if (!(buddy->flags & PF_FLAG_FREE) || buddy->order != order) {
+      break;
+    }
+    free_area_remove(buddy);
+    pfn &= ~(1lu << order);
+    ++order;
   }
-  return free;
+  free_area_push(&frames[pfn], order);
 }
 
-void *MMU_pf_alloc(void) {
-  // allocate from free list first
-  if (free_list) {
-    void *addr = free_list;
-    free_list = free_list->next;
-    return addr;
+static void zero_pool_drain();
+
+// the free lists are shared by every CPU, so the public entry points hold
+// frame_lock while they're on them. It's let go before reclaim, which frees
+// frames back through here
+void *MMU_pf_alloc_order(int order) {
+  void *addr = MMU_pf_try_alloc_order(order);
+  if (addr == NULL) {
+    // out of frames, make the caches give some back before giving up
+    zero_pool_drain();
+    SHRINK_run(MMU_WATERMARK_LOW);
+    addr = MMU_pf_try_alloc_order(order);
+  }
+  if (free_frames < MMU_WATERMARK_LOW) {
+    SHRINK_wake();
   }
+  return addr;
+}
+
+void *MMU_pf_try_alloc_order(int order) {
+  spin_lock(&frame_lock);
+  void *addr = pf_alloc_block(order);
+  spin_unlock(&frame_lock);
+  return addr;
+}
 
-  // otherwise, find next free address in a region
+void MMU_pf_free_order(void *pf, int order) {
+  spin_lock(&frame_lock);
+  pf_free_block((uintptr_t)pf / MMU_PAGE_SIZE, order);
+  spin_unlock(&frame_lock);
+}
+
+void *MMU_pf_alloc(void) { return MMU_pf_alloc_order(0); }
+
+void MMU_pf_free(void *pf) { MMU_pf_free_order(pf, 0); }
+
+// hands a region to the buddy lists in the largest aligned blocks it can
+static void pf_free_range(size_t start_pfn, size_t end_pfn) {
+  size_t pfn = start_pfn;
+  while (pfn < end_pfn) {
+    int order = MMU_MAX_ORDER;
+    while (order > 0 &&
+           (pfn % (1lu << order) != 0 || pfn + (1lu << order) > end_pfn)) {
+      --order;
+    }
+    pf_free_block(pfn, order);
+    pfn += 1lu << order;
+  }
+}
+
+void *MMU_pf_alloc_exact(size_t num) {
+  int order = 0;
+  while ((1lu << order) < num) {
+    ++order;
+  }
+  if (order > MMU_MAX_ORDER) {
+    return NULL;
+  }
+  void *addr = MMU_pf_alloc_order(order);
+  if (addr != NULL) {
+    size_t pfn = (uintptr_t)addr / MMU_PAGE_SIZE;
+    spin_lock(&frame_lock);
+    pf_free_range(pfn + num, pfn + (1lu << order));
+    spin_unlock(&frame_lock);
+  }
+  return addr;
+}
+
+void MMU_pf_free_exact(void *pf, size_t num) {
+  size_t pfn = (uintptr_t)pf / MMU_PAGE_SIZE;
+  spin_lock(&frame_lock);
+  pf_free_range(pfn, pfn + num);
+  spin_unlock(&frame_lock);
+}
+
+// non-temporal stores so zeroing in the background doesn't push everything
+// else out of the cache, the caller fences once it's done a batch
+static void zero_frame_nt(void *frame) {
+  uint64_t *word = frame;
+  uint64_t *end = word + MMU_PAGE_SIZE / sizeof(*word);
+  for (; word < end; word += 4) {
+    asm volatile("movnti %1, 0(%0)\n\t"
+                 "movnti %1, 8(%0)\n\t"
+                 "movnti %1, 16(%0)\n\t"
+                 "movnti %1, 24(%0)"
+                 :
+                 : "r"(word), "r"(0lu)
+                 : "memory");
+  }
+}
+
+static struct PageFrame *zero_pool_pop() {
+  SPIN_LOCK_GUARD(&zero_pool_lock);
+  struct PageFrame *frame = zero_pool;
+  if (frame != NULL) {
+    zero_pool = frame->next;
+    zero_pool_size -= 1;
+    MEMINFO_add(MEMSTAT_ZERO_POOL, -1);
+  }
+  SPIN_UNLOCK_GUARD(&zero_pool_lock);
+  return frame;
+}
+
+static void zero_pool_push(struct PageFrame *frame) {
+  SPIN_LOCK_GUARD(&zero_pool_lock);
+  frame->next = zero_pool;
+  zero_pool = frame;
+  zero_pool_size += 1;
+  MEMINFO_add(MEMSTAT_ZERO_POOL, 1);
+  SPIN_UNLOCK_GUARD(&zero_pool_lock);
+}
+
+// hands the pool back to the buddy lists when memory runs out
+static void zero_pool_drain() {
+  struct PageFrame *frame;
+  while ((frame = zero_pool_pop()) != NULL) {
+    MMU_pf_free_order(MMU_pf_frame_addr(frame), 0);
+  }
+}
+
+void *MMU_pf_alloc_zeroed() {
+  struct PageFrame *frame = zero_pool_pop();
+  if (frame != NULL) {
+    return MMU_pf_frame_addr(frame);
+  }
+  // the idle loop fell behind, zero it here through the cache since the
+  // caller is about to touch it anyway
+  void *addr = MMU_pf_alloc();
+  if (addr != NULL) {
+    memset(addr, 0, MMU_PAGE_SIZE);
+  }
+  return addr;
+}
+
+bool MMU_zero_pool_refill(size_t batch) {
+  size_t zeroed = 0;
+  while (zeroed < batch && zero_pool_size < MMU_ZERO_POOL_TARGET &&
+         free_frames > MMU_WATERMARK_HIGH) {
+    void *addr = MMU_pf_try_alloc_order(0);
+    if (addr == NULL) {
+      break;
+    }
+    zero_frame_nt(addr);
+    zero_pool_push(MMU_pf_frame(addr));
+    ++zeroed;
+  }
+  if (zeroed > 0) {
+    // make the streaming stores visible before anyone maps the frames
+    asm volatile("sfence" : : : "memory");
+  }
+  return zeroed > 0;
+}
+
+void MMU_pf_init() {
   struct MemRegions *regions = multiboot_get_mem_regions();
+  assert(regions->size > 0 && "Need at least one memory region");
   for (size_t i = 0; i < regions->size; ++i) {
+    size_t end_pfn = (uintptr_t)regions->d[i].end / MMU_PAGE_SIZE;
+    if (end_pfn > num_frames) {
+      num_frames = end_pfn;
+    }
+  }
+
+  // carve the frame table out of the first region big enough for it, it has
+  // to sit below 1 GiB as that's all the boot page tables map
+  size_t table_size = num_frames * sizeof(struct PageFrame);
+  table_size = align_pointer(table_size, MMU_PAGE_SIZE, true);
+  for (size_t i = 0; i < regions->size && frames == NULL; ++i) {
     struct MemRegion *region = &regions->d[i];
-    if (region->next < region->end) {
-      void *addr = region->next;
-      region->next += MMU_PAGE_SIZE;
-      return addr;
+    if ((size_t)(region->end - region->start) >= table_size) {
+      frames = region->start;
+      region->start += table_size;
     }
   }
+  assert(frames != NULL && "No memory region can hold the frame table");
 
-  // out of memory! scream?
-  printk("ALLOCATOR OUT OF MEMORY!!!");
-  EXIT;
+  // everything starts out reserved, then the usable regions are freed
+  memset(frames, 0, table_size);
+  for (size_t i = 0; i < regions->size; ++i) {
+    struct MemRegion *region = &regions->d[i];
+    pf_free_range((uintptr_t)region->start / MMU_PAGE_SIZE,
+                  (uintptr_t)region->end / MMU_PAGE_SIZE);
+  }
+  total_frames = free_frames;
+  printk("frame allocator: %lu frames, table %lu bytes\n", num_frames,
+         table_size);
+  MMU_pf_print_stats();
+}
 
-  // purely for compiler
-  return NULL;
+static void install_frame(struct PTEntry *entry, void *frame) {
+  entry->addr = (uint64_t)frame >> 12;
+  entry->read_write = true;
+  entry->present = true;
+  MEMINFO_add(MEMSTAT_HEAP_RESIDENT, 1);
 }
 
-void MMU_pf_free(void *pf) {
-  struct FreeNode *node = (struct FreeNode *)pf;
-  node->next = free_list;
-  free_list = node;
+static inline bool needs_backing(struct PTEntry *entry) {
+  return entry->available1 && !entry->present;
 }
 
-static void *brk = ADDR_SPACE_KERNEL_HEAP_BASE;
-void *sbrk(intptr_t increment) {
-  void *last_brk = brk;
-  brk += increment;
-  return last_brk;
+// the window is aligned and divides a table, so its entries all sit next to
+// the faulting one. Not present entries aren't cached, so no flush is needed
+static struct PTEntry *fault_around_window(struct PTEntry *entry,
+                                           size_t *pages) {
+  *pages = fault_around_pages > 1 && free_frames > MMU_WATERMARK_HIGH
+               ? fault_around_pages
+               : 1;
+  size_t index = ((uintptr_t)entry % MMU_PAGE_SIZE) / sizeof(*entry);
+  return entry - index % *pages;
 }
 
 void page_fault_handler(int num, int code, void *arg) {
@@ -83,111 +354,267 @@ void page_fault_handler(int num, int code, void *arg) {
     EXIT;
     return;
   }
-  entry->addr = (uint64_t)MMU_pf_alloc() >> 12;
-  entry->read_write = true;
-  entry->present = true;
+  __atomic_fetch_add(&num_faults, 1, __ATOMIC_RELAXED);
+  // every frame is allocated before taking the fault lock, as in
+  // populate_callback, since allocating can go into reclaim and fault on
+  // heap pages there. Never hand a recycled frame's old contents to a new
+  // mapping
+  void *frame = NULL;
+  if (!entry->present) {
+    frame = MMU_pf_alloc_zeroed();
+    if (frame == NULL) {
+      printk("ALLOCATOR OUT OF MEMORY!!! Virtual addr: %lx\n",
+             (uintptr_t)addr);
+      EXIT;
+      return;
+    }
+  }
+  size_t pages;
+  struct PTEntry *first = fault_around_window(entry, &pages);
+  void *around[MMU_FAULT_AROUND_PAGES];
+  size_t num_around = 0;
+  for (size_t i = 0; i < pages; ++i) {
+    if (&first[i] == entry || !needs_backing(&first[i])) {
+      continue;
+    }
+    around[num_around] = MMU_pf_alloc_zeroed();
+    if (around[num_around] == NULL) {
+      break;
+    }
+    num_around += 1;
+  }
+
+  // another CPU may have backed any of them while we allocated
+  size_t used = 0;
+  spin_lock(&fault_lock);
+  if (frame != NULL && needs_backing(entry)) {
+    install_frame(entry, frame);
+    frame = NULL;
+  }
+  for (size_t i = 0; i < pages && used < num_around; ++i) {
+    if (&first[i] != entry && needs_backing(&first[i])) {
+      install_frame(&first[i], around[used++]);
+    }
+  }
+  spin_unlock(&fault_lock);
+  if (frame != NULL) {
+    MMU_pf_free(frame);
+  }
+  while (used < num_around) {
+    MMU_pf_free(around[used++]);
+  }
 }
 
-// initialize allocator, setup page fault hook
-void MMU_alloc_init() { IRQ_handler_set(0xE, page_fault_handler, NULL); }
+size_t MMU_num_faults() { return num_faults; }
 
-void *MMU_alloc_page() {
-  void *virt_addr = sbrk(MMU_PAGE_SIZE);
-  struct PTEntry *pt_entry = page_table_get_entry(
-      (struct PageEntry *)get_current_page_table(), virt_addr, true);
-  pt_entry->available1 = (uint8_t)true;
-  return virt_addr;
+void MMU_set_fault_around(size_t pages) {
+  size_t table_entries = MMU_PAGE_SIZE / sizeof(struct PTEntry);
+  assert(pages > 0 && table_entries % pages == 0 &&
+         "Fault-around window has to divide a page table");
+  // the fault handler keeps the window's frames on its stack
+  assert(pages <= MMU_FAULT_AROUND_PAGES &&
+         "Fault-around window is bigger than the handler allows");
+  fault_around_pages = pages;
 }
 
-void mark_available_callback(void *virt_addr, struct PTEntry *entry) {
-  entry->available1 = (uint8_t)true;
-}
+// initialize allocator, setup page fault hook
+void MMU_alloc_init() { IRQ_handler_set(0xE, page_fault_handler, NULL); }
 
-void *MMU_alloc_pages(int num) {
-  void *virt_addr = sbrk(MMU_PAGE_SIZE * num);
-  page_table_walk((struct PageEntry *)get_current_page_table(), virt_addr,
-                  virt_addr + MMU_PAGE_SIZE * num, mark_available_callback);
-  return virt_addr;
+static void free_page_callback(void *virt_addr, struct PTEntry *entry,
+                               void *arg) {
+  // pages never touched have no frame behind them to give back
+  if (entry->present) {
+    MMU_pf_free((void *)((uint64_t)entry->addr << 12));
+    MEMINFO_add(MEMSTAT_HEAP_RESIDENT, -1);
+    entry->present = false;
+    tlb_batch_add(arg, virt_addr);
+  }
+  entry->available1 = false;
 }
 
-static inline void invlpg(void *virt_addr) {
-  asm volatile("invlpg %0" : : "rm"(virt_addr));
+static void populate_callback(void *virt_addr, struct PTEntry *entry,
+                              void *arg) {
+  bool *success = arg;
+  if (!*success || !entry->available1 || entry->present) {
+    return;
+  }
+  // allocated before taking the fault lock, since it can go into reclaim
+  // and shrinkers fault on heap pages that need the lock themselves
+  void *frame = MMU_pf_alloc_zeroed();
+  if (frame == NULL) {
+    *success = false;
+    return;
+  }
+  // a fault on another CPU may have backed it in the meantime
+  SPIN_LOCK_GUARD(&fault_lock);
+  bool installed = entry->available1 && !entry->present;
+  if (installed) {
+    install_frame(entry, frame);
+  }
+  SPIN_UNLOCK_GUARD(&fault_lock);
+  if (!installed) {
+    MMU_pf_free(frame);
+  }
 }
 
-void MMU_free_page(void *virt_addr) {
-  struct PTEntry *pt_entry = page_table_get_entry(
-      (struct PageEntry *)get_current_page_table(), virt_addr, true);
-  MMU_pf_free((void *)((uint64_t)pt_entry->addr << 12));
-  pt_entry->present = false;
-  invlpg(virt_addr);
+bool MMU_populate_pages(void *virt_addr, int num) {
+  bool success = true;
+  page_table_walk((struct PageEntry *)get_current_page_table(), virt_addr,
+                  virt_addr + MMU_PAGE_SIZE * num, false, &populate_callback,
+                  &success);
+  return success;
 }
 
 void MMU_free_pages(void *virt_addr, int num) {
-  for (void *page = virt_addr; page < virt_addr + MMU_PAGE_SIZE * num;
-       page += MMU_PAGE_SIZE) {
-    MMU_free_page(page);
-  }
+  struct TlbBatch batch;
+  tlb_batch_init(&batch);
+  page_table_walk((struct PageEntry *)get_current_page_table(), virt_addr,
+                  virt_addr + MMU_PAGE_SIZE * num, false, &free_page_callback,
+                  &batch);
+  tlb_batch_flush(&batch);
 }
 
 #ifdef MMU_MEMTEST
 #define MEMTEST_CYCLES 2
 #define MEMTEST_ADDR_CAPACITY 0x8000
+#define MEMTEST_STRESS_SLOTS 1024
+#define MEMTEST_STRESS_ROUNDS 100000
+#define MEMTEST_STRESS_MAX_ORDER 4
 static uintptr_t *memtest_addrs[MEMTEST_ADDR_CAPACITY];
+static uint8_t memtest_orders[MEMTEST_STRESS_SLOTS];
+
+static void memtest_snapshot(size_t blocks[MMU_MAX_ORDER + 1]) {
+  for (int order = 0; order <= MMU_MAX_ORDER; ++order) {
+    blocks[order] = free_blocks[order];
+  }
+}
+
+static void memtest_check_snapshot(size_t blocks[MMU_MAX_ORDER + 1]) {
+  for (int order = 0; order <= MMU_MAX_ORDER; ++order) {
+    assert(blocks[order] == free_blocks[order] &&
+           "Freed blocks should coalesce back to where they started");
+  }
+}
+
+static void memtest_fill_and_verify(size_t total_pages) {
+  // allocate and write
+  for (size_t i = 0; i < total_pages; ++i) {
+    // allocate block
+    uintptr_t *page = MMU_pf_alloc();
+    assert(page != NULL && "Every free frame should be allocatable");
+    // write address to block
+    for (size_t j = 0; j < MMU_PAGE_SIZE / sizeof(*page); ++j) {
+      page[j] = (uintptr_t)page;
+    }
+    memtest_addrs[i] = page;
+  }
+  assert(MMU_free_frames() == 0 && "Memory should be exhausted");
+  // verify results
+  for (size_t i = 0; i < total_pages; ++i) {
+    uintptr_t *page = memtest_addrs[i];
+    for (size_t j = 0; j < MMU_PAGE_SIZE / sizeof(*page); ++j) {
+      assert(page[j] == (uintptr_t)page &&
+             "bit pattern before and after should match!")
+    }
+  }
+}
 
 void MMU_memtest() {
+  size_t initial[MMU_MAX_ORDER + 1];
+  memtest_snapshot(initial);
+
   // basic allocations
   void *addr1 = MMU_pf_alloc();
   void *addr2 = MMU_pf_alloc();
 
-  assert(addr1 + MMU_PAGE_SIZE == addr2 &&
-         "Addresses should be allocated in order");
+  assert(addr1 != addr2 && "Addresses should be unique");
 
   MMU_pf_free(addr1);
   MMU_pf_free(addr2);
+  memtest_check_snapshot(initial);
 
-  void *addr2_new = MMU_pf_alloc();
-  void *addr1_new = MMU_pf_alloc();
-
-  assert(addr1 == addr1_new && "Addresses should be reused");
-  assert(addr2 == addr2_new && "In reverse order");
-
-  MMU_pf_free(addr1_new);
-  MMU_pf_free(addr2_new);
-
-  // count total allocatable blocks
-  struct MemRegions *regions = multiboot_get_mem_regions();
-  size_t total_pages = 0;
-  for (size_t i = 0; i < regions->size; ++i) {
-    struct MemRegion *region = &regions->d[i];
-    total_pages += (region->end - region->start) / MMU_PAGE_SIZE;
+  // blocks of every order are aligned to their size
+  int max_order = MMU_MAX_ORDER;
+  while (max_order > 0 && free_blocks[max_order] == 0) {
+    --max_order;
+  }
+  for (int order = 0; order <= max_order; ++order) {
+    void *block = MMU_pf_alloc_order(order);
+    assert(block != NULL && "Orders up to the largest free block should split");
+    assert((uintptr_t)block % (MMU_PAGE_SIZE << order) == 0 &&
+           "Blocks should be aligned to their size");
+    MMU_pf_free_order(block, order);
   }
+  memtest_check_snapshot(initial);
+
+  size_t total_pages = MMU_free_frames();
   assert(total_pages <= MEMTEST_ADDR_CAPACITY &&
          "Pages must be less than the capacity of memtest to store addresses");
 
-  // run n cycles of whole memory tests (2 or more allow both allocation
-  // mechanisms to be tested)
+  // run n cycles of whole memory tests, each should merge back completely
   for (size_t c = 0; c < MEMTEST_CYCLES; ++c) {
     printk("Running memtest cycle %lu for %lu pages...\n", c, total_pages);
-    // allocate and write
+    memtest_fill_and_verify(total_pages);
     for (size_t i = 0; i < total_pages; ++i) {
-      // allocate block
-      uintptr_t *page = MMU_pf_alloc();
-      // write address to block
-      for (size_t j = 0; j < MMU_PAGE_SIZE / sizeof(*page); ++j) {
-        page[j] = (uintptr_t)page;
-      }
-      memtest_addrs[i] = page;
+      MMU_pf_free(memtest_addrs[i]);
     }
-    // verify results
-    for (size_t i = 0; i < total_pages; ++i) {
-      uintptr_t *page = memtest_addrs[i];
-      for (size_t j = 0; j < MMU_PAGE_SIZE / sizeof(*page); ++j) {
-        assert(page[j] == (uintptr_t)page &&
-               "bit pattern before and after should match!")
+    memtest_check_snapshot(initial);
+  }
+
+  // worst case fragmentation, every other frame allocated leaves nothing
+  // bigger than a single frame
+  printk("Running fragmentation test...\n");
+  memtest_fill_and_verify(total_pages);
+  for (size_t i = 0; i < total_pages; ++i) {
+    if (((uintptr_t)memtest_addrs[i] / MMU_PAGE_SIZE) % 2 == 0) {
+      MMU_pf_free(memtest_addrs[i]);
+      memtest_addrs[i] = NULL;
+    }
+  }
+  for (int order = 1; order <= MMU_MAX_ORDER; ++order) {
+    assert(free_blocks[order] == 0 &&
+           "Interleaved frames should never merge");
+  }
+  for (size_t i = 0; i < total_pages; ++i) {
+    if (memtest_addrs[i] != NULL) {
+      MMU_pf_free(memtest_addrs[i]);
+    }
+  }
+  memtest_check_snapshot(initial);
+
+  // random mix of orders, allocated and freed out of order
+  printk("Running buddy stress test...\n");
+  uint64_t seed = 0x2545F4914F6CDD1D;
+  for (size_t i = 0; i < MEMTEST_STRESS_SLOTS; ++i) {
+    memtest_addrs[i] = NULL;
+  }
+  for (size_t r = 0; r < MEMTEST_STRESS_ROUNDS; ++r) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    size_t slot = seed % MEMTEST_STRESS_SLOTS;
+    if (memtest_addrs[slot] != NULL) {
+      MMU_pf_free_order(memtest_addrs[slot], memtest_orders[slot]);
+      memtest_addrs[slot] = NULL;
+    } else {
+      int order = (seed >> 32) % (MEMTEST_STRESS_MAX_ORDER + 1);
+      memtest_addrs[slot] = MMU_pf_alloc_order(order);
+      memtest_orders[slot] = order;
+      if (memtest_addrs[slot] != NULL) {
+        // stamp the first word so overlapping blocks would be noticed
+        *memtest_addrs[slot] = (uintptr_t)memtest_addrs[slot];
       }
-      MMU_pf_free(page);
     }
   }
+  for (size_t i = 0; i < MEMTEST_STRESS_SLOTS; ++i) {
+    if (memtest_addrs[i] != NULL) {
+      assert(*memtest_addrs[i] == (uintptr_t)memtest_addrs[i] &&
+             "Blocks should not overlap");
+      MMU_pf_free_order(memtest_addrs[i], memtest_orders[i]);
+    }
+  }
+  memtest_check_snapshot(initial);
+  MMU_pf_print_stats();
 
   printk("Memtest passed.\n");
 }
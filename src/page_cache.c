@@ -0,0 +1,335 @@
+#include "page_cache.h"
+#include "allocator.h"
+#include "interrupts.h"
+#include "meminfo.h"
+#include "page_allocator.h"
+#include "page_table.h"
+#include "processes.h"
+#include "radix_tree.h"
+#include "shrinker.h"
+#include "spinlock.h"
+#include "vfs.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+struct PageCacheMapping {
+  struct SuperBlock *sb;
+  ino_t ino;
+  // page index -> struct CachedPage
+  struct RadixTree pages;
+  struct PageCacheMapping *next;
+};
+
+struct CachedPage {
+  struct PageCacheMapping *mapping;
+  uint64_t index;
+  void *frame;
+  // mapped pages can't be dropped, we have no way to unmap them
+  uint32_t mapcount;
+  // readers copying out of it without the lock, reclaim leaves it alone
+  // until they're done
+  uint32_t pins;
+  bool uptodate;
+  bool referenced;
+  // readers waiting on readpage to fill the frame
+  struct ProcessQueue fill_queue;
+  // CLOCK ring of every cached page
+  struct CachedPage *next;
+  struct CachedPage *prev;
+};
+
+#define MAPPING_HASH_SIZE 64
+static struct PageCacheMapping *mapping_hash[MAPPING_HASH_SIZE];
+
+// guards the mapping hash, every mapping's pages and the CLOCK ring
+static struct Spinlock cache_lock = SPINLOCK_INIT;
+static struct CachedPage *clock_hand = NULL;
+static size_t num_pages = 0;
+static size_t num_mapped_pages = 0;
+
+static size_t mapping_hash_index(struct SuperBlock *sb, ino_t ino) {
+  return (((uintptr_t)sb >> 4) ^ (ino * 0x9E3779B1u)) % MAPPING_HASH_SIZE;
+}
+
+static struct PageCacheMapping *find_mapping(struct Inode *inode) {
+  size_t bucket = mapping_hash_index(inode->sb, inode->ino);
+  struct PageCacheMapping *mapping = mapping_hash[bucket];
+  while (mapping != NULL &&
+         (mapping->sb != inode->sb || mapping->ino != inode->ino)) {
+    mapping = mapping->next;
+  }
+  if (mapping == NULL) {
+    mapping = kmalloc(sizeof(*mapping));
+    if (mapping == NULL) {
+      return NULL;
+    }
+    mapping->sb = inode->sb;
+    mapping->ino = inode->ino;
+    radix_tree_init(&mapping->pages);
+    mapping->next = mapping_hash[bucket];
+    mapping_hash[bucket] = mapping;
+  }
+  return mapping;
+}
+
+// new pages go just behind the hand so they are scanned last
+static void clock_insert(struct CachedPage *page) {
+  if (clock_hand == NULL) {
+    page->next = page;
+    page->prev = page;
+    clock_hand = page;
+  } else {
+    page->next = clock_hand;
+    page->prev = clock_hand->prev;
+    page->prev->next = page;
+    page->next->prev = page;
+  }
+}
+
+static void clock_remove(struct CachedPage *page) {
+  if (page->next == page) {
+    clock_hand = NULL;
+  } else {
+    page->prev->next = page->next;
+    page->next->prev = page->prev;
+    if (clock_hand == page) {
+      clock_hand = page->next;
+    }
+  }
+}
+
+static void page_remove(struct CachedPage *page) {
+  radix_tree_delete(&page->mapping->pages, page->index);
+  clock_remove(page);
+  MMU_pf_free(page->frame);
+  kfree(page);
+  num_pages -= 1;
+  MEMINFO_add(MEMSTAT_PAGE_CACHE, -1);
+}
+
+static size_t clock_reclaim(size_t nr_pages) {
+  size_t freed = 0;
+  // two sweeps at most, the first may only clear referenced bits
+  size_t budget = 2 * num_pages;
+  while (freed < nr_pages && clock_hand != NULL && budget > 0) {
+    struct CachedPage *page = clock_hand;
+    clock_hand = page->next;
+    budget -= 1;
+    if (!page->uptodate || page->mapcount > 0 || page->pins > 0) {
+      continue;
+    }
+    if (page->referenced) {
+      page->referenced = false;
+      continue;
+    }
+    page_remove(page);
+    freed += 1;
+  }
+  return freed;
+}
+
+size_t page_cache_reclaim(size_t nr_pages) {
+  // the cache still makes a few small allocations with the lock held, a new
+  // mapping or a page table for mmap, and reclaim can come from those
+  if (!spin_trylock(&cache_lock)) {
+    return 0;
+  }
+  size_t freed = clock_reclaim(nr_pages);
+  spin_unlock(&cache_lock);
+  return freed;
+}
+
+size_t page_cache_num_pages() { return num_pages; }
+
+// a placeholder for a page not read in yet, with nothing locked since
+// allocating can go into reclaim, which takes cache_lock
+static struct CachedPage *page_alloc() {
+  struct CachedPage *page = kmalloc(sizeof(*page));
+  if (page == NULL) {
+    return NULL;
+  }
+  page->frame = MMU_pf_alloc();
+  if (page->frame == NULL) {
+    kfree(page);
+    return NULL;
+  }
+  page->mapcount = 0;
+  page->pins = 0;
+  page->uptodate = false;
+  page->referenced = true;
+  PROC_init_queue(&page->fill_queue);
+  return page;
+}
+
+static void page_free_unused(struct CachedPage *page) {
+  MMU_pf_free(page->frame);
+  kfree(page);
+}
+
+static size_t page_cache_shrink_count(struct Shrinker *this) {
+  return num_pages - num_mapped_pages;
+}
+
+static size_t page_cache_shrink_scan(struct Shrinker *this, size_t nr_pages) {
+  return page_cache_reclaim(nr_pages);
+}
+
+static struct Shrinker page_cache_shrinker = {
+    .name = "page cache",
+    .count = page_cache_shrink_count,
+    .scan = page_cache_shrink_scan,
+    .next = NULL,
+};
+
+void page_cache_init() { SHRINK_register(&page_cache_shrinker); }
+
+// reclaim can run from any thread on any CPU, so the cache is only looked at
+// with cache_lock held. The page comes back pinned, for the caller to unpin
+// under the lock once it's done with the frame. The lock is let go around
+// allocating and waiting for the disk
+static struct CachedPage *get_page_locked(struct Inode *inode,
+                                          uint64_t index) {
+  struct PageCacheMapping *mapping = find_mapping(inode);
+  if (mapping == NULL) {
+    return NULL;
+  }
+  struct CachedPage *new_page = NULL;
+  struct CachedPage *page;
+  while (true) {
+    page = radix_tree_lookup(&mapping->pages, index);
+    if (page != NULL && page->uptodate) {
+      if (new_page != NULL) {
+        page_free_unused(new_page);
+      }
+      page->referenced = true;
+      page->pins += 1;
+      return page;
+    }
+    if (page != NULL) {
+      // someone else is reading it in, wait for them then look again since
+      // the page is dropped if the read failed
+      // the wait lock is taken first so the page can't be dropped before
+      // we're on its queue
+      PROC_wait_lock();
+      spin_unlock(&cache_lock);
+      if (!page->uptodate) {
+        PROC_block_on(&page->fill_queue, true);
+      } else {
+        PROC_wait_unlock();
+      }
+      spin_lock(&cache_lock);
+      continue;
+    }
+    if (new_page != NULL) {
+      break;
+    }
+    spin_unlock(&cache_lock);
+    new_page = page_alloc();
+    spin_lock(&cache_lock);
+    if (new_page == NULL) {
+      return NULL;
+    }
+    // someone may have read it in while the lock was let go, look again
+  }
+
+  page = new_page;
+  page->mapping = mapping;
+  page->index = index;
+  if (!radix_tree_insert(&mapping->pages, index, page)) {
+    page_free_unused(page);
+    return NULL;
+  }
+  clock_insert(page);
+  num_pages += 1;
+  MEMINFO_add(MEMSTAT_PAGE_CACHE, 1);
+
+  // readpage may block on the disk, the placeholder keeps others from
+  // issuing the same read in the meantime and reclaim skips it
+  spin_unlock(&cache_lock);
+  bool success = inode->readpage(inode, index, page->frame);
+  spin_lock(&cache_lock);
+  page->uptodate = success;
+  PROC_unblock_all(&page->fill_queue);
+  if (!success) {
+    page_remove(page);
+    return NULL;
+  }
+  page->pins += 1;
+  return page;
+}
+
+void *page_cache_get_page(struct Inode *inode, uint64_t index) {
+  spin_lock(&cache_lock);
+  struct CachedPage *page = get_page_locked(inode, index);
+  void *frame = NULL;
+  if (page != NULL) {
+    frame = page->frame;
+    page->pins -= 1;
+  }
+  spin_unlock(&cache_lock);
+  return frame;
+}
+
+int page_cache_read(struct Inode *inode, off_t *cursor, char *dst, int len) {
+  int bytes_read = 0;
+  spin_lock(&cache_lock);
+  while (bytes_read < len && *cursor < inode->st_size) {
+    size_t page_off = *cursor % MMU_PAGE_SIZE;
+    size_t copied = MIN(MMU_PAGE_SIZE - page_off,
+                        MIN((size_t)(len - bytes_read),
+                            inode->st_size - *cursor));
+    struct CachedPage *page = get_page_locked(inode, *cursor / MMU_PAGE_SIZE);
+    if (page == NULL) {
+      break;
+    }
+    // the pin keeps it from being reclaimed while it's copied unlocked
+    spin_unlock(&cache_lock);
+    memcpy(dst, page->frame + page_off, copied);
+    spin_lock(&cache_lock);
+    page->pins -= 1;
+    bytes_read += copied;
+    *cursor += copied;
+    dst += copied;
+  }
+  spin_unlock(&cache_lock);
+  return bytes_read;
+}
+
+// maps the cached pages read only at addr, they stay pinned from then on
+int page_cache_mmap(struct Inode *inode, void *addr) {
+  spin_lock(&cache_lock);
+  struct PageEntry *table = (struct PageEntry *)get_current_page_table();
+  uint64_t num_file_pages =
+      inode->st_size / MMU_PAGE_SIZE + !!(inode->st_size % MMU_PAGE_SIZE);
+  bool success = true;
+  for (uint64_t i = 0; i < num_file_pages; ++i) {
+    struct CachedPage *page = get_page_locked(inode, i);
+    if (page == NULL) {
+      success = false;
+      break;
+    }
+    if (page->mapcount == 0) {
+      num_mapped_pages += 1;
+    }
+    page->mapcount += 1;
+    page->pins -= 1;
+    void *frame = page->frame;
+    void *virt_addr = addr + i * MMU_PAGE_SIZE;
+    struct PTEntry *entry = page_table_get_entry(table, virt_addr, true);
+    if (entry == NULL) {
+      success = false;
+      break;
+    }
+    entry->addr = (uint64_t)frame >> 12;
+    entry->read_write = false;
+    entry->present = true;
+    invlpg(virt_addr);
+  }
+  spin_unlock(&cache_lock);
+  return success;
+}
@@ -1,16 +1,21 @@
 #include "page_table.h"
+#include "alignment.h"
+#include "cpu.h"
+#include "meminfo.h"
 #include "multiboot_tags.h"
 #include "page_allocator.h"
 #include "printk.h"
 #include "smolassert.h"
+#include "smp.h"
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <string.h>
 
 #define PAGE_TABLE_LEVEL_SIZE 512
 #define PAGE_TABLE_NUM_LEVELS 4
+// bytes mapped by a single entry at each level, 0 being the page table
+#define PAGE_TABLE_LEVEL_SPAN(level) (1lu << (9 * (level) + 12))
 
 void split_virt_addr(void *virt_addr, uint16_t indices[PAGE_TABLE_NUM_LEVELS],
                      uint16_t *offset) {
@@ -25,64 +30,330 @@ void split_virt_addr(void *virt_addr, uint16_t indices[PAGE_TABLE_NUM_LEVELS],
   }
 }
 
-struct PTEntry *page_table_get_entry(struct PageEntry *table, void *virt_addr,
-                                     bool allocate) {
+static inline void load_page_table(struct PML4Entry *pml4_table) {
+  asm volatile("mov %0, %%cr3" : : "r"(pml4_table));
+}
+
+static struct PageEntry *page_table_alloc_table() {
+  struct PageEntry *table = MMU_pf_alloc_zeroed();
+  if (table == NULL) {
+    return NULL;
+  }
+  MEMINFO_add(MEMSTAT_PAGE_TABLES, 1);
+  return table;
+}
+
+// turns a huge entry at level into a table one level down that maps the same
+// range with the same permissions
+static bool page_table_split(struct PageEntry *entry, int level) {
+  struct PageEntry *table = page_table_alloc_table();
+  if (table == NULL) {
+    return false;
+  }
+  uint64_t step = PAGE_TABLE_LEVEL_SPAN(level - 1) / MMU_PAGE_SIZE;
+  for (int i = 0; i < PAGE_TABLE_LEVEL_SIZE; ++i) {
+    table[i] = *entry;
+    table[i].addr = entry->addr + i * step;
+    // a 1 GiB page splits into 2 MiB pages, those split into plain pages
+    table[i].page_size = level - 1 > 0;
+  }
+  entry->page_size = false;
+  entry->addr = (uint64_t)table >> 12;
+  load_page_table(get_current_page_table());
+  return true;
+}
+
+// the table an entry at level points to, creating it when missing and
+// splitting a huge page into it if asked to
+static struct PageEntry *page_table_next(struct PageEntry *entry, int level,
+                                         bool allocate, bool split) {
+  if (entry->present && entry->page_size) {
+    if (!split || !page_table_split(entry, level)) {
+      return NULL;
+    }
+  }
+  if (!entry->present) {
+    if (!allocate) {
+      return NULL;
+    }
+    struct PageEntry *next_table = page_table_alloc_table();
+    if (next_table == NULL) {
+      return NULL;
+    }
+    entry->present = true;
+    entry->read_write = true;
+    entry->addr = (uint64_t)next_table >> 12;
+  }
+  return (struct PageEntry *)((uint64_t)entry->addr << 12);
+}
+
+// finds the entry for virt_addr at the given level (0 being the page table),
+// descending through and optionally creating the tables above it
+static struct PageEntry *page_table_get_level_entry(struct PageEntry *table,
+                                                    void *virt_addr, int level,
+                                                    bool allocate) {
   uint16_t indices[PAGE_TABLE_NUM_LEVELS], offset;
   split_virt_addr(virt_addr, indices, &offset);
-  for (int l = PAGE_TABLE_NUM_LEVELS - 1; l > 0; --l) {
+  for (int l = PAGE_TABLE_NUM_LEVELS - 1; l > level && table != NULL; --l) {
+    table = page_table_next(&table[indices[l]], l, allocate, allocate);
+  }
+  return table == NULL ? NULL : &table[indices[level]];
+}
+
+struct PTEntry *page_table_get_entry(struct PageEntry *table, void *virt_addr,
+                                     bool allocate) {
+  return (struct PTEntry *)page_table_get_level_entry(table, virt_addr, 0,
+                                                      allocate);
+}
+
+void *page_table_virt_to_phys_addr(struct PageEntry *table, void *virt_addr) {
+  uint16_t indices[PAGE_TABLE_NUM_LEVELS];
+  split_virt_addr(virt_addr, indices, NULL);
+  for (int l = PAGE_TABLE_NUM_LEVELS - 1; l >= 0; --l) {
     struct PageEntry *entry = &table[indices[l]];
     if (!entry->present) {
-      if (allocate) {
-        struct PageEntry *next_table = MMU_pf_alloc();
-        memset(next_table, 0, MMU_PAGE_SIZE);
-        entry->present = true;
-        entry->read_write = true;
-        entry->addr = (uint64_t)next_table >> 12;
-      } else {
-        return NULL;
-      }
+      return NULL;
+    }
+    if (l == 0 || entry->page_size) {
+      uint64_t offset = (uint64_t)virt_addr & (PAGE_TABLE_LEVEL_SPAN(l) - 1);
+      return (void *)(((uint64_t)entry->addr << 12) + offset);
     }
     table = (struct PageEntry *)((uint64_t)entry->addr << 12);
   }
-  return (struct PTEntry *)&table[indices[0]];
+  return NULL;
 }
 
-void *page_table_virt_to_phys_addr(struct PageEntry *table, void *virt_addr) {
-  struct PTEntry *entry = page_table_get_entry(table, virt_addr, false);
-  if (entry == NULL) {
-    return NULL;
+void tlb_batch_add(struct TlbBatch *batch, void *virt_addr) {
+  if (batch->count < TLB_BATCH_MAX) {
+    batch->addrs[batch->count] = virt_addr;
+  }
+  batch->count += 1;
+}
+
+void tlb_batch_flush(struct TlbBatch *batch) {
+  // past the threshold dropping the whole TLB is cheaper than page by page
+  if (batch->count > TLB_BATCH_MAX) {
+    load_page_table(get_current_page_table());
+  } else {
+    for (size_t i = 0; i < batch->count; ++i) {
+      invlpg(batch->addrs[i]);
+    }
+  }
+  // every CPU shares the tables, so the others may be caching them too
+  if (batch->count > 0) {
+    SMP_tlb_shootdown();
+  }
+  batch->count = 0;
+}
+
+struct RangeWalk {
+  bool allocate;
+  entry_callback_t callback;
+  void *arg;
+};
+
+// visits [start, end) within a table at level, which the range must lie in,
+// so each table on the way is only descended into once
+static bool walk_level(struct PageEntry *table, int level, uint64_t start,
+                       uint64_t end, struct RangeWalk *walk) {
+  uint64_t span = PAGE_TABLE_LEVEL_SPAN(level);
+  uint16_t index = (start >> (9 * level + 12)) & 0x1FF;
+  for (uint64_t addr = start; addr < end; ++index) {
+    uint64_t next = (addr & ~(span - 1)) + span;
+    if (next > end) {
+      next = end;
+    }
+    struct PageEntry *entry = &table[index];
+    if (level == 0) {
+      walk->callback((void *)addr, (struct PTEntry *)entry, walk->arg);
+    } else {
+      struct PageEntry *next_table =
+          page_table_next(entry, level, walk->allocate, true);
+      if (next_table != NULL) {
+        if (!walk_level(next_table, level - 1, addr, next, walk)) {
+          return false;
+        }
+      } else if (walk->allocate || entry->present) {
+        // no frame for a new table or for splitting a huge page
+        return false;
+      }
+    }
+    addr = next;
   }
-  uint16_t offset;
-  split_virt_addr(virt_addr, NULL, &offset);
-  return (void *)(((uint64_t)entry->addr << 12) + offset);
+  return true;
 }
 
-void direct_map_callback(void *addr, struct PTEntry *entry) {
+bool page_table_walk(struct PageEntry *table, void *start_addr, void *end_addr,
+                     bool allocate, entry_callback_t callback, void *arg) {
+  struct RangeWalk walk = {allocate, callback, arg};
+  uint64_t start = (uint64_t)start_addr & ~(uint64_t)(MMU_PAGE_SIZE - 1);
+  bool success = walk_level(table, PAGE_TABLE_NUM_LEVELS - 1, start,
+                            (uint64_t)end_addr, &walk);
+  if (!success) {
+    printk("page_table_walk: out of memory for page tables in %lx-%lx\n",
+           (uintptr_t)start_addr, (uintptr_t)end_addr);
+  }
+  return success;
+}
+
+struct MapRange {
+  void *virt_start;
+  void *phys_start;
+  bool writable;
+  struct TlbBatch *batch;
+};
+
+static void map_callback(void *addr, struct PTEntry *entry, void *arg) {
+  struct MapRange *range = arg;
+  if (entry->present) {
+    tlb_batch_add(range->batch, addr);
+  }
+  entry->addr = (uint64_t)(range->phys_start + (addr - range->virt_start)) >> 12;
+  entry->read_write = range->writable;
+  entry->present = true;
+}
+
+bool page_table_map(struct PageEntry *table, void *virt_start, void *virt_end,
+                    void *phys_start, bool writable, struct TlbBatch *batch) {
+  struct MapRange range = {virt_start, phys_start, writable, batch};
+  return page_table_walk(table, virt_start, virt_end, true, &map_callback,
+                         &range);
+}
+
+static void unmap_callback(void *addr, struct PTEntry *entry, void *arg) {
+  if (entry->present) {
+    entry->present = false;
+    tlb_batch_add(arg, addr);
+  }
+}
+
+bool page_table_unmap(struct PageEntry *table, void *virt_start, void *virt_end,
+                      struct TlbBatch *batch) {
+  return page_table_walk(table, virt_start, virt_end, false, &unmap_callback,
+                         batch);
+}
+
+struct ProtectRange {
+  bool writable;
+  struct TlbBatch *batch;
+};
+
+static void protect_callback(void *addr, struct PTEntry *entry, void *arg) {
+  struct ProtectRange *range = arg;
+  if (entry->present && entry->read_write != range->writable) {
+    entry->read_write = range->writable;
+    tlb_batch_add(range->batch, addr);
+  }
+}
+
+bool page_table_protect(struct PageEntry *table, void *virt_start,
+                        void *virt_end, bool writable, struct TlbBatch *batch) {
+  struct ProtectRange range = {writable, batch};
+  return page_table_walk(table, virt_start, virt_end, false, &protect_callback,
+                         &range);
+}
+
+bool page_table_map_phys(struct PageEntry *table, void *phys_addr, size_t size,
+                         bool writable) {
+  uintptr_t start = align_pointer((uintptr_t)phys_addr, MMU_PAGE_SIZE, false);
+  uintptr_t end =
+      align_pointer((uintptr_t)phys_addr + size, MMU_PAGE_SIZE, true);
+  struct TlbBatch batch;
+  tlb_batch_init(&batch);
+  bool mapped = page_table_map(table, (void *)start, (void *)end,
+                               (void *)start, writable, &batch);
+  tlb_batch_flush(&batch);
+  return mapped;
+}
+
+bool page_table_map_huge(struct PageEntry *table, void *virt_addr,
+                         void *phys_addr, struct TlbBatch *batch) {
+  struct PageEntry *entry =
+      page_table_get_level_entry(table, virt_addr, 1, true);
+  if (entry == NULL) {
+    return false;
+  }
+  if (entry->present && !entry->page_size) {
+    // tables are kept around once the pages in them are gone
+    struct PTEntry *old = (struct PTEntry *)((uint64_t)entry->addr << 12);
+    for (int i = 0; i < PAGE_TABLE_LEVEL_SIZE; ++i) {
+      if (old[i].present || old[i].available1) {
+        return false;
+      }
+    }
+    MMU_pf_free(old);
+    MEMINFO_add(MEMSTAT_PAGE_TABLES, -1);
+    // paging structure caches may still point at the old table
+    tlb_batch_add(batch, virt_addr);
+  }
   entry->present = true;
   entry->read_write = true;
-  entry->addr = (uint64_t)addr >> 12;
+  entry->page_size = true;
+  entry->addr = (uint64_t)phys_addr >> 12;
+  return true;
 }
 
-void page_table_walk(struct PageEntry *table, void *start_addr, void *end_addr,
-                     entry_callback_t callback) {
-  uint16_t indices[4], offset;
-  for (void *addr = start_addr; addr < end_addr; addr += MMU_PAGE_SIZE) {
-    struct PTEntry *entry = page_table_get_entry(table, addr, true);
-    callback(addr, entry);
+void *page_table_unmap_huge(struct PageEntry *table, void *virt_addr,
+                            struct TlbBatch *batch) {
+  struct PageEntry *entry =
+      page_table_get_level_entry(table, virt_addr, 1, false);
+  if (entry == NULL || !entry->present || !entry->page_size) {
+    return NULL;
   }
+  entry->present = false;
+  entry->page_size = false;
+  tlb_batch_add(batch, virt_addr);
+  return (void *)((uint64_t)entry->addr << 12);
 }
 
-static inline void load_page_table(struct PML4Entry *pml4_table) {
-  asm volatile("mov %0, %%cr3" : : "r"(pml4_table));
+// maps [MMU_PAGE_SIZE, mem_end) onto itself with the largest pages that fit,
+// page 0 is left out so NULL dereferences still fault
+static void direct_map(struct PageEntry *pml4_table, void *mem_end,
+                       bool gigabyte_pages) {
+  uint64_t end = (uint64_t)mem_end;
+  uint64_t addr = MMU_PAGE_SIZE;
+  while (addr < end) {
+    int level = 0;
+#ifndef DIRECT_MAP_4K
+    for (int l = gigabyte_pages ? 2 : 1; l > 0; --l) {
+      if (addr % PAGE_TABLE_LEVEL_SPAN(l) == 0 &&
+          addr + PAGE_TABLE_LEVEL_SPAN(l) <= end) {
+        level = l;
+        break;
+      }
+    }
+#endif
+    struct PageEntry *entry =
+        page_table_get_level_entry(pml4_table, (void *)addr, level, true);
+    if (entry == NULL) {
+      printk("direct_map: out of memory for page tables at %lx\n", addr);
+      return;
+    }
+    entry->present = true;
+    entry->read_write = true;
+    entry->page_size = level > 0;
+    entry->addr = addr >> 12;
+    addr += PAGE_TABLE_LEVEL_SPAN(level);
+  }
 }
 
 struct PML4Entry *init_page_table() {
-  struct PML4Entry *pml4_table = MMU_pf_alloc();
-  memset(pml4_table, 0, MMU_PAGE_SIZE);
+  uint64_t start_tsc = rdtsc();
+  struct PML4Entry *pml4_table =
+      (struct PML4Entry *)page_table_alloc_table();
+  assert(pml4_table != NULL && "No frame for the PML4");
   struct MemRegions *regions = multiboot_get_mem_regions();
   void *mem_end = regions->d[regions->size - 1].end;
-  page_table_walk((struct PageEntry *)pml4_table, (void *)MMU_PAGE_SIZE,
-                  mem_end, &direct_map_callback);
+  bool gigabyte_pages = CPU_has_pdpe1gb();
+  direct_map((struct PageEntry *)pml4_table, mem_end, gigabyte_pages);
+  printk("direct map: %lu page table frames, %lu cycles, %s pages\n",
+         MEMINFO_get(MEMSTAT_PAGE_TABLES), rdtsc() - start_tsc,
+#ifdef DIRECT_MAP_4K
+         "4K"
+#else
+         gigabyte_pages ? "1G" : "2M"
+#endif
+  );
   uint16_t indices[4], offset;
   split_virt_addr((void *)(2lu << 39), indices, &offset);
   printk("address components: %lx -> [PML %hx][PDP %hx][PD %hx][PT %hx][OFF "
@@ -1,5 +1,6 @@
 #include "printk.h"
 #include "serial.h"
+#include "spinlock.h"
 #include "vga.h"
 
 #include <stdarg.h>
@@ -124,11 +125,16 @@ int print_string(const char *s) {
  * - %q[dux] long long? format (prefer ll)
  * - %s
  */
+// interrupt handlers print too, so it's only taken with interrupts off
+static struct Spinlock printk_lock = SPINLOCK_INIT;
+
 int printk(const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
 
   size_t printed = 0;
+  // keeps lines from different CPUs whole and the VGA cursor consistent
+  SPIN_LOCK_GUARD(&printk_lock);
 
   while (*fmt != '\0') {
     if (*fmt == '%') {
@@ -178,5 +184,6 @@ int printk(const char *fmt, ...) {
     fmt += 1;
   }
 
+  SPIN_UNLOCK_GUARD(&printk_lock);
   return printed;
 }
@@ -1,8 +1,14 @@
 #include "processes.h"
 #include "allocator.h"
-#include "gdt.h"
+#include "cpu.h"
 #include "interrupts.h"
+#include "preempt.h"
+#include "printk.h"
+#include "slab.h"
 #include "smolassert.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -10,33 +16,76 @@
 
 #define PROC_STACK_SIZE 8192
 
-// used to setup new processes
-struct InitalProcFrame {
-  // stack pointer stored directly in context
-  // stack base pointer
-  void *rbp;
-  // initial saved processor state
-  // segment registers
-  uint64_t gs, fs, es, ds;
-  // standard registers
-  uint64_t r15, r14, r13, r12, rbx, r11, r10, r9, r8, rdi, rsi, rdx, rcx, rax;
-  // iretq frame, will be set to "return" into entry
-  void *rip;
-  uint64_t cs;
-  uint64_t rflags;
-  void *rsp;
-  uint64_t ss;
-  // kexit return, to be called after the process finishes
-  void *kexit_ret;
-} __attribute__((packed));
+// what switch_to pops off a new thread's stack. The padding leaves the stack
+// 16 byte aligned once it returns into proc_thread_start
+struct InitialSwitchFrame {
+  uint64_t r15, r14, r13, r12, rbx, rbp;
+  void *ret;
+  uint64_t padding[2];
+};
 
+// switch.asm
+void switch_to(struct ProcNode *prev, struct ProcNode *next);
+void proc_thread_start();
+
+struct SchedStats {
+  size_t switches;
+  size_t preemptions;
+  // switches to a more urgent thread before the slice ran out
+  size_t wake_preemptions;
+  // slices that ran out while preemption was disabled
+  size_t deferred;
+  // threads taken from another CPU's run queue
+  size_t steals;
+  // wakeups from an interrupt that switched straight to the woken thread
+  size_t handoffs;
+  // cycles from becoming runnable to being switched to
+  uint64_t latency_total;
+  uint64_t latency_max;
+};
+
+struct RunQueue {
+  struct Spinlock lock;
+  // a round robin queue per priority, with a bit set for every non-empty one
+  struct ProcessQueue queues[PROC_NUM_PRIOS];
+  uint32_t bitmap;
+  unsigned slice_left;
+  // something more urgent became runnable while it couldn't be switched to
+  bool need_resched;
+  // woken by a softirq to run here as soon as they're all done, and kept
+  // from being stolen until then
+  struct ProcNode *handoff;
+  // a thread that exited and switched away, left for the next one to put on
+  // the exited list since its stack was still in use until then
+  struct ProcNode *dead;
+  // stands in for the idle loop that called PROC_run
+  struct ProcNode source_proc;
+  struct ProcContext source_ctx;
+  struct SchedStats stats;
+};
+
+// one per CPU, only ever switched to from the CPU that owns it. Lock order is
+// the wait lock, then a run queue lock, never two run queues at once
+static struct RunQueue run_queues[CPU_MAX];
+static struct Spinlock wait_lock = SPINLOCK_INIT;
 static size_t pid_count = 0;
-static struct ProcessQueue avail_procs = {NULL};
-static struct ProcNode source_proc;
-static struct ProcContext source_proc_ctx;
+// new threads are dealt out to the CPUs in turn
+static unsigned next_cpu = 0;
+// threads that exited, their stacks can't be freed until we're off them
+static struct ProcessQueue exited_procs = {NULL};
+static struct Spinlock exit_lock = SPINLOCK_INIT;
+static struct KmemCache *proc_node_cache;
+static struct KmemCache *proc_context_cache;
+
+static unsigned time_slice = PROC_DEFAULT_TIME_SLICE;
+static int wake_boost = PROC_WAKE_BOOST;
 
-struct ProcNode *cur_proc = NULL;
-struct ProcNode *next_proc = NULL;
+// only stable with interrupts or preemption off
+static inline struct RunQueue *this_rq() { return &run_queues[CPU_id()]; }
+
+static inline bool is_idle(struct ProcNode *cur, struct RunQueue *rq) {
+  return cur == NULL || cur == &rq->source_proc;
+}
 
 static struct ProcNode *cycle_next_proc(struct ProcessQueue *queue) {
   if (queue->head) {
@@ -73,102 +122,843 @@ static void append_proc(struct ProcNode *node, struct ProcessQueue *queue) {
   }
 }
 
-void PROC_block_on(struct ProcessQueue *queue, int enable_ints) {
-  if (queue == NULL)
+// the run queue helpers all expect rq->lock held
+static void enqueue_proc(struct RunQueue *rq, struct ProcNode *node) {
+  append_proc(node, &rq->queues[node->prio]);
+  rq->bitmap |= 1u << node->prio;
+}
+
+static void dequeue_proc(struct RunQueue *rq, struct ProcNode *node) {
+  struct ProcessQueue *queue = &rq->queues[node->prio];
+  unlink_proc(node, queue);
+  if (queue->head == NULL) {
+    rq->bitmap &= ~(1u << node->prio);
+  }
+}
+
+static struct ProcNode *pick_next_proc(struct RunQueue *rq) {
+  if (rq->bitmap == 0) {
+    return NULL;
+  }
+  return cycle_next_proc(&rq->queues[__builtin_ctz(rq->bitmap)]);
+}
+
+// queues node on the CPU it belongs to and gets that CPU to look at it if
+// it's idle or running something less urgent
+static void ready_proc(struct ProcNode *node) {
+  unsigned target = node->cpu;
+  struct RunQueue *rq = &run_queues[target];
+  SPIN_LOCK_GUARD(&rq->lock);
+  enqueue_proc(rq, node);
+  struct ProcNode *cur = SMP_cpu(target)->cur_proc;
+  bool idle = is_idle(cur, rq);
+  bool preempt = !idle && node->prio < cur->prio;
+  if (preempt) {
+    rq->need_resched = true;
+  }
+  spin_unlock(&rq->lock);
+  if (target != CPU_id()) {
+    if (idle || preempt) {
+      SMP_send_resched(target);
+    }
+  } else if (preempt && IRQ_in_interrupt() && preempt_count() == 0) {
+    // switches on the way out of the interrupt that woke it
+    rq->stats.wake_preemptions += 1;
+    PROC_reschedule();
+  }
+  STI_GUARD;
+}
+
+static void boost_proc(struct ProcNode *node) {
+  node->runnable_since = rdtsc();
+  // threads that sleep a lot get to cut in front of the ones that don't
+  int boosted = node->base_prio - wake_boost;
+  if (boosted < PROC_PRIO_HIGHEST) {
+    boosted = PROC_PRIO_HIGHEST;
+  }
+  if (boosted < node->prio) {
+    node->prio = boosted;
+  }
+}
+
+static void wake_proc(struct ProcNode *node) {
+  boost_proc(node);
+  ready_proc(node);
+}
+
+void PROC_wait_lock() {
+  CLI;
+  spin_lock(&wait_lock);
+}
+
+void PROC_wait_unlock() {
+  spin_unlock(&wait_lock);
+  STI;
+}
+
+static void block_on(struct ProcessQueue *queue, int enable_ints,
+                     bool exclusive) {
+  if (queue == NULL) {
+    PROC_wait_unlock();
     return;
+  }
 
-  unlink_proc(cur_proc, &avail_procs);
-  append_proc(cur_proc, queue);
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  spin_lock(&rq->lock);
+  dequeue_proc(rq, cpu->cur_proc);
+  spin_unlock(&rq->lock);
+  append_proc(cpu->cur_proc, queue);
+  cpu->cur_proc->blocked_on = queue;
+  cpu->cur_proc->exclusive = exclusive;
+  // interrupts stay off, the timer mustn't find it running outside of a run
+  // queue. A waker can put it back on one before the switch, which is fine,
+  // it's still current here so nobody else will run it
+  spin_unlock(&wait_lock);
+  yield();
   if (enable_ints)
     STI;
+}
 
-  yield();
+void PROC_block_on(struct ProcessQueue *queue, int enable_ints) {
+  block_on(queue, enable_ints, false);
+}
+
+void PROC_block_on_exclusive(struct ProcessQueue *queue, int enable_ints) {
+  block_on(queue, enable_ints, true);
+}
+
+struct BlockTimeout {
+  struct ProcNode *node;
+  struct ProcessQueue *queue;
+  bool timed_out;
+};
+
+static void block_timeout_expired(void *arg) {
+  struct BlockTimeout *timeout = arg;
+  struct ProcNode *node = timeout->node;
+  SPIN_LOCK_GUARD(&wait_lock);
+  // an unblock may have got there first
+  bool waiting = timeout->queue != NULL && node->blocked_on == timeout->queue;
+  if (waiting) {
+    unlink_proc(node, timeout->queue);
+    node->blocked_on = NULL;
+    timeout->timed_out = true;
+  }
+  SPIN_UNLOCK_GUARD(&wait_lock);
+  if (waiting) {
+    wake_proc(node);
+  }
+}
+
+bool PROC_block_on_timeout(struct ProcessQueue *queue, int enable_ints,
+                           uint64_t timeout_ns) {
+  struct BlockTimeout timeout = {
+      .node = CPU_this()->cur_proc, .queue = queue, .timed_out = false};
+  struct Timer timer;
+  TIMER_setup(&timer, block_timeout_expired, &timeout);
+  TIMER_arm(&timer, timeout_ns);
+  PROC_block_on(queue, false);
+  // waits for the callback if it's mid way through, it points at this stack
+  TIMER_cancel(&timer);
+  if (enable_ints)
+    STI;
+  return !timeout.timed_out;
 }
 
 void PROC_unblock_all(struct ProcessQueue *queue) {
-  while (queue->head != NULL) {
-    PROC_unblock_head(queue);
+  SPIN_LOCK_GUARD(&wait_lock);
+  struct ProcNode *first = queue->head;
+  queue->head = NULL;
+  if (first != NULL) {
+    // so a timeout firing now knows they've already been taken off
+    struct ProcNode *node = first;
+    do {
+      node->blocked_on = NULL;
+      node = node->next;
+    } while (node != first);
+  }
+  SPIN_UNLOCK_GUARD(&wait_lock);
+  if (first == NULL) {
+    return;
   }
+  // detached, so the rest are left alone while the woken ones run
+  struct ProcNode *node = first;
+  do {
+    struct ProcNode *next = node->next;
+    wake_proc(node);
+    node = next;
+  } while (node != first);
 }
 
-void PROC_unblock_head(struct ProcessQueue *queue) {
+bool PROC_unblock_one(struct ProcessQueue *queue) {
+  SPIN_LOCK_GUARD(&wait_lock);
   struct ProcNode *node = queue->head;
-  assert(node != NULL && "Cannot unblock null head");
-  unlink_proc(node, queue);
-  append_proc(node, &avail_procs);
+  if (node != NULL) {
+    unlink_proc(node, queue);
+    node->blocked_on = NULL;
+  }
+  SPIN_UNLOCK_GUARD(&wait_lock);
+  if (node != NULL) {
+    wake_proc(node);
+  }
+  return node != NULL;
+}
+
+void PROC_unblock_head(struct ProcessQueue *queue) {
+  bool woken = PROC_unblock_one(queue);
+  assert(woken && "Cannot unblock null head");
+}
+
+bool PROC_has_unblocked() { return this_rq()->bitmap != 0; }
+
+void PROC_latency_record(struct WakeLatency *latency, uint64_t since) {
+  uint64_t cycles = rdtsc() - since;
+  __atomic_add_fetch(&latency->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&latency->total, cycles, __ATOMIC_RELAXED);
+  // racy, a concurrent max can be lost
+  if (cycles > latency->max) {
+    latency->max = cycles;
+  }
 }
 
-bool PROC_has_unblocked() { return avail_procs.head != NULL; }
+void PROC_latency_print(const char *name, struct WakeLatency *latency) {
+  printk("%s: %lu wakeups, latency avg %lu max %lu cycles\n", name,
+         latency->count, latency->total / (latency->count | 1),
+         latency->max);
+}
 
 void PROC_init_queue(struct ProcessQueue *queue) { queue->head = NULL; }
 
-void PROC_resume_source() { next_proc = &source_proc; }
+// bookkeeping for a switch about to happen to node
+static void switching_to(struct RunQueue *rq, struct Cpu *cpu,
+                         struct ProcNode *node) {
+  if (node == cpu->cur_proc || node == &rq->source_proc) {
+    return;
+  }
+  uint64_t latency = rdtsc() - node->runnable_since;
+  rq->stats.switches += 1;
+  rq->stats.latency_total += latency;
+  if (latency > rq->stats.latency_max) {
+    rq->stats.latency_max = latency;
+  }
+  rq->slice_left = time_slice;
+  rq->need_resched = false;
+}
 
-void noop_handler(int number, int error_code, void *arg) {}
+// a thread can be woken after going on a wait queue but before it's
+// switched away from, it's still its CPU's cur_proc until its rsp is saved.
+// Same check as find_stealable, moving it now would run it on two CPUs
+static bool on_cpu(struct ProcNode *node) {
+  struct RunQueue *rq = &run_queues[node->cpu];
+  struct Cpu *cpu = SMP_cpu(node->cpu);
+  SPIN_LOCK_GUARD(&rq->lock);
+  bool running = node == cpu->cur_proc || node == cpu->next_proc;
+  SPIN_UNLOCK_GUARD(&rq->lock);
+  return running;
+}
 
-void kexit_handler(int number, int error_code, void *arg) {
-  unlink_proc(cur_proc, &avail_procs);
-  kfree(cur_proc->context->frame);
-  kfree(cur_proc->context);
-  kfree(cur_proc);
-  cur_proc = NULL;
-  if (avail_procs.head == NULL) {
-    // all processes completed
-    PROC_resume_source();
-  } else {
-    // otherwise set next proc to head of proclist
-    next_proc = avail_procs.head;
+// runs node on this CPU as soon as the interrupt that woke it returns, ahead
+// of whatever it interrupted, instead of leaving it to wait its turn
+static void handoff_proc(struct ProcNode *node) {
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  // softirqs hold preemption off themselves, whether what they interrupted
+  // did is only known once they're done
+  bool softirq = IRQ_in_softirq();
+  // an idle CPU picks it up as soon as it's out of the hlt anyway, and has
+  // its tick stopped besides
+  if (!IRQ_in_interrupt() || (preempt_count() > 0 && !softirq) ||
+      is_idle(cpu->cur_proc, rq) || (node->pinned && node->cpu != cpu->id) ||
+      on_cpu(node)) {
+    wake_proc(node);
+    return;
+  }
+  boost_proc(node);
+  node->cpu = cpu->id;
+  if (softirq) {
+    SPIN_LOCK_GUARD(&rq->lock);
+    enqueue_proc(rq, node);
+    rq->handoff = node;
+    SPIN_UNLOCK_GUARD(&rq->lock);
+    return;
+  }
+  spin_lock(&rq->lock);
+  enqueue_proc(rq, node);
+  cpu->cur_proc->runnable_since = rdtsc();
+  cpu->next_proc = node;
+  spin_unlock(&rq->lock);
+  rq->stats.handoffs += 1;
+  switching_to(rq, cpu, node);
+}
+
+size_t PROC_wake(struct ProcessQueue *queue, int flags) {
+  struct ProcessQueue woken = {NULL};
+  SPIN_LOCK_GUARD(&wait_lock);
+  struct ProcNode *node = queue->head;
+  // stops after the tail it started with, whatever's unlinked on the way
+  struct ProcNode *last = node != NULL ? node->prev : NULL;
+  bool exclusive_woken = false;
+  while (node != NULL) {
+    struct ProcNode *next = node == last ? NULL : node->next;
+    if (!node->exclusive || !exclusive_woken || (flags & PROC_WAKE_ALL)) {
+      exclusive_woken |= node->exclusive;
+      unlink_proc(node, queue);
+      node->blocked_on = NULL;
+      append_proc(node, &woken);
+    }
+    node = next;
+  }
+  SPIN_UNLOCK_GUARD(&wait_lock);
+
+  size_t num_woken = 0;
+  while (woken.head != NULL) {
+    node = woken.head;
+    unlink_proc(node, &woken);
+    if (num_woken == 0 && (flags & PROC_WAKE_HANDOFF)) {
+      handoff_proc(node);
+    } else {
+      wake_proc(node);
+    }
+    num_woken += 1;
   }
+  return num_woken;
+}
+
+static void reap_exited_procs() {
+  while (true) {
+    SPIN_LOCK_GUARD(&exit_lock);
+    struct ProcNode *node = exited_procs.head;
+    if (node != NULL) {
+      unlink_proc(node, &exited_procs);
+    }
+    SPIN_UNLOCK_GUARD(&exit_lock);
+    if (node == NULL) {
+      return;
+    }
+    kfree(node->context->frame);
+    kmem_cache_free(proc_context_cache, node->context);
+    kmem_cache_free(proc_node_cache, node);
+  }
+}
+
+// runs first thing on whatever was switched to, on the same CPU and still
+// with interrupts off
+void PROC_finish_switch() {
+  struct RunQueue *rq = this_rq();
+  if (rq->dead != NULL) {
+    spin_lock(&exit_lock);
+    append_proc(rq->dead, &exited_procs);
+    spin_unlock(&exit_lock);
+    rq->dead = NULL;
+  }
+}
+
+// with interrupts off. Returns once something switches back, possibly on
+// another CPU
+static void context_switch(struct Cpu *cpu, struct ProcNode *next) {
+  switch_to(cpu->cur_proc, next);
+  PROC_finish_switch();
+}
+
+// from isr_handler.asm, when the interrupt picked something else to run
+void PROC_switch_from_irq() {
+  struct Cpu *cpu = CPU_this();
+  context_switch(cpu, cpu->next_proc);
+}
+
+// the first thread queued on victim that isn't running or about to be
+static struct ProcNode *find_stealable(struct RunQueue *rq,
+                                       struct Cpu *victim) {
+  for (uint32_t bits = rq->bitmap; bits != 0; bits &= bits - 1) {
+    struct ProcNode *head = rq->queues[__builtin_ctz(bits)].head;
+    struct ProcNode *node = head;
+    do {
+      if (!node->pinned && node != victim->cur_proc &&
+          node != victim->next_proc && node != rq->handoff) {
+        return node;
+      }
+      node = node->next;
+    } while (node != head);
+  }
+  return NULL;
+}
+
+// moves a thread another CPU has waiting over here, called from the idle
+// loop so a CPU with nothing to do doesn't sit halted next to a backlog
+static bool steal_proc() {
+  unsigned self = CPU_id();
+  unsigned num_cpus = SMP_num_cpus();
+  for (unsigned i = 1; i < num_cpus; ++i) {
+    unsigned victim = (self + i) % num_cpus;
+    struct RunQueue *rq = &run_queues[victim];
+    // a racy peek, saves taking every lock just to find them empty
+    if (rq->bitmap == 0) {
+      continue;
+    }
+    SPIN_LOCK_GUARD(&rq->lock);
+    struct ProcNode *node = find_stealable(rq, SMP_cpu(victim));
+    if (node != NULL) {
+      dequeue_proc(rq, node);
+    }
+    SPIN_UNLOCK_GUARD(&rq->lock);
+    if (node != NULL) {
+      node->cpu = self;
+      run_queues[self].stats.steals += 1;
+      ready_proc(node);
+      return true;
+    }
+  }
+  return false;
 }
 
 void PROC_run() {
-  if (avail_procs.head != NULL) {
-    IRQ_handler_set(0x80, noop_handler, NULL);
-    // set cur_proc to be this thread
-    memset(&source_proc_ctx, 0, sizeof(source_proc_ctx));
-    memset(&source_proc, 0, sizeof(source_proc));
-    source_proc.context = &source_proc_ctx;
-    IRQ_handler_set(0x81, kexit_handler, NULL);
-    cur_proc = &source_proc;
-    PROC_reschedule();
-    asm volatile("int $0x80");
-    IRQ_handler_set(0x80, NULL, NULL);
-    IRQ_handler_set(0x81, NULL, NULL);
+  if (!PROC_has_unblocked() && !steal_proc()) {
+    return;
+  }
+  // the idle loop becomes the thread switched away from, and back to once
+  // nothing here is runnable
+  CPU_this()->cur_proc = &this_rq()->source_proc;
+  yield();
+}
+
+void PROC_init() {
+  proc_node_cache =
+      kmem_cache_create("proc_node", sizeof(struct ProcNode), 0, NULL);
+  proc_context_cache =
+      kmem_cache_create("proc_context", sizeof(struct ProcContext), 0, NULL);
+  for (unsigned cpu = 0; cpu < CPU_MAX; ++cpu) {
+    struct RunQueue *rq = &run_queues[cpu];
+    spin_lock_init(&rq->lock);
+    rq->slice_left = time_slice;
+    rq->source_proc.context = &rq->source_ctx;
+    rq->source_proc.cpu = cpu;
   }
 }
 
 size_t PROC_create_kthread(kproc_t entry_point, void *arg) {
-  struct ProcContext *ctx = kmalloc(sizeof(*ctx));
+  return PROC_create_kthread_prio(entry_point, arg, PROC_PRIO_DEFAULT);
+}
+
+static size_t create_kthread(kproc_t entry_point, void *arg, int prio,
+                             unsigned cpu, bool pinned) {
+  struct ProcContext *ctx = kmem_cache_alloc(proc_context_cache);
   // make a new stack
   void *frame = kmalloc(PROC_STACK_SIZE);
-  struct InitalProcFrame *initial = frame + PROC_STACK_SIZE - sizeof(*initial);
-  // zero out frame for good default values for most things
+  struct InitialSwitchFrame *initial =
+      frame + PROC_STACK_SIZE - sizeof(*initial);
   memset(initial, 0, sizeof(*initial));
-  // FIXME: not all threads should be kernel mode in the future
-  initial->cs = GDT_kernel_desc_offset();
-  // set the function address as the return location for iretq
-  initial->rdi = (uint64_t)arg;
-  initial->rip = entry_point;
-  // after iretq returns the stack should start right at the start
-  initial->rsp = frame + PROC_STACK_SIZE - sizeof(void *);
-  // add kexit for ret from proc
-  initial->kexit_ret = &kexit;
+  // proc_thread_start turns interrupts on, calls entry(arg), then kexit
+  initial->ret = &proc_thread_start;
+  initial->r12 = (uint64_t)entry_point;
+  initial->r13 = (uint64_t)arg;
   // set the rsp for the switcher itself
   ctx->frame = (uint64_t *)frame;
   ctx->rsp = (uint64_t *)initial;
-  ctx->pid = pid_count++;
+  ctx->pid = __atomic_fetch_add(&pid_count, 1, __ATOMIC_RELAXED);
   // frame node
-  struct ProcNode *node = kmalloc(sizeof(*node));
+  struct ProcNode *node = kmem_cache_alloc(proc_node_cache);
   node->context = ctx;
-  append_proc(node, &avail_procs);
+  node->runnable_since = rdtsc();
+  node->prio = prio;
+  node->base_prio = prio;
+  node->cpu = cpu;
+  node->pinned = pinned;
+  node->blocked_on = NULL;
+  node->exclusive = false;
+  ready_proc(node);
   return ctx->pid;
 }
 
-void PROC_reschedule() { next_proc = cycle_next_proc(&avail_procs); }
+size_t PROC_create_kthread_prio(kproc_t entry_point, void *arg, int prio) {
+  assert(prio >= PROC_PRIO_HIGHEST && prio <= PROC_PRIO_LOWEST &&
+         "Priority out of range");
+  unsigned cpu =
+      __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED) % SMP_num_cpus();
+  return create_kthread(entry_point, arg, prio, cpu, false);
+}
+
+size_t PROC_create_kthread_pinned(kproc_t entry_point, void *arg,
+                                  unsigned cpu) {
+  assert(cpu < SMP_num_cpus() && "Pinned to a CPU that isn't online");
+  return create_kthread(entry_point, arg, PROC_PRIO_DEFAULT, cpu, true);
+}
+
+void PROC_set_priority(int prio) {
+  assert(prio >= PROC_PRIO_HIGHEST && prio <= PROC_PRIO_LOWEST &&
+         "Priority out of range");
+  CLI_GUARD;
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  struct ProcNode *cur = cpu->cur_proc;
+  assert(!is_idle(cur, rq) && "Only threads have a priority");
+  spin_lock(&rq->lock);
+  dequeue_proc(rq, cur);
+  cur->prio = prio;
+  cur->base_prio = prio;
+  enqueue_proc(rq, cur);
+  // dropping below something runnable gives it the CPU on the next tick
+  if (__builtin_ctz(rq->bitmap) < prio) {
+    rq->need_resched = true;
+  }
+  spin_unlock(&rq->lock);
+  STI_GUARD;
+}
+
+// with interrupts off, from an interrupt or just before a switch
+void PROC_reschedule() {
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  if (cpu->cur_proc != NULL) {
+    cpu->cur_proc->runnable_since = rdtsc();
+  }
+  // next_proc is set under the lock so a stealing CPU never takes it
+  spin_lock(&rq->lock);
+  struct ProcNode *next = pick_next_proc(rq);
+  // with nothing left the switch goes back to the idle loop
+  cpu->next_proc = next != NULL ? next : &rq->source_proc;
+  spin_unlock(&rq->lock);
+  switching_to(rq, cpu, cpu->next_proc);
+}
+
+void PROC_kick() {
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  // an idle CPU only needed waking up, the idle loop takes it from here
+  if (is_idle(cpu->cur_proc, rq) || !rq->need_resched) {
+    return;
+  }
+  // otherwise the tick switches once preemption is back on
+  if (preempt_count() == 0) {
+    rq->stats.wake_preemptions += 1;
+    PROC_reschedule();
+  }
+}
+
+void PROC_softirq_exit() {
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  if (rq->handoff == NULL) {
+    PROC_kick();
+    return;
+  }
+  spin_lock(&rq->lock);
+  struct ProcNode *node = rq->handoff;
+  rq->handoff = NULL;
+  bool handoff = preempt_count() == 0;
+  if (handoff) {
+    cpu->cur_proc->runnable_since = rdtsc();
+    cpu->next_proc = node;
+  } else {
+    // left queued and boosted, for the first tick where it's safe
+    rq->need_resched = true;
+  }
+  spin_unlock(&rq->lock);
+  if (handoff) {
+    rq->stats.handoffs += 1;
+    switching_to(rq, cpu, node);
+  }
+}
+
+#ifdef SCHED_BENCH
+static void bench_tick();
+#endif
+
+void PROC_tick() {
+#ifdef SCHED_BENCH
+  if (CPU_id() == 0) {
+    bench_tick();
+  }
+#endif
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  struct ProcNode *cur = cpu->cur_proc;
+  // only threads get preempted, not the idle loop or boot before PROC_run
+  if (is_idle(cur, rq)) {
+    return;
+  }
+  if (rq->need_resched && preempt_count() == 0) {
+    rq->stats.wake_preemptions += 1;
+    PROC_reschedule();
+    return;
+  }
+  if (rq->slice_left > 1) {
+    rq->slice_left -= 1;
+    return;
+  }
+  if (preempt_count() > 0) {
+    // left at the end of its slice, so the first tick after it's safe
+    // switches
+    rq->slice_left = 1;
+    rq->stats.deferred += 1;
+    return;
+  }
+  rq->stats.preemptions += 1;
+  rq->slice_left = time_slice;
+  // burning whole slices is a sign it isn't as interactive as its boost says
+  if (cur->prio < cur->base_prio) {
+    spin_lock(&rq->lock);
+    dequeue_proc(rq, cur);
+    cur->prio += 1;
+    enqueue_proc(rq, cur);
+    spin_unlock(&rq->lock);
+  }
+  // the switch itself happens on the way out of the interrupt
+  PROC_reschedule();
+}
+
+void PROC_set_time_slice(unsigned ticks) {
+  assert(ticks > 0 && "Time slices need at least a tick");
+  time_slice = ticks;
+}
+
+void PROC_set_wake_boost(int levels) {
+  assert(levels >= 0 && levels < PROC_NUM_PRIOS && "Boost out of range");
+  wake_boost = levels;
+}
+
+void PROC_print_sched_stats() {
+  printk("sched: slice %u ticks\n", time_slice);
+  for (unsigned cpu = 0; cpu < SMP_num_cpus(); ++cpu) {
+    struct SchedStats *stats = &run_queues[cpu].stats;
+    printk("  cpu %u: %lu switches, %lu preemptions, %lu wake preemptions, "
+           "%lu deferred, %lu steals, %lu handoffs, latency avg %lu max %lu "
+           "cycles\n",
+           cpu, stats->switches, stats->preemptions, stats->wake_preemptions,
+           stats->deferred, stats->steals, stats->handoffs,
+           stats->latency_total / (stats->switches | 1), stats->latency_max);
+  }
+}
 
 void yield() {
+  // a tick between picking the next thread and switching would pick again
+  CLI_GUARD;
   PROC_reschedule();
-  asm volatile("int $0x80");
+  struct Cpu *cpu = CPU_this();
+  if (cpu->next_proc != cpu->cur_proc) {
+    context_switch(cpu, cpu->next_proc);
+  }
+  STI_GUARD;
+  reap_exited_procs();
+}
+
+void kexit() {
+  CLI;
+  struct Cpu *cpu = CPU_this();
+  struct RunQueue *rq = &run_queues[cpu->id];
+  spin_lock(&rq->lock);
+  dequeue_proc(rq, cpu->cur_proc);
+  spin_unlock(&rq->lock);
+  // still on its stack, so it's only reaped once the next thread runs
+  rq->dead = cpu->cur_proc;
+  PROC_reschedule();
+  context_switch(cpu, cpu->next_proc);
+  assert(false && "Switched back to a thread that exited");
 }
 
-void kexit() { asm volatile("int $0x81"); }
+#ifdef SCHED_BENCH
+#define SCHED_BENCH_THREADS 4
+#define SCHED_BENCH_TICKS 1000
+// the interactive thread is woken this often by the timer while the
+// spinners run
+#define SCHED_BENCH_WAKE_TICKS 5
+#define SCHED_BENCH_SAMPLES 128
+static const unsigned bench_slices[] = {1, 2, 5, 10, 20, 50};
+static uint64_t bench_work[SCHED_BENCH_THREADS];
+static struct ProcessQueue bench_done;
+static size_t bench_running;
+static struct ProcessQueue bench_wake;
+static volatile uint64_t bench_woken_at;
+static uint64_t bench_samples[SCHED_BENCH_SAMPLES];
+
+// stands in for a device interrupt, from the timer interrupt
+static void bench_tick() {
+  if (bench_wake.head != NULL && TIMER_ticks() % SCHED_BENCH_WAKE_TICKS == 0) {
+    bench_woken_at = rdtsc();
+    PROC_unblock_all(&bench_wake);
+  }
+}
+
+static void bench_finished() {
+  if (__atomic_sub_fetch(&bench_running, 1, __ATOMIC_SEQ_CST) == 0) {
+    PROC_unblock_all(&bench_done);
+  }
+}
+
+// never yields, the timer is the only way anyone else gets a turn
+static void bench_spinner(void *arg) {
+  volatile uint64_t *work = arg;
+  uint64_t end = TIMER_ticks() + SCHED_BENCH_TICKS;
+  while (TIMER_ticks() < end) {
+    *work += 1;
+  }
+  bench_finished();
+}
+
+static void bench_interactive(void *arg) {
+  for (int i = 0; i < SCHED_BENCH_SAMPLES; ++i) {
+    PROC_wait_lock();
+    PROC_block_on(&bench_wake, true);
+    bench_samples[i] = rdtsc() - bench_woken_at;
+  }
+  bench_finished();
+}
+
+static void bench_wait() {
+  PROC_wait_lock();
+  while (bench_running > 0) {
+    PROC_block_on(&bench_done, true);
+    PROC_wait_lock();
+  }
+  PROC_wait_unlock();
+}
+
+static void bench_reset_stats() {
+  for (unsigned cpu = 0; cpu < CPU_MAX; ++cpu) {
+    memset(&run_queues[cpu].stats, 0, sizeof(run_queues[cpu].stats));
+  }
+}
+
+// every CPU's stats added together
+static struct SchedStats bench_stats() {
+  struct SchedStats total;
+  memset(&total, 0, sizeof(total));
+  for (unsigned cpu = 0; cpu < SMP_num_cpus(); ++cpu) {
+    struct SchedStats *stats = &run_queues[cpu].stats;
+    total.switches += stats->switches;
+    total.wake_preemptions += stats->wake_preemptions;
+    total.latency_total += stats->latency_total;
+    if (stats->latency_max > total.latency_max) {
+      total.latency_max = stats->latency_max;
+    }
+  }
+  return total;
+}
+
+static void bench_spawn_spinners() {
+  for (int t = 0; t < SCHED_BENCH_THREADS; ++t) {
+    bench_work[t] = 0;
+    PROC_create_kthread(&bench_spinner, &bench_work[t]);
+  }
+}
+
+static void bench_slice_sweep() {
+  for (size_t i = 0; i < sizeof(bench_slices) / sizeof(*bench_slices); ++i) {
+    PROC_set_time_slice(bench_slices[i]);
+    bench_reset_stats();
+    bench_running = SCHED_BENCH_THREADS;
+    bench_spawn_spinners();
+    bench_wait();
+    uint64_t work = 0;
+    for (int t = 0; t < SCHED_BENCH_THREADS; ++t) {
+      work += bench_work[t];
+    }
+    struct SchedStats stats = bench_stats();
+    printk("sched bench, slice %u: %lu iterations/tick, latency avg %lu max "
+           "%lu cycles, %lu switches\n",
+           bench_slices[i], work / SCHED_BENCH_TICKS,
+           stats.latency_total / (stats.switches | 1), stats.latency_max,
+           stats.switches);
+  }
+  PROC_set_time_slice(PROC_DEFAULT_TIME_SLICE);
+}
+
+// wakeup latency of a thread that mostly sleeps, sharing the CPU with
+// threads that never do
+static void bench_mixed(int boost) {
+  PROC_set_wake_boost(boost);
+  bench_reset_stats();
+  bench_running = SCHED_BENCH_THREADS + 1;
+  bench_spawn_spinners();
+  PROC_create_kthread(&bench_interactive, NULL);
+  bench_wait();
+  // insertion sort, there's only a handful
+  for (int i = 1; i < SCHED_BENCH_SAMPLES; ++i) {
+    uint64_t sample = bench_samples[i];
+    int j = i;
+    for (; j > 0 && bench_samples[j - 1] > sample; --j) {
+      bench_samples[j] = bench_samples[j - 1];
+    }
+    bench_samples[j] = sample;
+  }
+  struct SchedStats stats = bench_stats();
+  printk("sched bench, mixed with boost %d: wakeup p50 %lu p99 %lu max %lu "
+         "cycles, %lu wake preemptions\n",
+         boost, bench_samples[SCHED_BENCH_SAMPLES / 2],
+         bench_samples[SCHED_BENCH_SAMPLES * 99 / 100],
+         bench_samples[SCHED_BENCH_SAMPLES - 1], stats.wake_preemptions);
+}
+
+static void bench_thread(void *arg) {
+  bench_slice_sweep();
+  // no boost is plain round robin, the way it was before priorities
+  bench_mixed(0);
+  bench_mixed(PROC_WAKE_BOOST);
+  PROC_set_wake_boost(PROC_WAKE_BOOST);
+}
+
+void PROC_sched_bench() {
+  PROC_init_queue(&bench_done);
+  PROC_init_queue(&bench_wake);
+  PROC_create_kthread(&bench_thread, NULL);
+}
+#endif
+
+#ifdef SWITCH_BENCH
+// two threads pinned to the same CPU handing it back and forth, once through
+// a software interrupt the way every switch used to go and once directly
+#define SWITCH_BENCH_ROUNDS 100000
+#define SWITCH_BENCH_VECTOR 0x80
+static size_t switch_bench_running;
+static struct ProcessQueue switch_bench_done;
+
+static void switch_bench_handler(int number, int error_code, void *arg) {
+  PROC_reschedule();
+}
+
+static void switch_bench_pinger(void *arg) {
+  bool through_irq = (bool)arg;
+  for (int i = 0; i < SWITCH_BENCH_ROUNDS; ++i) {
+    if (through_irq) {
+      asm volatile("int %0" : : "i"(SWITCH_BENCH_VECTOR));
+    } else {
+      yield();
+    }
+  }
+  if (__atomic_sub_fetch(&switch_bench_running, 1, __ATOMIC_SEQ_CST) == 0) {
+    PROC_unblock_all(&switch_bench_done);
+  }
+}
+
+static void switch_bench_run(bool through_irq) {
+  switch_bench_running = 2;
+  uint64_t switches = run_queues[0].stats.switches;
+  uint64_t start = rdtsc();
+  for (int t = 0; t < 2; ++t) {
+    PROC_create_kthread_pinned(&switch_bench_pinger,
+                               (void *)(uintptr_t)through_irq, 0);
+  }
+  PROC_wait_lock();
+  while (switch_bench_running > 0) {
+    PROC_block_on(&switch_bench_done, true);
+    PROC_wait_lock();
+  }
+  PROC_wait_unlock();
+  uint64_t cycles = rdtsc() - start;
+  switches = run_queues[0].stats.switches - switches;
+  printk("switch bench, %s: %lu switches, %lu cycles each\n",
+         through_irq ? "interrupt" : "direct", switches,
+         cycles / (switches | 1));
+}
+
+static void switch_bench_thread(void *arg) {
+  IRQ_handler_set(SWITCH_BENCH_VECTOR, switch_bench_handler, NULL);
+  switch_bench_run(true);
+  switch_bench_run(false);
+}
+
+void PROC_switch_bench() {
+  PROC_init_queue(&switch_bench_done);
+  PROC_create_kthread(&switch_bench_thread, NULL);
+}
+#endif
@@ -12,6 +12,7 @@
 #include <stdint.h>
 
 static struct RingBuffer keyboard_ring;
+static struct Softirq keyboard_softirq;
 
 struct Ps2Status ps2_get_status() {
   uint8_t status = inb(PS2_STATUS_COMMAND_PORT);
@@ -75,9 +76,13 @@ void ps2_irq_handler(int num, int error_code, void *arg) {
       ring_producer_add_char(&keyboard_ring, c);
     }
   }
-  PROC_unblock_all(keyboard_ring.blocked);
 
   PIC_sendEOI(num);
+  IRQ_raise_softirq(&keyboard_softirq);
+}
+
+static void ps2_wake_reader(void *arg) {
+  PROC_wake(keyboard_ring.blocked, PROC_WAKE_HANDOFF);
 }
 
 void ps2_initialize() {
@@ -154,6 +159,7 @@ void ps2_initialize() {
   dprintk("Enable Interrupts...\n");
   // setup the ring buffer for the handler to write to
   ring_init(&keyboard_ring, true);
+  IRQ_softirq_init(&keyboard_softirq, &ps2_wake_reader, NULL);
   // setup the handler before actually enabling them
   IRQ_handler_set(PS2_INTERRUPT_NUM, ps2_irq_handler, NULL);
   IRQ_clear_mask(IRQ1);
@@ -185,3 +191,7 @@ int getc() {
   ring_consumer_block_next(&keyboard_ring, &c);
   return c;
 }
+
+void ps2_print_latency() {
+  PROC_latency_print("keyboard", &keyboard_ring.latency);
+}
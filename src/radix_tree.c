@@ -0,0 +1,167 @@
+#include "radix_tree.h"
+#include "allocator.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static struct RadixTreeNode *node_alloc() {
+  struct RadixTreeNode *node = kmalloc(sizeof(*node));
+  if (node != NULL) {
+    memset(node, 0, sizeof(*node));
+  }
+  return node;
+}
+
+// largest index (exclusive) a tree of the given height can hold
+static uint64_t height_capacity(uint32_t height) {
+  if (height * RADIX_TREE_SHIFT >= 64) {
+    return UINT64_MAX;
+  }
+  return 1lu << (height * RADIX_TREE_SHIFT);
+}
+
+static inline uint32_t slot_index(uint64_t index, uint32_t level) {
+  return (index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK;
+}
+
+void radix_tree_init(struct RadixTree *tree) {
+  tree->root = NULL;
+  tree->height = 0;
+}
+
+void *radix_tree_lookup(struct RadixTree *tree, uint64_t index) {
+  if (tree->root == NULL || index >= height_capacity(tree->height)) {
+    return NULL;
+  }
+  struct RadixTreeNode *node = tree->root;
+  for (uint32_t l = tree->height - 1; l > 0; --l) {
+    node = node->slots[slot_index(index, l)];
+    if (node == NULL) {
+      return NULL;
+    }
+  }
+  return node->slots[slot_index(index, 0)];
+}
+
+bool radix_tree_insert(struct RadixTree *tree, uint64_t index, void *item) {
+  if (tree->root == NULL) {
+    tree->root = node_alloc();
+    if (tree->root == NULL) {
+      return false;
+    }
+    tree->height = 1;
+  }
+  // grow upwards until the index fits, old root becomes slot 0
+  while (tree->height < RADIX_TREE_MAX_HEIGHT &&
+         index >= height_capacity(tree->height)) {
+    struct RadixTreeNode *new_root = node_alloc();
+    if (new_root == NULL) {
+      return false;
+    }
+    new_root->slots[0] = tree->root;
+    new_root->count = 1;
+    tree->root = new_root;
+    tree->height += 1;
+  }
+
+  struct RadixTreeNode *node = tree->root;
+  for (uint32_t l = tree->height - 1; l > 0; --l) {
+    uint32_t slot = slot_index(index, l);
+    if (node->slots[slot] == NULL) {
+      node->slots[slot] = node_alloc();
+      if (node->slots[slot] == NULL) {
+        return false;
+      }
+      node->count += 1;
+    }
+    node = node->slots[slot];
+  }
+
+  uint32_t slot = slot_index(index, 0);
+  if (node->slots[slot] != NULL) {
+    return false;
+  }
+  node->slots[slot] = item;
+  node->count += 1;
+  return true;
+}
+
+void *radix_tree_delete(struct RadixTree *tree, uint64_t index) {
+  if (tree->root == NULL || index >= height_capacity(tree->height)) {
+    return NULL;
+  }
+
+  struct RadixTreeNode *path[RADIX_TREE_MAX_HEIGHT];
+  struct RadixTreeNode *node = tree->root;
+  for (uint32_t l = tree->height - 1; l > 0; --l) {
+    path[l] = node;
+    node = node->slots[slot_index(index, l)];
+    if (node == NULL) {
+      return NULL;
+    }
+  }
+  path[0] = node;
+
+  uint32_t slot = slot_index(index, 0);
+  void *item = node->slots[slot];
+  if (item == NULL) {
+    return NULL;
+  }
+
+  // clear the slot, then free any nodes that became empty on the way up
+  node->slots[slot] = NULL;
+  node->count -= 1;
+  for (uint32_t l = 0; l < tree->height && path[l]->count == 0; ++l) {
+    kfree(path[l]);
+    if (l + 1 == tree->height) {
+      tree->root = NULL;
+      tree->height = 0;
+    } else {
+      path[l + 1]->slots[slot_index(index, l + 1)] = NULL;
+      path[l + 1]->count -= 1;
+    }
+  }
+  return item;
+}
+
+static void for_each_node(struct RadixTreeNode *node, uint32_t level,
+                          uint64_t base, radix_tree_cb cb, void *arg) {
+  for (uint32_t i = 0; i < RADIX_TREE_SLOTS; ++i) {
+    void *slot = node->slots[i];
+    if (slot == NULL) {
+      continue;
+    }
+    uint64_t index = base | ((uint64_t)i << (level * RADIX_TREE_SHIFT));
+    if (level == 0) {
+      cb(index, slot, arg);
+    } else {
+      for_each_node(slot, level - 1, index, cb, arg);
+    }
+  }
+}
+
+void radix_tree_for_each(struct RadixTree *tree, radix_tree_cb cb, void *arg) {
+  if (tree->root != NULL) {
+    for_each_node(tree->root, tree->height - 1, 0, cb, arg);
+  }
+}
+
+static void destroy_node(struct RadixTreeNode *node, uint32_t level) {
+  if (level > 0) {
+    for (uint32_t i = 0; i < RADIX_TREE_SLOTS; ++i) {
+      if (node->slots[i] != NULL) {
+        destroy_node(node->slots[i], level - 1);
+      }
+    }
+  }
+  kfree(node);
+}
+
+void radix_tree_destroy(struct RadixTree *tree) {
+  if (tree->root != NULL) {
+    destroy_node(tree->root, tree->height - 1);
+  }
+  radix_tree_init(tree);
+}
@@ -1,16 +1,19 @@
 #include "ring_buffer.h"
 
 #include "allocator.h"
+#include "cpu.h"
 #include "interrupts.h"
 #include "processes.h"
 
 #include <stdbool.h>
+#include <string.h>
 
 static struct RingBuffer ring;
 
 void ring_init(struct RingBuffer *state, bool blockable) {
   state->consumer = &state->buff[0];
   state->producer = &state->buff[0];
+  memset(&state->latency, 0, sizeof(state->latency));
   if (blockable) {
     state->blocked = kmalloc(sizeof((*state->blocked)));
     PROC_init_queue(state->blocked);
@@ -33,18 +36,21 @@ bool ring_consumer_next(struct RingBuffer *state, char *next) {
 }
 
 void ring_consumer_block_next(struct RingBuffer *state, char *next) {
-  CLI;
+  PROC_wait_lock();
   while (state->consumer == state->producer) {
-    PROC_block_on(state->blocked, true);
-    CLI;
+    // each character only goes to one reader
+    PROC_block_on_exclusive(state->blocked, true);
+    PROC_wait_lock();
   }
 
+  PROC_latency_record(&state->latency,
+                      state->stamps[state->consumer - state->buff]);
   *next = *state->consumer++;
 
   if (state->consumer >= &state->buff[BUFF_SIZE]) {
     state->consumer = &state->buff[0];
   }
-  STI;
+  PROC_wait_unlock();
 }
 
 bool ring_producer_add_char(struct RingBuffer *state, char to_add) {
@@ -54,6 +60,7 @@ bool ring_producer_add_char(struct RingBuffer *state, char to_add) {
     return false;
   }
 
+  state->stamps[state->producer - state->buff] = rdtsc();
   *state->producer++ = to_add;
 
   if (state->producer >= &state->buff[BUFF_SIZE]) {
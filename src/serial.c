@@ -4,14 +4,23 @@
 #include "portio.h"
 #include "printk.h"
 #include "ring_buffer.h"
+#include "spinlock.h"
 
 #include <stdbool.h>
 #include <string.h>
 
 #define COM1 0x3f8
+#define INT_ENABLE_DATA_AVAILABLE (1 << 0)
 #define INT_ENABLE_TRANSMIT_EMPTY (1 << 1)
+#define LINE_STATUS_DATA_READY (1 << 0)
 
 static struct RingBuffer ring;
+static struct RingBuffer input_ring;
+static bool input_enabled = false;
+static struct Softirq input_softirq;
+// the handler only runs on the boot CPU, writers can be on any of them and
+// both take characters off the output ring
+static struct Spinlock ser_lock = SPINLOCK_INIT;
 
 static int is_transmit_empty() { return inb(COM1 + 5) & 0x20; }
 
@@ -26,13 +35,25 @@ static void serial_ring_consumer_serial_write(struct RingBuffer *state) {
   }
 }
 
-static void serial_transmit_ready_handler(int num, int error_code, void *arg) {
+static void serial_handler(int num, int error_code, void *arg) {
+  if (input_enabled && (inb(COM1 + 5) & LINE_STATUS_DATA_READY)) {
+    while (inb(COM1 + 5) & LINE_STATUS_DATA_READY) {
+      ring_producer_add_char(&input_ring, inb(COM1));
+    }
+    IRQ_raise_softirq(&input_softirq);
+  }
+  spin_lock(&ser_lock);
   serial_ring_consumer_serial_write((struct RingBuffer *)arg);
+  spin_unlock(&ser_lock);
   PIC_sendEOI(num);
 }
 
+static void serial_wake_reader(void *arg) {
+  PROC_wake(input_ring.blocked, PROC_WAKE_HANDOFF);
+}
+
 int SER_write(const char *buff, int len) {
-  CLI_GUARD;
+  SPIN_LOCK_GUARD(&ser_lock);
 
   for (int i = 0; i < len; i += 1) {
     ring_producer_add_char(&ring, buff[i]);
@@ -43,7 +64,7 @@ int SER_write(const char *buff, int len) {
     STI;
   }
 
-  STI_GUARD;
+  SPIN_UNLOCK_GUARD(&ser_lock);
   return len;
 }
 
@@ -67,10 +88,25 @@ void SER_init(void) {
   // If serial is not faulty set it in normal operation mode
   // (not-loopback with IRQs enabled and OUT#1 and OUT#2 bits enabled)
   // setup interrupts
-  IRQ_handler_set(IRQ_BASE + IRQ4, serial_transmit_ready_handler, &ring);
+  IRQ_handler_set(IRQ_BASE + IRQ4, serial_handler, &ring);
   IRQ_clear_mask(IRQ4);
   outb(COM1 + 1, INT_ENABLE_TRANSMIT_EMPTY);
 
   outb(COM1 + 4, 0x0F);
   printk("serial chip initialized\n");
 }
+
+void SER_input_init(void) {
+  ring_init(&input_ring, true);
+  IRQ_softirq_init(&input_softirq, &serial_wake_reader, NULL);
+  CLI_GUARD;
+  input_enabled = true;
+  outb(COM1 + 1, INT_ENABLE_DATA_AVAILABLE | INT_ENABLE_TRANSMIT_EMPTY);
+  STI_GUARD;
+}
+
+int SER_getc(void) {
+  char c;
+  ring_consumer_block_next(&input_ring, &c);
+  return c;
+}
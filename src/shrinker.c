@@ -0,0 +1,101 @@
+#include "shrinker.h"
+#include "interrupts.h"
+#include "page_allocator.h"
+#include "processes.h"
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SHRINK_BATCH 32
+
+static struct Shrinker *shrinkers = NULL;
+static struct ProcessQueue reclaim_queue = {NULL};
+static bool reclaim_running = false;
+static bool reclaim_pending = false;
+// held for a whole run, and only ever tried for
+static struct Spinlock shrink_lock = SPINLOCK_INIT;
+
+void SHRINK_register(struct Shrinker *shrinker) {
+  shrinker->next = shrinkers;
+  shrinkers = shrinker;
+}
+
+void SHRINK_unregister(struct Shrinker *shrinker) {
+  struct Shrinker **link = &shrinkers;
+  while (*link != NULL && *link != shrinker) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    *link = shrinker->next;
+  }
+}
+
+// asks each shrinker for a share proportional to what it says it can free
+size_t SHRINK_run(size_t nr_pages) {
+  // a shrinker that allocates must not recurse back into reclaim, and one
+  // run at a time is plenty. Holding it also keeps the shrinkers from being
+  // switched out half way through structures they share with other threads
+  if (!spin_trylock(&shrink_lock)) {
+    return 0;
+  }
+
+  size_t total = 0;
+  for (struct Shrinker *s = shrinkers; s != NULL; s = s->next) {
+    total += s->count(s);
+  }
+
+  size_t freed = 0;
+  for (struct Shrinker *s = shrinkers; s != NULL && freed < nr_pages;
+       s = s->next) {
+    size_t count = s->count(s);
+    if (count == 0) {
+      continue;
+    }
+    size_t share = total > 0 ? nr_pages * count / total : nr_pages;
+    if (share == 0) {
+      share = 1;
+    }
+    freed += s->scan(s, share);
+  }
+  // proportional shares can round down, let anyone make up the difference
+  for (struct Shrinker *s = shrinkers; s != NULL && freed < nr_pages;
+       s = s->next) {
+    freed += s->scan(s, nr_pages - freed);
+  }
+
+  spin_unlock(&shrink_lock);
+  return freed;
+}
+
+static void reclaim_thread(void *arg) {
+  while (true) {
+    PROC_wait_lock();
+    while (!reclaim_pending) {
+      PROC_block_on(&reclaim_queue, true);
+      PROC_wait_lock();
+    }
+    reclaim_pending = false;
+    PROC_wait_unlock();
+
+    // run in batches until the high watermark, giving others a turn between
+    while (MMU_free_frames() < MMU_WATERMARK_HIGH) {
+      if (SHRINK_run(SHRINK_BATCH) == 0) {
+        break;
+      }
+      yield();
+    }
+  }
+}
+
+void SHRINK_init() {
+  if (!reclaim_running) {
+    reclaim_running = true;
+    PROC_create_kthread(reclaim_thread, NULL);
+  }
+}
+
+void SHRINK_wake() {
+  reclaim_pending = true;
+  PROC_unblock_all(&reclaim_queue);
+}
@@ -0,0 +1,509 @@
+#include "slab.h"
+#include "alignment.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "meminfo.h"
+#include "page_allocator.h"
+#include "preempt.h"
+#include "printk.h"
+#include "processes.h"
+#include "shrinker.h"
+#include "smolassert.h"
+#include "spinlock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// caches and magazines are themselves allocated from these, bypassing the
+// magazine layer
+static struct KmemCache cache_cache;
+static struct KmemCache magazine_cache;
+static struct KmemCache *caches = NULL;
+static struct Spinlock caches_lock = SPINLOCK_INIT;
+
+static inline struct Slab *slab_of(void *obj) {
+  return (struct Slab *)((uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static inline void **free_ptr(struct KmemCache *cache, void *obj) {
+  return (void **)(obj + cache->free_offset);
+}
+
+static void slab_list_push(struct Slab **head, struct Slab *slab) {
+  slab->prev = NULL;
+  slab->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = slab;
+  }
+  *head = slab;
+}
+
+static void slab_list_remove(struct Slab **head, struct Slab *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *head = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+static struct Slab *slab_new(struct KmemCache *cache) {
+  struct Slab *slab = MMU_pf_alloc_order(SLAB_ORDER);
+  if (slab == NULL) {
+    return NULL;
+  }
+  struct PageFrame *frame = MMU_pf_frame(slab);
+  for (int i = 0; i < 1 << SLAB_ORDER; ++i) {
+    frame[i].slab_cache = cache;
+    frame[i].flags |= PF_FLAG_SLAB;
+  }
+  slab->cache = cache;
+  slab->free = NULL;
+  slab->inuse = 0;
+  // chain backwards so objects are handed out in address order
+  for (size_t i = cache->objs_per_slab; i > 0; --i) {
+    void *obj = (void *)slab + cache->first_offset + (i - 1) * cache->stride;
+    if (cache->ctor != NULL) {
+      cache->ctor(obj);
+    }
+    *free_ptr(cache, obj) = slab->free;
+    slab->free = obj;
+  }
+  MEMINFO_add(MEMSTAT_SLAB, 1 << SLAB_ORDER);
+  return slab;
+}
+
+static void slab_release(struct KmemCache *cache, struct Slab *slab) {
+  cache->num_slabs -= 1;
+  MEMINFO_add(MEMSTAT_SLAB, -(1 << SLAB_ORDER));
+  struct PageFrame *frame = MMU_pf_frame(slab);
+  for (int i = 0; i < 1 << SLAB_ORDER; ++i) {
+    frame[i].flags &= ~PF_FLAG_SLAB;
+  }
+  MMU_pf_free_order(slab, SLAB_ORDER);
+}
+
+static void cache_setup(struct KmemCache *cache, const char *name, size_t size,
+                        size_t align, kmem_ctor_t ctor) {
+  if (align < sizeof(void *)) {
+    align = sizeof(void *);
+  }
+  if (size < sizeof(void *)) {
+    size = sizeof(void *);
+  }
+  spin_lock_init(&cache->lock);
+  cache->name = name;
+  cache->size = size;
+  cache->ctor = ctor;
+  if (ctor != NULL) {
+    cache->free_offset = align_pointer(size, sizeof(void *), true);
+    cache->stride = align_pointer(cache->free_offset + sizeof(void *), align,
+                                  true);
+  } else {
+    cache->free_offset = 0;
+    cache->stride = align_pointer(size, align, true);
+  }
+  cache->first_offset = align_pointer(sizeof(struct Slab), align, true);
+  assert(cache->first_offset + cache->stride <= SLAB_SIZE &&
+         "Object too large for a slab");
+  cache->objs_per_slab = (SLAB_SIZE - cache->first_offset) / cache->stride;
+  cache->full = cache->partial = cache->empty = NULL;
+  cache->num_slabs = cache->num_empty = cache->active_objs = 0;
+  cache->magazine_size = 0;
+  memset(cache->cpu, 0, sizeof(cache->cpu));
+  cache->depot_full = cache->depot_empty = NULL;
+  cache->depot_num_full = cache->depot_num_empty = 0;
+  spin_lock(&caches_lock);
+  cache->next = caches;
+  caches = cache;
+  spin_unlock(&caches_lock);
+}
+
+// bigger objects get smaller magazines so a CPU doesn't sit on too much memory
+static size_t magazine_size(size_t stride) {
+  if (stride <= 256) {
+    return MAGAZINE_MAX_ROUNDS;
+  } else if (stride <= 1024) {
+    return MAGAZINE_MAX_ROUNDS / 2;
+  }
+  return MAGAZINE_MAX_ROUNDS / 4;
+}
+
+static void *slab_alloc(struct KmemCache *cache) {
+  spin_lock(&cache->lock);
+  struct Slab *slab = cache->partial;
+  if (slab == NULL) {
+    slab = cache->empty;
+    if (slab != NULL) {
+      slab_list_remove(&cache->empty, slab);
+      cache->num_empty -= 1;
+    } else {
+      // getting frames can reclaim, which shrinks this cache too
+      spin_unlock(&cache->lock);
+      slab = slab_new(cache);
+      if (slab == NULL) {
+        return NULL;
+      }
+      spin_lock(&cache->lock);
+      cache->num_slabs += 1;
+    }
+    slab_list_push(&cache->partial, slab);
+  }
+
+  void *obj = slab->free;
+  slab->free = *free_ptr(cache, obj);
+  slab->inuse += 1;
+  cache->active_objs += 1;
+  if (slab->inuse == cache->objs_per_slab) {
+    slab_list_remove(&cache->partial, slab);
+    slab_list_push(&cache->full, slab);
+  }
+  MEMINFO_add(MEMSTAT_SLAB_ACTIVE, cache->stride);
+  spin_unlock(&cache->lock);
+  return obj;
+}
+
+static void slab_free(struct KmemCache *cache, void *obj) {
+  struct Slab *slab = slab_of(obj);
+  assert(slab->cache == cache && "Object freed to the wrong cache");
+  spin_lock(&cache->lock);
+  if (slab->inuse == cache->objs_per_slab) {
+    slab_list_remove(&cache->full, slab);
+    slab_list_push(&cache->partial, slab);
+  }
+  *free_ptr(cache, obj) = slab->free;
+  slab->free = obj;
+  slab->inuse -= 1;
+  cache->active_objs -= 1;
+  MEMINFO_add(MEMSTAT_SLAB_ACTIVE, -(long)cache->stride);
+
+  if (slab->inuse == 0) {
+    slab_list_remove(&cache->partial, slab);
+    if (cache->num_empty < SLAB_MAX_EMPTY) {
+      slab_list_push(&cache->empty, slab);
+      cache->num_empty += 1;
+    } else {
+      slab_release(cache, slab);
+    }
+  }
+  spin_unlock(&cache->lock);
+}
+
+static struct Magazine *magazine_alloc() {
+  struct Magazine *mag = slab_alloc(&magazine_cache);
+  if (mag != NULL) {
+    mag->rounds = 0;
+  }
+  return mag;
+}
+
+static struct Magazine *depot_pop(struct KmemCache *cache,
+                                   struct Magazine **list, size_t *count) {
+  spin_lock(&cache->lock);
+  struct Magazine *mag = *list;
+  if (mag != NULL) {
+    *list = mag->next;
+    *count -= 1;
+  }
+  spin_unlock(&cache->lock);
+  return mag;
+}
+
+// returns false if the depot is already holding enough of these
+static bool depot_push(struct KmemCache *cache, struct Magazine **list,
+                       size_t *count, struct Magazine *mag) {
+  spin_lock(&cache->lock);
+  bool pushed = *count < DEPOT_MAX_MAGAZINES;
+  if (pushed) {
+    mag->next = *list;
+    *list = mag;
+    *count += 1;
+  }
+  spin_unlock(&cache->lock);
+  return pushed;
+}
+
+// hands a magazine's objects back to the slabs and frees the magazine itself
+static void magazine_drain(struct KmemCache *cache, struct Magazine *mag) {
+  while (mag->rounds > 0) {
+    slab_free(cache, mag->objs[--mag->rounds]);
+  }
+  slab_free(&magazine_cache, mag);
+}
+
+static void cpu_cache_drain(struct KmemCache *cache, struct KmemCpuCache *cc) {
+  if (cc->loaded != NULL) {
+    magazine_drain(cache, cc->loaded);
+    cc->loaded = NULL;
+  }
+  if (cc->previous != NULL) {
+    magazine_drain(cache, cc->previous);
+    cc->previous = NULL;
+  }
+}
+
+static void depot_drain(struct KmemCache *cache) {
+  struct Magazine *mag;
+  while ((mag = depot_pop(cache, &cache->depot_full,
+                          &cache->depot_num_full)) != NULL) {
+    magazine_drain(cache, mag);
+  }
+  while ((mag = depot_pop(cache, &cache->depot_empty,
+                          &cache->depot_num_empty)) != NULL) {
+    magazine_drain(cache, mag);
+  }
+}
+
+static void *cpu_cache_alloc(struct KmemCache *cache) {
+  if (cache->magazine_size == 0) {
+    return slab_alloc(cache);
+  }
+  struct KmemCpuCache *cc = &cache->cpu[CPU_id()];
+  if (cc->loaded != NULL && cc->loaded->rounds > 0) {
+    return cc->loaded->objs[--cc->loaded->rounds];
+  }
+  if (cc->previous != NULL && cc->previous->rounds > 0) {
+    struct Magazine *tmp = cc->loaded;
+    cc->loaded = cc->previous;
+    cc->previous = tmp;
+    return cc->loaded->objs[--cc->loaded->rounds];
+  }
+  // both empty, trade one in for a full magazine from the depot
+  struct Magazine *full =
+      depot_pop(cache, &cache->depot_full, &cache->depot_num_full);
+  if (full == NULL) {
+    return slab_alloc(cache);
+  }
+  if (cc->previous != NULL &&
+      !depot_push(cache, &cache->depot_empty, &cache->depot_num_empty,
+                  cc->previous)) {
+    slab_free(&magazine_cache, cc->previous);
+  }
+  cc->previous = cc->loaded;
+  cc->loaded = full;
+  return cc->loaded->objs[--cc->loaded->rounds];
+}
+
+// the magazines belong to this CPU only while nothing else can run on it
+void *kmem_cache_alloc(struct KmemCache *cache) {
+  preempt_disable();
+  void *obj = cpu_cache_alloc(cache);
+  preempt_enable();
+  return obj;
+}
+
+static void cpu_cache_free(struct KmemCache *cache, void *obj) {
+  if (cache->magazine_size == 0) {
+    slab_free(cache, obj);
+    return;
+  }
+  struct KmemCpuCache *cc = &cache->cpu[CPU_id()];
+  if (cc->loaded != NULL && cc->loaded->rounds < cache->magazine_size) {
+    cc->loaded->objs[cc->loaded->rounds++] = obj;
+    return;
+  }
+  if (cc->previous != NULL && cc->previous->rounds < cache->magazine_size) {
+    struct Magazine *tmp = cc->loaded;
+    cc->loaded = cc->previous;
+    cc->previous = tmp;
+    cc->loaded->objs[cc->loaded->rounds++] = obj;
+    return;
+  }
+  // both full (or missing), trade one in for an empty magazine
+  struct Magazine *empty =
+      depot_pop(cache, &cache->depot_empty, &cache->depot_num_empty);
+  if (empty == NULL) {
+    empty = magazine_alloc();
+    if (empty == NULL) {
+      slab_free(cache, obj);
+      return;
+    }
+  }
+  if (cc->previous != NULL &&
+      !depot_push(cache, &cache->depot_full, &cache->depot_num_full,
+                  cc->previous)) {
+    magazine_drain(cache, cc->previous);
+  }
+  cc->previous = cc->loaded;
+  cc->loaded = empty;
+  cc->loaded->objs[cc->loaded->rounds++] = obj;
+}
+
+void kmem_cache_free(struct KmemCache *cache, void *obj) {
+  preempt_disable();
+  cpu_cache_free(cache, obj);
+  preempt_enable();
+}
+
+size_t kmem_cache_shrink(struct KmemCache *cache) {
+  preempt_disable();
+  depot_drain(cache);
+  if (cache->magazine_size > 0) {
+    cpu_cache_drain(cache, &cache->cpu[CPU_id()]);
+  }
+  size_t freed = 0;
+  spin_lock(&cache->lock);
+  while (cache->empty != NULL) {
+    struct Slab *slab = cache->empty;
+    slab_list_remove(&cache->empty, slab);
+    cache->num_empty -= 1;
+    slab_release(cache, slab);
+    freed += 1 << SLAB_ORDER;
+  }
+  spin_unlock(&cache->lock);
+  preempt_enable();
+  return freed;
+}
+
+struct KmemCache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                    kmem_ctor_t ctor) {
+  struct KmemCache *cache = slab_alloc(&cache_cache);
+  if (cache != NULL) {
+    cache_setup(cache, name, size, align, ctor);
+    cache->magazine_size = magazine_size(cache->stride);
+  }
+  return cache;
+}
+
+void kmem_cache_destroy(struct KmemCache *cache) {
+  preempt_disable();
+  if (cache->magazine_size > 0) {
+    for (int cpu = 0; cpu < CPU_MAX; ++cpu) {
+      cpu_cache_drain(cache, &cache->cpu[cpu]);
+    }
+  }
+  kmem_cache_shrink(cache);
+  assert(cache->active_objs == 0 && "Destroying a cache still in use");
+  spin_lock(&caches_lock);
+  for (struct KmemCache **cur = &caches; *cur != NULL; cur = &(*cur)->next) {
+    if (*cur == cache) {
+      *cur = cache->next;
+      break;
+    }
+  }
+  spin_unlock(&caches_lock);
+  slab_free(&cache_cache, cache);
+  preempt_enable();
+}
+
+struct KmemCache *kmem_cache_of(void *obj) { return slab_of(obj)->cache; }
+
+void kmem_cache_print_stats() {
+  printk("slab caches (name, object size, active/total objects, slabs, "
+         "depot):\n");
+  spin_lock(&caches_lock);
+  for (struct KmemCache *cache = caches; cache != NULL; cache = cache->next) {
+    printk("  %s: %lu, %lu/%lu, %lu, %lu full magazines\n", cache->name,
+           cache->size, cache->active_objs,
+           cache->num_slabs * cache->objs_per_slab, cache->num_slabs,
+           cache->depot_num_full);
+  }
+  spin_unlock(&caches_lock);
+}
+
+static size_t slab_shrink_count(struct Shrinker *this) {
+  size_t empty = 0;
+  spin_lock(&caches_lock);
+  for (struct KmemCache *cache = caches; cache != NULL; cache = cache->next) {
+    empty += cache->num_empty;
+  }
+  spin_unlock(&caches_lock);
+  return empty << SLAB_ORDER;
+}
+
+static size_t slab_shrink_scan(struct Shrinker *this, size_t nr_pages) {
+  size_t freed = 0;
+  spin_lock(&caches_lock);
+  for (struct KmemCache *cache = caches; cache != NULL && freed < nr_pages;
+       cache = cache->next) {
+    freed += kmem_cache_shrink(cache);
+  }
+  spin_unlock(&caches_lock);
+  return freed;
+}
+
+static struct Shrinker slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrink_count,
+    .scan = slab_shrink_scan,
+};
+
+void slab_init() {
+  cache_setup(&cache_cache, "kmem_cache", sizeof(struct KmemCache), 0, NULL);
+  cache_setup(&magazine_cache, "kmem_magazine", sizeof(struct Magazine), 0,
+              NULL);
+  SHRINK_register(&slab_shrinker);
+}
+
+#ifdef SLAB_BENCH
+#define SLAB_BENCH_MAX_THREADS 4
+#define SLAB_BENCH_ROUNDS 20000
+#define SLAB_BENCH_BATCH 16
+// yield this often so the workers interleave
+#define SLAB_BENCH_YIELD_EVERY 64
+static struct KmemCache bench_slab_cache;
+static struct KmemCache bench_magazine_cache;
+static struct ProcessQueue bench_done;
+static size_t bench_running;
+
+static void bench_worker(void *arg) {
+  struct KmemCache *cache = arg;
+  void *objs[SLAB_BENCH_BATCH];
+  for (int round = 0; round < SLAB_BENCH_ROUNDS; ++round) {
+    for (int i = 0; i < SLAB_BENCH_BATCH; ++i) {
+      objs[i] = kmem_cache_alloc(cache);
+      assert(objs[i] != NULL && "Slab benchmark ran out of memory");
+    }
+    for (int i = 0; i < SLAB_BENCH_BATCH; ++i) {
+      kmem_cache_free(cache, objs[i]);
+    }
+    if (round % SLAB_BENCH_YIELD_EVERY == 0) {
+      yield();
+    }
+  }
+  if (__atomic_sub_fetch(&bench_running, 1, __ATOMIC_SEQ_CST) == 0) {
+    PROC_unblock_all(&bench_done);
+  }
+}
+
+static uint64_t bench_run(struct KmemCache *cache, int num_threads) {
+  bench_running = num_threads;
+  uint64_t start = rdtsc();
+  for (int i = 0; i < num_threads; ++i) {
+    PROC_create_kthread(&bench_worker, cache);
+  }
+  PROC_wait_lock();
+  while (bench_running > 0) {
+    PROC_block_on(&bench_done, true);
+    PROC_wait_lock();
+  }
+  PROC_wait_unlock();
+  uint64_t ops =
+      (uint64_t)num_threads * SLAB_BENCH_ROUNDS * SLAB_BENCH_BATCH * 2;
+  return (rdtsc() - start) / ops;
+}
+
+static void bench_thread(void *arg) {
+  for (int threads = 1; threads <= SLAB_BENCH_MAX_THREADS; ++threads) {
+    uint64_t slab_cycles = bench_run(&bench_slab_cache, threads);
+    uint64_t magazine_cycles = bench_run(&bench_magazine_cache, threads);
+    printk("slab bench, %d threads: %lu cycles/op on the slab lists, %lu with "
+           "magazines\n",
+           threads, slab_cycles, magazine_cycles);
+  }
+  kmem_cache_print_stats();
+}
+
+void kmem_cache_bench() {
+  // same object size, one cache with magazines and one going straight to the
+  // slab lists
+  cache_setup(&bench_slab_cache, "bench-slab", 64, 0, NULL);
+  cache_setup(&bench_magazine_cache, "bench-magazine", 64, 0, NULL);
+  bench_magazine_cache.magazine_size = magazine_size(64);
+  PROC_init_queue(&bench_done);
+  PROC_create_kthread(&bench_thread, NULL);
+}
+#endif
@@ -0,0 +1,278 @@
+#include "smp.h"
+#include "acpi.h"
+#include "allocator.h"
+#include "apic.h"
+#include "exit.h"
+#include "interrupts.h"
+#include "md5.h"
+#include "multiboot_tags.h"
+#include "page_allocator.h"
+#include "page_table.h"
+#include "preempt.h"
+#include "printk.h"
+#include "processes.h"
+#include "smolassert.h"
+#include "timer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// ticks to hold INIT for and to give an AP to come up
+#define SMP_INIT_TICKS 10
+#define SMP_STARTUP_TICKS 100
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint64_t ap_trampoline_cr3;
+extern uint64_t ap_trampoline_stack;
+extern uint64_t ap_trampoline_entry;
+extern uint64_t ap_trampoline_arg;
+
+static struct Cpu cpus[CPU_MAX];
+static unsigned num_cpus = 1;
+// every shootdown bumps the generation, each CPU records the last one it
+// flushed for
+static volatile uint64_t tlb_generation = 0;
+static volatile uint64_t tlb_flushed[CPU_MAX];
+
+void SMP_early_init() {
+  cpus[0].id = 0;
+  cpus[0].online = true;
+  CPU_set_local(&cpus[0]);
+}
+
+unsigned SMP_num_cpus() { return num_cpus; }
+
+struct Cpu *SMP_cpu(unsigned id) { return &cpus[id]; }
+
+static void wait_ticks(uint64_t ticks) {
+  uint64_t end = TIMER_ticks() + ticks;
+  while (TIMER_ticks() < end) {
+    asm volatile("pause");
+  }
+}
+
+static void flush_local_tlb() {
+  uint64_t generation = tlb_generation;
+  asm volatile("mov %%cr3, %%rax\n\t"
+               "mov %%rax, %%cr3"
+               :
+               :
+               : "rax", "memory");
+  tlb_flushed[CPU_id()] = generation;
+}
+
+static void tlb_handler(int num, int error_code, void *arg) {
+  flush_local_tlb();
+  APIC_eoi();
+}
+
+static void resched_handler(int num, int error_code, void *arg) {
+  APIC_eoi();
+  PROC_kick();
+}
+
+static void timer_handler(int num, int error_code, void *arg) {
+  APIC_eoi();
+  TIMER_tick();
+}
+
+static void spurious_handler(int num, int error_code, void *arg) {}
+
+void SMP_send_resched(unsigned cpu) {
+  APIC_send_ipi(cpus[cpu].apic_id, APIC_ICR_FIXED | SMP_RESCHED_VECTOR);
+}
+
+void SMP_tlb_shootdown() {
+  if (num_cpus == 1) {
+    return;
+  }
+  preempt_disable();
+  unsigned self = CPU_id();
+  uint64_t generation =
+      __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_SEQ_CST);
+  APIC_send_ipi_others(APIC_ICR_FIXED | SMP_TLB_VECTOR);
+  for (unsigned cpu = 0; cpu < num_cpus; ++cpu) {
+    while (cpu != self && tlb_flushed[cpu] < generation) {
+      // two CPUs can be waiting on each other with interrupts off, so
+      // answer anyone else's request from here too
+      if (tlb_flushed[self] < tlb_generation) {
+        flush_local_tlb();
+      }
+      asm volatile("pause");
+    }
+  }
+  preempt_enable();
+}
+
+void SMP_idle() {
+  while (true) {
+    PROC_run();
+    // idle time goes into zeroing frames for the page fault path, a batch at
+    // a time so woken threads aren't kept waiting
+    if (PROC_has_unblocked() || MMU_zero_pool_refill(MMU_ZERO_POOL_BATCH)) {
+      continue;
+    }
+    // sti only takes effect after the next instruction, so a wakeup can't
+    // land between the last look and the hlt
+    CLI;
+    if (PROC_has_unblocked()) {
+      STI;
+    } else {
+      // no tick while halted, only whatever is due next
+      TIMER_idle_enter();
+      STI;
+      HLT;
+      TIMER_idle_exit();
+    }
+  }
+}
+
+static void ap_main(uint64_t id) {
+  struct Cpu *cpu = &cpus[id];
+  CPU_set_local(cpu);
+  IRQ_init_ap(id);
+  APIC_enable();
+  APIC_timer_start(SMP_TIMER_VECTOR);
+  tlb_flushed[id] = tlb_generation;
+  __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+  STI;
+  SMP_idle();
+}
+
+static inline uint64_t *trampoline_param(uint64_t *param) {
+  return (uint64_t *)(SMP_TRAMPOLINE_ADDR +
+                      ((uint8_t *)param - ap_trampoline_start));
+}
+
+// INIT, then up to two STARTUPs as the MP spec asks for
+static bool start_ap(unsigned id, uint32_t apic_id) {
+  struct Cpu *cpu = &cpus[id];
+  cpu->id = id;
+  cpu->apic_id = apic_id;
+  // big enough to come straight from the frame allocator, so it's mapped
+  // before the AP has an IDT to take a fault with
+  void *stack = kmalloc(SMP_AP_STACK_SIZE);
+  if (stack == NULL) {
+    return false;
+  }
+  *trampoline_param(&ap_trampoline_cr3) = (uint64_t)get_current_page_table();
+  *trampoline_param(&ap_trampoline_stack) =
+      (uint64_t)stack + SMP_AP_STACK_SIZE;
+  *trampoline_param(&ap_trampoline_entry) = (uint64_t)&ap_main;
+  *trampoline_param(&ap_trampoline_arg) = id;
+
+  APIC_send_ipi(apic_id, APIC_ICR_INIT | APIC_ICR_LEVEL_ASSERT);
+  wait_ticks(SMP_INIT_TICKS);
+  for (int attempt = 0; attempt < 2 && !cpu->online; ++attempt) {
+    APIC_send_ipi(apic_id,
+                  APIC_ICR_STARTUP | (SMP_TRAMPOLINE_ADDR / MMU_PAGE_SIZE));
+    uint64_t deadline = TIMER_ticks() + SMP_STARTUP_TICKS;
+    while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) &&
+           TIMER_ticks() < deadline) {
+      asm volatile("pause");
+    }
+  }
+  if (!cpu->online) {
+    kfree(stack);
+  }
+  return cpu->online;
+}
+
+void SMP_init() {
+  IRQ_handler_set(SMP_RESCHED_VECTOR, resched_handler, NULL);
+  IRQ_handler_set(SMP_TLB_VECTOR, tlb_handler, NULL);
+  IRQ_handler_set(SMP_TIMER_VECTOR, timer_handler, NULL);
+  IRQ_handler_set(APIC_SPURIOUS_VECTOR, spurious_handler, NULL);
+
+  struct AcpiMadtInfo madt;
+  if (!ACPI_read_madt(&madt)) {
+    printk("smp: no MADT, running on the boot CPU only\n");
+    return;
+  }
+  APIC_init(madt.lapic_addr);
+  cpus[0].apic_id = APIC_id();
+  APIC_timer_calibrate();
+  TIMER_use_apic(SMP_TIMER_VECTOR);
+
+  size_t trampoline_size = ap_trampoline_end - ap_trampoline_start;
+  assert(SMP_TRAMPOLINE_ADDR + trampoline_size <= MEM_LOW_RESERVED_END &&
+         "AP trampoline doesn't fit in reserved low memory");
+  memcpy((void *)SMP_TRAMPOLINE_ADDR, ap_trampoline_start, trampoline_size);
+
+  for (size_t i = 0; i < madt.num_cpus; ++i) {
+    if (madt.apic_ids[i] == cpus[0].apic_id) {
+      continue;
+    }
+    if (start_ap(num_cpus, madt.apic_ids[i])) {
+      // published only once it's up, so nothing waits on a CPU that isn't
+      __atomic_store_n(&num_cpus, num_cpus + 1, __ATOMIC_RELEASE);
+    } else {
+      printk("smp: APIC %u didn't come up\n", madt.apic_ids[i]);
+    }
+  }
+  printk("smp: %u CPUs online\n", num_cpus);
+}
+
+#ifdef SMP_BENCH
+// the same buffer hashed this many times, dealt out to 1 up to every CPU's
+// worth of threads
+#define SMP_BENCH_JOBS 64
+#define SMP_BENCH_BUFFER_SIZE 65536
+static unsigned char *bench_buffer;
+static size_t bench_next_job;
+static size_t bench_running;
+static struct ProcessQueue bench_done;
+
+static void bench_worker(void *arg) {
+  while (__atomic_fetch_add(&bench_next_job, 1, __ATOMIC_RELAXED) <
+         SMP_BENCH_JOBS) {
+    MD5_CTX ctx;
+    unsigned char digest[16];
+    MD5Init(&ctx);
+    MD5Update(&ctx, bench_buffer, SMP_BENCH_BUFFER_SIZE);
+    MD5Final(digest, &ctx);
+  }
+  if (__atomic_sub_fetch(&bench_running, 1, __ATOMIC_SEQ_CST) == 0) {
+    PROC_unblock_all(&bench_done);
+  }
+}
+
+static uint64_t bench_run(unsigned threads) {
+  bench_next_job = 0;
+  bench_running = threads;
+  uint64_t start = rdtsc();
+  for (unsigned i = 0; i < threads; ++i) {
+    PROC_create_kthread(&bench_worker, NULL);
+  }
+  PROC_wait_lock();
+  while (bench_running > 0) {
+    PROC_block_on(&bench_done, true);
+    PROC_wait_lock();
+  }
+  PROC_wait_unlock();
+  return rdtsc() - start;
+}
+
+static void bench_thread(void *arg) {
+  bench_buffer = kmalloc(SMP_BENCH_BUFFER_SIZE);
+  assert(bench_buffer != NULL && "Out of memory for the SMP benchmark");
+  for (size_t i = 0; i < SMP_BENCH_BUFFER_SIZE; ++i) {
+    bench_buffer[i] = i * 31;
+  }
+  uint64_t single = bench_run(1);
+  for (unsigned threads = 1; threads <= num_cpus; ++threads) {
+    uint64_t cycles = threads == 1 ? single : bench_run(threads);
+    printk("smp bench, %u threads: %lu cycles, %lu.%lu times one thread\n",
+           threads, cycles, single / cycles, single * 10 / cycles % 10);
+  }
+  kfree(bench_buffer);
+}
+
+void SMP_bench() {
+  PROC_init_queue(&bench_done);
+  PROC_create_kthread(&bench_thread, NULL);
+}
+#endif
@@ -44,15 +44,12 @@ char *strcpy(char *dest, const char *src) {
   return dest;
 }
 
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
-
 int strcmp(const char *a, const char *b) {
-  for (size_t i = 0; i < MIN(strlen(a), strlen(b)); ++i) {
-    if (a[i] - b[i] != 0) {
-      return a[i] - b[0];
-    }
+  while (*a != '\0' && *a == *b) {
+    a += 1;
+    b += 1;
   }
-  return 0;
+  return (unsigned char)*a - (unsigned char)*b;
 }
 
 // I don't wanna write an allocator T^T
@@ -0,0 +1,46 @@
+global switch_to
+global proc_thread_start
+
+extern PROC_finish_switch
+extern kexit
+
+;; offset of cur_proc in struct Cpu, which gs points at
+%define CPU_CUR_PROC 8
+
+section .text
+bits 64
+;; void switch_to(struct ProcNode *prev, struct ProcNode *next)
+;; only the callee saved registers need keeping, whoever called this already
+;; saved the rest. Called with interrupts off, and returns once something
+;; switches back to prev
+switch_to:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    ;; prev->context->rsp
+    mov rax, [rdi]
+    mov [rax], rsp
+    ;; next becomes current only once prev's rsp is saved, since another CPU
+    ;; may take prev as soon as it isn't
+    mov [gs:CPU_CUR_PROC], rsi
+    mov rax, [rsi]
+    mov rsp, [rax]
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+;; a new thread's first switch_to returns here, with its entry point in r12
+;; and the argument in r13
+proc_thread_start:
+    call PROC_finish_switch
+    sti
+    mov rdi, r13
+    call r12
+    call kexit
@@ -0,0 +1,403 @@
+#include "sync.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "printk.h"
+#include "smolassert.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// how long a mutex is spun on while its owner runs before blocking
+#define KMUTEX_SPIN_LIMIT 1000
+// classes lock_stats_print can sort, any past this are left off
+#define LOCK_STATS_MAX_CLASSES 64
+
+#ifdef LOCK_STATS
+static struct Spinlock classes_lock = SPINLOCK_INIT;
+static struct LockClass *classes = NULL;
+
+static void atomic_max(uint64_t *max, uint64_t value) {
+  uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > cur && !__atomic_compare_exchange_n(max, &cur, value, false,
+                                                     __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED)) {
+  }
+}
+
+static inline uint64_t lock_clock() { return rdtsc(); }
+
+// wait_start is 0 if it was taken straight away
+static void class_acquired(struct LockClass *class, uint64_t wait_start) {
+  if (!__atomic_load_n(&class->registered, __ATOMIC_ACQUIRE)) {
+    SPIN_LOCK_GUARD(&classes_lock);
+    if (!class->registered) {
+      class->next = classes;
+      classes = class;
+      __atomic_store_n(&class->registered, true, __ATOMIC_RELEASE);
+    }
+    SPIN_UNLOCK_GUARD(&classes_lock);
+  }
+  __atomic_add_fetch(&class->acquisitions, 1, __ATOMIC_RELAXED);
+  if (wait_start != 0) {
+    uint64_t waited = rdtsc() - wait_start;
+    __atomic_add_fetch(&class->contentions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&class->wait_cycles, waited, __ATOMIC_RELAXED);
+    atomic_max(&class->wait_max, waited);
+  }
+}
+
+static void class_released(struct LockClass *class, uint64_t acquired_at) {
+  uint64_t held = rdtsc() - acquired_at;
+  __atomic_add_fetch(&class->holds, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&class->hold_cycles, held, __ATOMIC_RELAXED);
+  atomic_max(&class->hold_max, held);
+}
+#else
+static inline uint64_t lock_clock() { return 0; }
+static inline void class_acquired(struct LockClass *class,
+                                  uint64_t wait_start) {}
+#endif
+
+typedef bool (*try_acquire_t)(void *lock);
+
+// the slow path they all share, returns once try_acquire has succeeded
+static void wait_for(struct ProcessQueue *queue, volatile uint32_t *waiters,
+                     try_acquire_t try_acquire, void *lock) {
+  assert(!IRQ_in_interrupt() && "Can't sleep on a lock in an interrupt");
+  PROC_wait_lock();
+  __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+  while (!try_acquire(lock)) {
+    PROC_block_on(queue, true);
+    PROC_wait_lock();
+  }
+  __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+  PROC_wait_unlock();
+}
+
+// after the release itself is visible
+static inline void wake_one(struct ProcessQueue *queue,
+                            volatile uint32_t *waiters) {
+  if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0) {
+    PROC_unblock_one(queue);
+  }
+}
+
+void kmutex_init(struct KMutex *mutex, struct LockClass *class) {
+  mutex->owner = NULL;
+  mutex->waiters = 0;
+  PROC_init_queue(&mutex->queue);
+  mutex->class = class;
+}
+
+static bool mutex_try(void *lock) {
+  struct KMutex *mutex = lock;
+  struct ProcNode *expected = NULL;
+  return __atomic_compare_exchange_n(&mutex->owner, &expected, CPU_cur_proc(),
+                                     false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED);
+}
+
+// racy, the owner may have let go and even exited since it was read. At
+// worst that means spinning a little longer or blocking a little sooner
+static bool owner_running(struct ProcNode *owner) {
+  unsigned cpu = owner->cpu;
+  return cpu < SMP_num_cpus() && SMP_cpu(cpu)->cur_proc == owner;
+}
+
+// the owner of a short critical section is likely to be done before a
+// block and wakeup would be
+static bool mutex_spin(struct KMutex *mutex) {
+  if (SMP_num_cpus() == 1) {
+    return false;
+  }
+  for (int i = 0; i < KMUTEX_SPIN_LIMIT; ++i) {
+    struct ProcNode *owner = mutex->owner;
+    if (owner == NULL) {
+      if (mutex_try(mutex)) {
+        return true;
+      }
+    } else if (!owner_running(owner)) {
+      return false;
+    }
+    asm volatile("pause");
+  }
+  return false;
+}
+
+void kmutex_lock(struct KMutex *mutex) {
+  uint64_t wait_start = 0;
+  if (!mutex_try(mutex)) {
+    assert(mutex->owner != CPU_cur_proc() && "Mutex is already held");
+    wait_start = lock_clock();
+    if (!mutex_spin(mutex)) {
+      wait_for(&mutex->queue, &mutex->waiters, mutex_try, mutex);
+    }
+  }
+  class_acquired(mutex->class, wait_start);
+#ifdef LOCK_STATS
+  mutex->acquired_at = rdtsc();
+#endif
+}
+
+bool kmutex_trylock(struct KMutex *mutex) {
+  if (!mutex_try(mutex)) {
+    return false;
+  }
+  class_acquired(mutex->class, 0);
+#ifdef LOCK_STATS
+  mutex->acquired_at = rdtsc();
+#endif
+  return true;
+}
+
+void kmutex_unlock(struct KMutex *mutex) {
+  assert(mutex->owner == CPU_cur_proc() &&
+         "Mutex unlocked by a thread that doesn't hold it");
+#ifdef LOCK_STATS
+  class_released(mutex->class, mutex->acquired_at);
+#endif
+  __atomic_store_n(&mutex->owner, NULL, __ATOMIC_SEQ_CST);
+  wake_one(&mutex->queue, &mutex->waiters);
+}
+
+void ksem_init(struct KSemaphore *sem, int64_t count,
+               struct LockClass *class) {
+  sem->count = count;
+  sem->waiters = 0;
+  PROC_init_queue(&sem->queue);
+  sem->class = class;
+}
+
+static bool sem_try(void *lock) {
+  struct KSemaphore *sem = lock;
+  int64_t count = __atomic_load_n(&sem->count, __ATOMIC_SEQ_CST);
+  while (count > 0) {
+    if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ksem_down(struct KSemaphore *sem) {
+  uint64_t wait_start = 0;
+  if (!sem_try(sem)) {
+    wait_start = lock_clock();
+    wait_for(&sem->queue, &sem->waiters, sem_try, sem);
+  }
+  class_acquired(sem->class, wait_start);
+}
+
+bool ksem_trydown(struct KSemaphore *sem) {
+  if (!sem_try(sem)) {
+    return false;
+  }
+  class_acquired(sem->class, 0);
+  return true;
+}
+
+void ksem_up(struct KSemaphore *sem) {
+  __atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
+  wake_one(&sem->queue, &sem->waiters);
+}
+
+void kcond_init(struct KCondVar *cond) {
+  cond->seq = 0;
+  PROC_init_queue(&cond->queue);
+}
+
+// every signal bumps the sequence, so a signal between dropping the mutex
+// and blocking is seen and the wait returns straight away
+void kcond_wait(struct KCondVar *cond, struct KMutex *mutex) {
+  uint64_t seq = __atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST);
+  kmutex_unlock(mutex);
+  PROC_wait_lock();
+  if (cond->seq == seq) {
+    PROC_block_on(&cond->queue, true);
+  } else {
+    PROC_wait_unlock();
+  }
+  kmutex_lock(mutex);
+}
+
+void kcond_signal(struct KCondVar *cond) {
+  __atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+  PROC_unblock_one(&cond->queue);
+}
+
+void kcond_broadcast(struct KCondVar *cond) {
+  __atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+  PROC_unblock_all(&cond->queue);
+}
+
+void krwlock_init(struct KRWLock *lock, struct LockClass *class) {
+  lock->state = 0;
+  lock->readers_waiting = 0;
+  lock->writers_waiting = 0;
+  PROC_init_queue(&lock->readers);
+  PROC_init_queue(&lock->writers);
+  lock->class = class;
+}
+
+static bool read_try(void *arg) {
+  struct KRWLock *lock = arg;
+  int64_t state = __atomic_load_n(&lock->state, __ATOMIC_SEQ_CST);
+  // a waiting writer holds new readers off so it isn't starved
+  while (state >= 0 &&
+         __atomic_load_n(&lock->writers_waiting, __ATOMIC_SEQ_CST) == 0) {
+    if (__atomic_compare_exchange_n(&lock->state, &state, state + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool write_try(void *arg) {
+  struct KRWLock *lock = arg;
+  int64_t expected = 0;
+  return __atomic_compare_exchange_n(&lock->state, &expected, KRWLOCK_WRITER,
+                                     false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED);
+}
+
+void krwlock_read_lock(struct KRWLock *lock) {
+  uint64_t wait_start = 0;
+  if (!read_try(lock)) {
+    wait_start = lock_clock();
+    wait_for(&lock->readers, &lock->readers_waiting, read_try, lock);
+  }
+  class_acquired(lock->class, wait_start);
+}
+
+void krwlock_read_unlock(struct KRWLock *lock) {
+  int64_t state = __atomic_sub_fetch(&lock->state, 1, __ATOMIC_SEQ_CST);
+  assert(state >= 0 && "Read unlock of a rwlock that wasn't read locked");
+  if (state == 0) {
+    wake_one(&lock->writers, &lock->writers_waiting);
+  }
+}
+
+void krwlock_write_lock(struct KRWLock *lock) {
+  uint64_t wait_start = 0;
+  if (!write_try(lock)) {
+    wait_start = lock_clock();
+    wait_for(&lock->writers, &lock->writers_waiting, write_try, lock);
+  }
+  class_acquired(lock->class, wait_start);
+#ifdef LOCK_STATS
+  lock->acquired_at = rdtsc();
+#endif
+}
+
+void krwlock_write_unlock(struct KRWLock *lock) {
+  assert(lock->state == KRWLOCK_WRITER &&
+         "Write unlock of a rwlock that wasn't write locked");
+#ifdef LOCK_STATS
+  class_released(lock->class, lock->acquired_at);
+#endif
+  __atomic_store_n(&lock->state, 0, __ATOMIC_SEQ_CST);
+  // readers held off by this writer, and the next writer, which gets in
+  // first if it wins the race
+  if (__atomic_load_n(&lock->readers_waiting, __ATOMIC_SEQ_CST) > 0) {
+    PROC_unblock_all(&lock->readers);
+  }
+  wake_one(&lock->writers, &lock->writers_waiting);
+}
+
+#ifdef LOCK_STATS
+void lock_stats_print() {
+  struct LockClass *sorted[LOCK_STATS_MAX_CLASSES];
+  size_t num = 0;
+  SPIN_LOCK_GUARD(&classes_lock);
+  for (struct LockClass *class = classes;
+       class != NULL && num < LOCK_STATS_MAX_CLASSES; class = class->next) {
+    size_t i = num++;
+    for (; i > 0 && sorted[i - 1]->wait_cycles < class->wait_cycles; --i) {
+      sorted[i] = sorted[i - 1];
+    }
+    sorted[i] = class;
+  }
+  SPIN_UNLOCK_GUARD(&classes_lock);
+  printk("locks: acquisitions, contended, wait avg/max, hold avg/max in "
+         "cycles\n");
+  for (size_t i = 0; i < num; ++i) {
+    struct LockClass *class = sorted[i];
+    printk("  %s: %lu, %lu, %lu/%lu, %lu/%lu\n", class->name,
+           class->acquisitions, class->contentions,
+           class->wait_cycles / (class->contentions | 1), class->wait_max,
+           class->hold_cycles / (class->holds | 1), class->hold_max);
+  }
+}
+#endif
+
+#ifdef SYNC_BENCH
+// threads bumping a shared counter under a mutex, one per CPU and then
+// twice that so some owners get preempted mid hold, then a semaphore ping
+// pong between two threads
+#define SYNC_BENCH_ROUNDS 100000
+static struct LockClass bench_class = LOCK_CLASS_INIT("sync_bench");
+static struct KMutex bench_mutex;
+static struct KSemaphore bench_ping;
+static struct KSemaphore bench_pong;
+static struct KSemaphore bench_done;
+static volatile uint64_t bench_counter;
+
+static void bench_incrementer(void *arg) {
+  for (int i = 0; i < SYNC_BENCH_ROUNDS; ++i) {
+    kmutex_lock(&bench_mutex);
+    bench_counter += 1;
+    kmutex_unlock(&bench_mutex);
+  }
+  ksem_up(&bench_done);
+}
+
+static void bench_mutex_run(unsigned threads) {
+  bench_counter = 0;
+  uint64_t start = rdtsc();
+  for (unsigned i = 0; i < threads; ++i) {
+    PROC_create_kthread(&bench_incrementer, NULL);
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    ksem_down(&bench_done);
+  }
+  uint64_t cycles = rdtsc() - start;
+  assert(bench_counter == (uint64_t)threads * SYNC_BENCH_ROUNDS &&
+         "Mutex let two threads in at once");
+  printk("sync bench, mutex with %u threads: %lu cycles a lock\n", threads,
+         cycles / bench_counter);
+}
+
+static void bench_ponger(void *arg) {
+  for (int i = 0; i < SYNC_BENCH_ROUNDS; ++i) {
+    ksem_down(&bench_ping);
+    ksem_up(&bench_pong);
+  }
+  ksem_up(&bench_done);
+}
+
+static void bench_thread(void *arg) {
+  kmutex_init(&bench_mutex, &bench_class);
+  ksem_init(&bench_ping, 0, &bench_class);
+  ksem_init(&bench_pong, 0, &bench_class);
+  ksem_init(&bench_done, 0, &bench_class);
+  bench_mutex_run(SMP_num_cpus());
+  bench_mutex_run(2 * SMP_num_cpus());
+
+  uint64_t start = rdtsc();
+  PROC_create_kthread(&bench_ponger, NULL);
+  for (int i = 0; i < SYNC_BENCH_ROUNDS; ++i) {
+    ksem_up(&bench_ping);
+    ksem_down(&bench_pong);
+  }
+  ksem_down(&bench_done);
+  printk("sync bench, semaphore ping pong: %lu cycles a round trip\n",
+         (rdtsc() - start) / SYNC_BENCH_ROUNDS);
+}
+
+void sync_bench() { PROC_create_kthread(&bench_thread, NULL); }
+#endif
@@ -0,0 +1,250 @@
+#include "thread_pool.h"
+#include "cpu.h"
+#include "printk.h"
+#include "processes.h"
+#include "smolassert.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "sync.h"
+
+#ifdef POOL_BENCH
+#include "allocator.h"
+#include "md5.h"
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a finished task's waiters are woken while it's still DONE_WAKING, and
+// only once that's over does it go DONE and belong to its owner again
+#define TASK_IDLE 0
+#define TASK_QUEUED 1
+#define TASK_DONE_WAKING 2
+#define TASK_DONE 3
+
+static struct LockClass pool_lock_class = LOCK_CLASS_INIT("pool");
+
+static struct Spinlock queue_lock = SPINLOCK_INIT;
+static struct PoolTask *queue_head = NULL;
+static struct PoolTask *queue_tail = NULL;
+// one for every task on the queue, workers sleep on it
+static struct KSemaphore queued;
+static size_t num_workers = 0;
+
+// only after a successful down on queued, which means there's one there
+static struct PoolTask *pop_task() {
+  SPIN_LOCK_GUARD(&queue_lock);
+  struct PoolTask *task = queue_head;
+  queue_head = task->next;
+  if (queue_head == NULL) {
+    queue_tail = NULL;
+  }
+  SPIN_UNLOCK_GUARD(&queue_lock);
+  return task;
+}
+
+static void run_task(struct PoolTask *task) {
+  task->result = task->fn(task->arg);
+  // seen under the wait lock, so a joiner either doesn't block or is
+  // already on the queue for the wakeup
+  PROC_wait_lock();
+  task->state = TASK_DONE_WAKING;
+  PROC_wait_unlock();
+  PROC_unblock_all(&task->waiters);
+  __atomic_store_n(&task->state, TASK_DONE, __ATOMIC_RELEASE);
+}
+
+static void worker(void *arg) {
+  while (true) {
+    ksem_down(&queued);
+    run_task(pop_task());
+  }
+}
+
+void POOL_init() {
+  ksem_init(&queued, 0, &pool_lock_class);
+  num_workers = SMP_num_cpus();
+  for (unsigned cpu = 0; cpu < num_workers; ++cpu) {
+    PROC_create_kthread_pinned(&worker, NULL, cpu);
+  }
+  printk("pool: %lu workers\n", num_workers);
+}
+
+size_t POOL_num_workers() { return num_workers; }
+
+void POOL_task_init(struct PoolTask *task, pool_task_fn_t fn, void *arg) {
+  task->next = NULL;
+  task->fn = fn;
+  task->arg = arg;
+  task->result = NULL;
+  task->state = TASK_IDLE;
+  PROC_init_queue(&task->waiters);
+}
+
+void POOL_submit(struct PoolTask *task) {
+  assert(task->state == TASK_IDLE && "pool task submitted twice");
+  task->state = TASK_QUEUED;
+  task->next = NULL;
+  SPIN_LOCK_GUARD(&queue_lock);
+  if (queue_tail == NULL) {
+    queue_head = task;
+  } else {
+    queue_tail->next = task;
+  }
+  queue_tail = task;
+  SPIN_UNLOCK_GUARD(&queue_lock);
+  ksem_up(&queued);
+}
+
+bool POOL_done(struct PoolTask *task) {
+  return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == TASK_DONE;
+}
+
+void *POOL_join(struct PoolTask *task) {
+  assert(task->state != TASK_IDLE && "pool task joined before submitting");
+  // a worker joining would otherwise hold up its CPU's share of the queue,
+  // maybe the very task it's waiting for
+  while (task->state == TASK_QUEUED && ksem_trydown(&queued)) {
+    run_task(pop_task());
+  }
+  PROC_wait_lock();
+  while (task->state == TASK_QUEUED) {
+    PROC_block_on(&task->waiters, true);
+    PROC_wait_lock();
+  }
+  PROC_wait_unlock();
+  while (!POOL_done(task)) {
+    asm volatile("pause");
+  }
+  return task->result;
+}
+
+struct ParallelFor {
+  volatile size_t next;
+  size_t end;
+  size_t grain;
+  pool_range_fn_t fn;
+  void *arg;
+};
+
+// every helper and the caller take pieces until there are none left, so a
+// helper that only gets to run late just finds nothing to do
+static void *parallel_for_pieces(void *arg) {
+  struct ParallelFor *loop = arg;
+  while (true) {
+    size_t begin = __atomic_fetch_add(&loop->next, loop->grain,
+                                      __ATOMIC_RELAXED);
+    if (begin >= loop->end) {
+      return NULL;
+    }
+    size_t end = loop->end - begin > loop->grain ? begin + loop->grain
+                                                 : loop->end;
+    loop->fn(begin, end, loop->arg);
+  }
+}
+
+void POOL_parallel_for(size_t begin, size_t end, size_t grain,
+                       pool_range_fn_t fn, void *arg) {
+  if (begin >= end) {
+    return;
+  }
+  if (grain == 0) {
+    grain = 1;
+  }
+  struct ParallelFor loop = {
+      .next = begin, .end = end, .grain = grain, .fn = fn, .arg = arg};
+  // the caller takes pieces too, so one helper fewer than there are pieces
+  size_t pieces = (end - begin - 1) / grain + 1;
+  size_t helpers = pieces - 1 < num_workers ? pieces - 1 : num_workers;
+  struct PoolTask tasks[CPU_MAX];
+  for (size_t i = 0; i < helpers; ++i) {
+    POOL_task_init(&tasks[i], &parallel_for_pieces, &loop);
+    POOL_submit(&tasks[i]);
+  }
+  parallel_for_pieces(&loop);
+  for (size_t i = 0; i < helpers; ++i) {
+    POOL_join(&tasks[i]);
+  }
+}
+
+#ifdef POOL_BENCH
+// empty tasks, to time what it costs to get one run
+#define POOL_BENCH_TASKS 256
+// checksummed piece by piece, as a checksum job would
+#define POOL_BENCH_PIECES 64
+#define POOL_BENCH_PIECE_SIZE 16384
+
+static size_t bench_running;
+static struct ProcessQueue bench_done;
+static unsigned char *bench_buffer;
+static unsigned char bench_digests[POOL_BENCH_PIECES][16];
+
+static void bench_empty_thread(void *arg) {
+  if (__atomic_sub_fetch(&bench_running, 1, __ATOMIC_SEQ_CST) == 0) {
+    PROC_unblock_all(&bench_done);
+  }
+}
+
+static void *bench_empty_task(void *arg) { return arg; }
+
+static void bench_hash(size_t begin, size_t end, void *arg) {
+  for (size_t piece = begin; piece < end; ++piece) {
+    MD5_CTX ctx;
+    MD5Init(&ctx);
+    MD5Update(&ctx, bench_buffer + piece * POOL_BENCH_PIECE_SIZE,
+              POOL_BENCH_PIECE_SIZE);
+    MD5Final(bench_digests[piece], &ctx);
+  }
+}
+
+static void bench_thread(void *arg) {
+  bench_running = POOL_BENCH_TASKS;
+  uint64_t start = rdtsc();
+  for (size_t i = 0; i < POOL_BENCH_TASKS; ++i) {
+    PROC_create_kthread(&bench_empty_thread, NULL);
+  }
+  PROC_wait_lock();
+  while (bench_running > 0) {
+    PROC_block_on(&bench_done, true);
+    PROC_wait_lock();
+  }
+  PROC_wait_unlock();
+  uint64_t threads = rdtsc() - start;
+
+  static struct PoolTask tasks[POOL_BENCH_TASKS];
+  start = rdtsc();
+  for (size_t i = 0; i < POOL_BENCH_TASKS; ++i) {
+    POOL_task_init(&tasks[i], &bench_empty_task, NULL);
+    POOL_submit(&tasks[i]);
+  }
+  for (size_t i = 0; i < POOL_BENCH_TASKS; ++i) {
+    POOL_join(&tasks[i]);
+  }
+  uint64_t pooled = rdtsc() - start;
+  printk("pool bench, per task: %lu cycles for a thread, %lu pooled\n",
+         threads / POOL_BENCH_TASKS, pooled / POOL_BENCH_TASKS);
+
+  bench_buffer = kmalloc(POOL_BENCH_PIECES * POOL_BENCH_PIECE_SIZE);
+  assert(bench_buffer != NULL && "Out of memory for the pool benchmark");
+  for (size_t i = 0; i < POOL_BENCH_PIECES * POOL_BENCH_PIECE_SIZE; ++i) {
+    bench_buffer[i] = i * 31;
+  }
+  start = rdtsc();
+  bench_hash(0, POOL_BENCH_PIECES, NULL);
+  uint64_t serial = rdtsc() - start;
+  start = rdtsc();
+  POOL_parallel_for(0, POOL_BENCH_PIECES, 1, &bench_hash, NULL);
+  uint64_t parallel = rdtsc() - start;
+  printk("pool bench, %u checksums: %lu cycles serial, %lu with %lu "
+         "workers, %lu.%lu times faster\n",
+         POOL_BENCH_PIECES, serial, parallel, num_workers, serial / parallel,
+         serial * 10 / parallel % 10);
+  kfree(bench_buffer);
+}
+
+void POOL_bench() {
+  PROC_init_queue(&bench_done);
+  PROC_create_kthread(&bench_thread, NULL);
+}
+#endif
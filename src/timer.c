@@ -0,0 +1,390 @@
+#include "timer.h"
+#include "apic.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "portio.h"
+#include "printk.h"
+#include "processes.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND 0x43
+#define PIT_FREQUENCY 1193182
+// channel 0, low then high byte of the divisor, rate generator
+#define PIT_MODE_RATE_GENERATOR 0x34
+// ticks the TSC calibration runs for
+#define TSC_CALIBRATE_TICKS 10
+
+// a hierarchical wheel: level 0 has a slot per tick, each level above a slot
+// per whole turn of the one below. Timers sit in the level their distance
+// away calls for and drop a level whenever the one below wraps around to
+// their slot, so adding, cancelling and firing are all constant time
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+// anything further out waits in the top level and gets put back there until
+// it's in range
+#define WHEEL_MAX_DELTA ((1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+// only counts while the PIT is ticking, the TSC keeps time after that
+static volatile uint64_t pit_ticks = 0;
+
+static uint64_t tsc_base = 0;
+// nanoseconds per TSC cycle and cycles per nanosecond, as 32.32 fixed point
+static uint64_t tsc_ns_mult = 0;
+static uint64_t tsc_cycles_mult = 0;
+
+// once the local APIC timers take over the tick, what they interrupt on
+static uint8_t apic_vector = 0;
+// the tick the boot CPU's timer is set for while it idles, UINT64_MAX if
+// nothing is, 0 while it isn't idle. Under the timer lock
+static uint64_t idle_until = 0;
+
+static struct Spinlock timer_lock = SPINLOCK_INIT;
+static struct Timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+// the next tick the wheel hasn't fired yet
+static uint64_t wheel_tick = 0;
+// the callback being run outside the lock, for TIMER_cancel to wait out
+static struct Timer *volatile running_timer = NULL;
+static struct Softirq wheel_softirq;
+
+static inline unsigned wheel_slot(uint64_t tick, unsigned level) {
+  return (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+}
+
+static void wheel_insert(struct Timer *timer) {
+  uint64_t expires = timer->expires;
+  // already due ones fire on the next tick the wheel runs
+  if (expires < wheel_tick) {
+    expires = wheel_tick;
+  }
+  uint64_t delta = expires - wheel_tick;
+  if (delta > WHEEL_MAX_DELTA) {
+    expires = wheel_tick + WHEEL_MAX_DELTA;
+    delta = WHEEL_MAX_DELTA;
+  }
+  unsigned level = 0;
+  while (delta >= 1ull << (WHEEL_BITS * (level + 1))) {
+    level += 1;
+  }
+  struct Timer **head = &wheel[level][wheel_slot(expires, level)];
+  timer->next = *head;
+  if (timer->next != NULL) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = head;
+  *head = timer;
+}
+
+static void wheel_remove(struct Timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+// puts a slot's timers back in, which lands them a level or more down.
+// Returns the slot so the caller knows if this level wrapped too
+static unsigned wheel_cascade(unsigned level) {
+  unsigned slot = wheel_slot(wheel_tick, level);
+  struct Timer *timer = wheel[level][slot];
+  wheel[level][slot] = NULL;
+  while (timer != NULL) {
+    struct Timer *next = timer->next;
+    wheel_insert(timer);
+    timer = next;
+  }
+  return slot;
+}
+
+// the first tick anything could be due on. Something up a level counts as
+// due when its slot cascades, which is early but never late
+static uint64_t wheel_next_expiry() {
+  uint64_t next = UINT64_MAX;
+  for (unsigned i = 0; i < WHEEL_SIZE; ++i) {
+    if (wheel[0][wheel_slot(wheel_tick + i, 0)] != NULL) {
+      next = wheel_tick + i;
+      break;
+    }
+  }
+  for (unsigned level = 1; level < WHEEL_LEVELS; ++level) {
+    uint64_t span = 1ull << (WHEEL_BITS * level);
+    // cascades happen on multiples of the span, starting with the next one
+    // the wheel hasn't run yet
+    uint64_t tick = (wheel_tick + span - 1) & ~(span - 1);
+    for (unsigned i = 0; i < WHEEL_SIZE && tick < next; ++i, tick += span) {
+      if (wheel[level][wheel_slot(tick, level)] != NULL) {
+        next = tick;
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+// a softirq on the boot CPU, fires everything due up to now with interrupts
+// on for the callbacks
+static void wheel_run(void *arg) {
+  uint64_t now = TIMER_ticks();
+  CLI;
+  spin_lock(&timer_lock);
+  while (wheel_tick <= now) {
+    // after a long tickless idle, skip straight over the empty stretch
+    if (now - wheel_tick > WHEEL_SIZE) {
+      uint64_t next = wheel_next_expiry();
+      if (next > wheel_tick) {
+        wheel_tick = next <= now ? next : now + 1;
+        continue;
+      }
+    }
+    if (wheel_slot(wheel_tick, 0) == 0) {
+      for (unsigned level = 1; level < WHEEL_LEVELS; ++level) {
+        if (wheel_cascade(level) != 0) {
+          break;
+        }
+      }
+    }
+    // one at a time, a callback can cancel or add others in this slot
+    struct Timer **slot = &wheel[0][wheel_slot(wheel_tick, 0)];
+    while (*slot != NULL) {
+      struct Timer *timer = *slot;
+      wheel_remove(timer);
+      running_timer = timer;
+      spin_unlock(&timer_lock);
+      STI;
+      timer->fn(timer->arg);
+      CLI;
+      spin_lock(&timer_lock);
+      running_timer = NULL;
+    }
+    wheel_tick += 1;
+  }
+  spin_unlock(&timer_lock);
+  STI;
+}
+
+void TIMER_tick() {
+  // the wheel is all run from one CPU
+  if (CPU_id() == 0) {
+    IRQ_raise_softirq(&wheel_softirq);
+  }
+  PROC_tick();
+}
+
+static void timer_handler(int num, int error_code, void *arg) {
+  pit_ticks += 1;
+  PIC_sendEOI(num);
+  TIMER_tick();
+}
+
+// the TSC is taken to be invariant and in step across CPUs, as it is on
+// anything recent
+static void tsc_calibrate() {
+  // start on a tick edge so the whole window is measured
+  uint64_t start = pit_ticks;
+  while (pit_ticks == start) {
+    asm volatile("pause");
+  }
+  uint64_t tsc_start = rdtsc();
+  while (pit_ticks < start + 1 + TSC_CALIBRATE_TICKS) {
+    asm volatile("pause");
+  }
+  uint64_t cycles = rdtsc() - tsc_start;
+  uint64_t hz = cycles * (TIMER_HZ / TSC_CALIBRATE_TICKS);
+  tsc_ns_mult = (TIMER_NS_PER_SEC << 32) / hz;
+  // in kHz so the shift can't overflow, and rounded up so deadlines land
+  // just after the time they're for rather than just before
+  tsc_cycles_mult = ((hz / 1000) << 32) / (TIMER_NS_PER_SEC / 1000) + 1;
+  tsc_base = tsc_start - (start + 1) * (cycles / TSC_CALIBRATE_TICKS);
+  printk("timer: TSC runs at %lu kHz\n", hz / 1000);
+}
+
+void TIMER_init() {
+  uint16_t divisor = PIT_FREQUENCY / TIMER_HZ;
+  outb(PIT_COMMAND, PIT_MODE_RATE_GENERATOR);
+  outb(PIT_CHANNEL0, divisor & 0xFF);
+  outb(PIT_CHANNEL0, divisor >> 8);
+  IRQ_softirq_init(&wheel_softirq, &wheel_run, NULL);
+  IRQ_handler_set(IRQ_BASE + IRQ0, timer_handler, NULL);
+  IRQ_clear_mask(IRQ0);
+  printk("timer: %d Hz\n", TIMER_HZ);
+  tsc_calibrate();
+}
+
+uint64_t TIMER_ticks() {
+  if (tsc_ns_mult == 0) {
+    return pit_ticks;
+  }
+  return TIMER_ns() / TIMER_NS_PER_TICK;
+}
+
+uint64_t TIMER_ns() {
+  if (tsc_ns_mult == 0) {
+    return pit_ticks * TIMER_NS_PER_TICK;
+  }
+  return ((unsigned __int128)(rdtsc() - tsc_base) * tsc_ns_mult) >> 32;
+}
+
+uint64_t TIMER_ns_to_tsc(uint64_t ns) {
+  return tsc_base + (((unsigned __int128)ns * tsc_cycles_mult) >> 32);
+}
+
+void TIMER_use_apic(uint8_t vector) {
+  apic_vector = vector;
+  APIC_timer_start(vector);
+  IRQ_set_mask(IRQ0);
+  printk("timer: ticking off the local APIC, tickless while idle\n");
+}
+
+void TIMER_idle_enter() {
+  if (apic_vector == 0) {
+    return;
+  }
+  // other CPUs have no timers of their own, anything queued for them comes
+  // with an IPI
+  if (CPU_id() != 0) {
+    APIC_timer_stop();
+    return;
+  }
+  spin_lock(&timer_lock);
+  uint64_t next = wheel_next_expiry();
+  idle_until = next;
+  spin_unlock(&timer_lock);
+  if (next == UINT64_MAX) {
+    APIC_timer_stop();
+  } else {
+    APIC_timer_oneshot(apic_vector, next * TIMER_NS_PER_TICK);
+  }
+}
+
+void TIMER_idle_exit() {
+  if (apic_vector == 0) {
+    return;
+  }
+  CLI_GUARD;
+  if (CPU_id() == 0) {
+    spin_lock(&timer_lock);
+    idle_until = 0;
+    spin_unlock(&timer_lock);
+  }
+  APIC_timer_start(apic_vector);
+  STI_GUARD;
+}
+
+void TIMER_setup(struct Timer *timer, timer_fn_t fn, void *arg) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->fn = fn;
+  timer->arg = arg;
+}
+
+void TIMER_arm(struct Timer *timer, uint64_t delay_ns) {
+  // rounded up, plus one since the current tick is already partly gone
+  uint64_t delay =
+      (delay_ns + TIMER_NS_PER_TICK - 1) / TIMER_NS_PER_TICK + 1;
+  SPIN_LOCK_GUARD(&timer_lock);
+  if (timer->pprev != NULL) {
+    wheel_remove(timer);
+  }
+  timer->expires = TIMER_ticks() + delay;
+  wheel_insert(timer);
+  // the boot CPU has to set its timer again if it's idling past this one.
+  // From the boot CPU itself that's an interrupt, and the idle loop looks
+  // again once it returns
+  bool kick = timer->expires < idle_until && CPU_id() != 0;
+  SPIN_UNLOCK_GUARD(&timer_lock);
+  if (kick) {
+    SMP_send_resched(0);
+  }
+}
+
+bool TIMER_cancel(struct Timer *timer) {
+  SPIN_LOCK_GUARD(&timer_lock);
+  bool pending = timer->pprev != NULL;
+  if (pending) {
+    wheel_remove(timer);
+  }
+  SPIN_UNLOCK_GUARD(&timer_lock);
+  while (running_timer == timer) {
+    asm volatile("pause");
+  }
+  return pending;
+}
+
+void ksleep_ns(uint64_t ns) {
+  if (ns < TIMER_NS_PER_TICK) {
+    uint64_t deadline = TIMER_ns() + ns;
+    while (TIMER_ns() < deadline) {
+      asm volatile("pause");
+    }
+    return;
+  }
+  // nothing else ever wakes this queue
+  struct ProcessQueue queue;
+  PROC_init_queue(&queue);
+  PROC_wait_lock();
+  PROC_block_on_timeout(&queue, true, ns);
+}
+
+#ifdef TIMER_BENCH
+// lots of timers spread over a few seconds, the way pending I/O timeouts
+// would be, then how late they fired and how long sleeps really took
+#define TIMER_BENCH_TIMERS 4096
+#define TIMER_BENCH_SPREAD_NS (4 * TIMER_NS_PER_SEC)
+static struct Timer bench_timers[TIMER_BENCH_TIMERS];
+static uint64_t bench_deadlines[TIMER_BENCH_TIMERS];
+static uint64_t bench_fired;
+static uint64_t bench_late_total;
+static uint64_t bench_late_max;
+
+static void bench_expired(void *arg) {
+  uint64_t late = TIMER_ns() - bench_deadlines[(size_t)arg];
+  bench_late_total += late;
+  if (late > bench_late_max) {
+    bench_late_max = late;
+  }
+  bench_fired += 1;
+}
+
+static void bench_thread(void *arg) {
+  uint64_t seed = 1;
+  uint64_t start = rdtsc();
+  for (size_t i = 0; i < TIMER_BENCH_TIMERS; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    uint64_t delay = (seed >> 16) % TIMER_BENCH_SPREAD_NS;
+    TIMER_setup(&bench_timers[i], bench_expired, (void *)i);
+    bench_deadlines[i] = TIMER_ns() + delay;
+    TIMER_arm(&bench_timers[i], delay);
+  }
+  uint64_t arm_cycles = (rdtsc() - start) / TIMER_BENCH_TIMERS;
+  // cancel every other one, they shouldn't be counted
+  size_t cancelled = 0;
+  for (size_t i = 0; i < TIMER_BENCH_TIMERS; i += 2) {
+    cancelled += TIMER_cancel(&bench_timers[i]);
+  }
+  ksleep_ns(TIMER_BENCH_SPREAD_NS + 2 * TIMER_NS_PER_TICK);
+  printk("timer bench: %lu cycles an arm, %lu of %u fired, %lu cancelled, "
+         "late avg %lu max %lu ns\n",
+         arm_cycles, bench_fired, TIMER_BENCH_TIMERS, cancelled,
+         bench_late_total / (bench_fired | 1), bench_late_max);
+
+  uint64_t sleeps[] = {10000, 500000, 2000000, 50000000};
+  for (size_t i = 0; i < sizeof(sleeps) / sizeof(*sleeps); ++i) {
+    uint64_t before = TIMER_ns();
+    ksleep_ns(sleeps[i]);
+    printk("timer bench: asked to sleep %lu ns, slept %lu ns\n", sleeps[i],
+           TIMER_ns() - before);
+  }
+}
+
+void TIMER_bench() { PROC_create_kthread(&bench_thread, NULL); }
+#endif
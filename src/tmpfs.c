@@ -0,0 +1,449 @@
+#include "tmpfs.h"
+#include "allocator.h"
+#include "meminfo.h"
+#include "page_allocator.h"
+#include "page_table.h"
+#include "printk.h"
+#include "radix_tree.h"
+#include "slab.h"
+#include "smolassert.h"
+#include "sync.h"
+#include "vfs.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+struct TmpfsSuperBlock {
+  struct SuperBlock sb;
+  // over the directory tree, the inode table and link and open counts
+  struct KRWLock lock;
+  ino_t next_ino;
+  // ino -> struct TmpfsInode
+  struct RadixTree inodes;
+};
+
+struct TmpfsInode;
+
+struct TmpfsDirEntry {
+  char *name;
+  struct TmpfsInode *inode;
+  struct TmpfsDirEntry *next;
+};
+
+struct TmpfsInode {
+  struct Inode in;
+  struct TmpfsSuperBlock *tsb;
+  // over the file's size and pages
+  struct KMutex lock;
+  uint32_t nlink;
+  uint32_t open_count;
+  // page index -> struct TmpfsPage, holes are read back as zeroes
+  struct RadixTree pages;
+  struct TmpfsDirEntry *entries;
+};
+
+struct TmpfsPage {
+  void *frame;
+  // mapped pages outlive the file, we have no way to unmap them
+  uint32_t mapcount;
+};
+
+struct TmpfsFile {
+  struct File f;
+  struct TmpfsInode *inode;
+  off_t cursor;
+};
+
+static struct KmemCache *tmpfs_inode_cache;
+static struct LockClass tmpfs_sb_lock_class = LOCK_CLASS_INIT("tmpfs_sb");
+static struct LockClass tmpfs_inode_lock_class =
+    LOCK_CLASS_INIT("tmpfs_inode");
+
+static void free_page_callback(uint64_t index, void *item, void *arg) {
+  struct TmpfsPage *page = item;
+  if (page->mapcount > 0) {
+    return;
+  }
+  MMU_pf_free(page->frame);
+  kfree(page);
+  MEMINFO_add(MEMSTAT_TMPFS, -1);
+}
+
+// inodes are only destroyed once no directory or open file refers to them.
+// With the superblock write locked
+static void tmpfs_inode_release(struct TmpfsInode *tin) {
+  if (tin->nlink > 0 || tin->open_count > 0) {
+    return;
+  }
+  radix_tree_for_each(&tin->pages, free_page_callback, NULL);
+  radix_tree_destroy(&tin->pages);
+  radix_tree_delete(&tin->tsb->inodes, tin->in.ino);
+  kmem_cache_free(tmpfs_inode_cache, tin);
+}
+
+static struct TmpfsPage *tmpfs_get_page(struct TmpfsInode *tin,
+                                        uint64_t index, bool allocate) {
+  struct TmpfsPage *page = radix_tree_lookup(&tin->pages, index);
+  if (page == NULL && allocate) {
+    page = kmalloc(sizeof(*page));
+    if (page == NULL) {
+      return NULL;
+    }
+    page->frame = MMU_pf_alloc_zeroed();
+    page->mapcount = 0;
+    if (page->frame == NULL) {
+      kfree(page);
+      return NULL;
+    }
+    if (!radix_tree_insert(&tin->pages, index, page)) {
+      MMU_pf_free(page->frame);
+      kfree(page);
+      return NULL;
+    }
+    MEMINFO_add(MEMSTAT_TMPFS, 1);
+  }
+  return page;
+}
+
+static int tmpfs_file_read(struct File *file, char *dst, int len) {
+  struct TmpfsFile *tf = (struct TmpfsFile *)file;
+  struct TmpfsInode *tin = tf->inode;
+  int bytes_read = 0;
+  kmutex_lock(&tin->lock);
+  while (bytes_read < len && tf->cursor < tin->in.st_size) {
+    size_t page_off = tf->cursor % MMU_PAGE_SIZE;
+    size_t copied = MIN(MMU_PAGE_SIZE - page_off,
+                        MIN((size_t)(len - bytes_read),
+                            tin->in.st_size - tf->cursor));
+    struct TmpfsPage *page =
+        tmpfs_get_page(tin, tf->cursor / MMU_PAGE_SIZE, false);
+    if (page != NULL) {
+      memcpy(dst, page->frame + page_off, copied);
+    } else {
+      memset(dst, 0, copied);
+    }
+    bytes_read += copied;
+    tf->cursor += copied;
+    dst += copied;
+  }
+  kmutex_unlock(&tin->lock);
+  return bytes_read;
+}
+
+static int tmpfs_file_write(struct File *file, char *src, int len) {
+  struct TmpfsFile *tf = (struct TmpfsFile *)file;
+  struct TmpfsInode *tin = tf->inode;
+  int bytes_written = 0;
+  kmutex_lock(&tin->lock);
+  while (bytes_written < len) {
+    size_t page_off = tf->cursor % MMU_PAGE_SIZE;
+    size_t copied =
+        MIN(MMU_PAGE_SIZE - page_off, (size_t)(len - bytes_written));
+    struct TmpfsPage *page =
+        tmpfs_get_page(tin, tf->cursor / MMU_PAGE_SIZE, true);
+    if (page == NULL) {
+      // out of memory, report the short write
+      break;
+    }
+    memcpy(page->frame + page_off, src, copied);
+    bytes_written += copied;
+    tf->cursor += copied;
+    src += copied;
+  }
+  tin->in.st_size = MAX(tin->in.st_size, tf->cursor);
+  kmutex_unlock(&tin->lock);
+  return bytes_written;
+}
+
+static int tmpfs_file_lseek(struct File *file, off_t offset) {
+  struct TmpfsFile *tf = (struct TmpfsFile *)file;
+  // seeking past the end is fine, a later write leaves a hole behind it
+  tf->cursor = offset;
+  return offset;
+}
+
+// maps the whole file at addr, writes through the mapping land in the file
+static int tmpfs_file_mmap(struct File *file, void *addr) {
+  struct TmpfsFile *tf = (struct TmpfsFile *)file;
+  struct TmpfsInode *tin = tf->inode;
+  struct PageEntry *table = (struct PageEntry *)get_current_page_table();
+  bool mapped = true;
+  kmutex_lock(&tin->lock);
+  uint64_t num_pages = tin->in.st_size / MMU_PAGE_SIZE +
+                       !!(tin->in.st_size % MMU_PAGE_SIZE);
+  for (uint64_t i = 0; i < num_pages && mapped; ++i) {
+    struct TmpfsPage *page = tmpfs_get_page(tin, i, true);
+    void *virt_addr = addr + i * MMU_PAGE_SIZE;
+    struct PTEntry *entry =
+        page == NULL ? NULL : page_table_get_entry(table, virt_addr, true);
+    if (entry == NULL) {
+      mapped = false;
+      break;
+    }
+    page->mapcount += 1;
+    entry->addr = (uint64_t)page->frame >> 12;
+    entry->read_write = true;
+    entry->present = true;
+    invlpg(virt_addr);
+  }
+  kmutex_unlock(&tin->lock);
+  return mapped;
+}
+
+static int tmpfs_file_close(struct File **file) {
+  struct TmpfsFile *tf = (struct TmpfsFile *)*file;
+  struct TmpfsInode *tin = tf->inode;
+  kfree(tf);
+  *file = NULL;
+  krwlock_write_lock(&tin->tsb->lock);
+  tin->open_count -= 1;
+  tmpfs_inode_release(tin);
+  krwlock_write_unlock(&tin->tsb->lock);
+  return true;
+}
+
+static struct File *tmpfs_open(struct Inode *inode) {
+  struct TmpfsInode *tin = (struct TmpfsInode *)inode;
+  struct TmpfsFile *file = kmalloc(sizeof(*file));
+  if (file == NULL) {
+    return NULL;
+  }
+  file->f.close = tmpfs_file_close;
+  file->f.read = tmpfs_file_read;
+  file->f.write = tmpfs_file_write;
+  file->f.lseek = tmpfs_file_lseek;
+  file->f.mmap = tmpfs_file_mmap;
+  file->inode = tin;
+  file->cursor = 0;
+  krwlock_write_lock(&tin->tsb->lock);
+  tin->open_count += 1;
+  krwlock_write_unlock(&tin->tsb->lock);
+  return (struct File *)file;
+}
+
+// cb runs with the superblock read locked, so it mustn't change this tmpfs
+static int tmpfs_readdir(struct Inode *inode, readdir_cb cb, void *arg) {
+  struct TmpfsInode *tin = (struct TmpfsInode *)inode;
+  if (!(inode->st_mode & VFS_MODE_DIR)) {
+    return false;
+  }
+  krwlock_read_lock(&tin->tsb->lock);
+  for (struct TmpfsDirEntry *entry = tin->entries; entry != NULL;
+       entry = entry->next) {
+    cb(entry->name, (struct Inode *)entry->inode, arg);
+  }
+  krwlock_read_unlock(&tin->tsb->lock);
+  return true;
+}
+
+static struct TmpfsDirEntry **tmpfs_lookup(struct TmpfsInode *dir,
+                                           const char *name) {
+  struct TmpfsDirEntry **link = &dir->entries;
+  while (*link != NULL && strcmp((*link)->name, name) != 0) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static int tmpfs_unlink(struct Inode *inode, const char *name) {
+  struct TmpfsInode *dir = (struct TmpfsInode *)inode;
+  krwlock_write_lock(&dir->tsb->lock);
+  struct TmpfsDirEntry **link = tmpfs_lookup(dir, name);
+  struct TmpfsDirEntry *entry = *link;
+  // a directory has to be empty
+  if (entry == NULL || entry->inode->entries != NULL) {
+    krwlock_write_unlock(&dir->tsb->lock);
+    return false;
+  }
+  *link = entry->next;
+  entry->inode->nlink -= 1;
+  tmpfs_inode_release(entry->inode);
+  krwlock_write_unlock(&dir->tsb->lock);
+  kfree(entry->name);
+  kfree(entry);
+  return true;
+}
+
+static struct Inode *tmpfs_create(struct Inode *inode, const char *name,
+                                  mode_t mode);
+
+static struct TmpfsInode *tmpfs_inode_alloc(struct TmpfsSuperBlock *tsb,
+                                            mode_t mode) {
+  struct TmpfsInode *tin = kmem_cache_alloc(tmpfs_inode_cache);
+  if (tin == NULL) {
+    return NULL;
+  }
+  tin->in.ino = tsb->next_ino++;
+  tin->in.st_mode = mode;
+  tin->in.st_uid = 0;
+  tin->in.st_gid = 0;
+  tin->in.st_size = 0;
+  tin->in.sb = (struct SuperBlock *)tsb;
+  tin->in.open = tmpfs_open;
+  tin->in.readdir = tmpfs_readdir;
+  tin->in.unlink = tmpfs_unlink;
+  tin->in.create = tmpfs_create;
+  // data already lives in memory, no need for the page cache
+  tin->in.readpage = NULL;
+  tin->tsb = tsb;
+  kmutex_init(&tin->lock, &tmpfs_inode_lock_class);
+  tin->nlink = 0;
+  tin->open_count = 0;
+  radix_tree_init(&tin->pages);
+  tin->entries = NULL;
+  if (!radix_tree_insert(&tsb->inodes, tin->in.ino, tin)) {
+    kmem_cache_free(tmpfs_inode_cache, tin);
+    return NULL;
+  }
+  return tin;
+}
+
+static struct Inode *tmpfs_create(struct Inode *inode, const char *name,
+                                  mode_t mode) {
+  struct TmpfsInode *dir = (struct TmpfsInode *)inode;
+  if (!(inode->st_mode & VFS_MODE_DIR)) {
+    return NULL;
+  }
+  struct TmpfsDirEntry *entry = kmalloc(sizeof(*entry));
+  char *entry_name = kmalloc(strlen(name) + 1);
+  if (entry == NULL || entry_name == NULL) {
+    kfree(entry_name);
+    kfree(entry);
+    return NULL;
+  }
+  strcpy(entry_name, name);
+  entry->name = entry_name;
+  krwlock_write_lock(&dir->tsb->lock);
+  struct TmpfsInode *tin = NULL;
+  if (*tmpfs_lookup(dir, name) == NULL) {
+    tin = tmpfs_inode_alloc(dir->tsb, mode);
+  }
+  if (tin != NULL) {
+    tin->nlink = 1;
+    entry->inode = tin;
+    entry->next = dir->entries;
+    dir->entries = entry;
+  }
+  krwlock_write_unlock(&dir->tsb->lock);
+  if (tin == NULL) {
+    kfree(entry->name);
+    kfree(entry);
+  }
+  return (struct Inode *)tin;
+}
+
+static struct Inode *tmpfs_read_inode(struct SuperBlock *sb,
+                                      unsigned long inode_num) {
+  struct TmpfsSuperBlock *tsb = (struct TmpfsSuperBlock *)sb;
+  krwlock_read_lock(&tsb->lock);
+  struct Inode *inode = radix_tree_lookup(&tsb->inodes, inode_num);
+  krwlock_read_unlock(&tsb->lock);
+  return inode;
+}
+
+void tmpfs_init() {
+  tmpfs_inode_cache =
+      kmem_cache_create("tmpfs_inode", sizeof(struct TmpfsInode), 0, NULL);
+}
+
+struct SuperBlock *tmpfs_mount() {
+  struct TmpfsSuperBlock *tsb = kmalloc(sizeof(*tsb));
+  if (tsb == NULL) {
+    return NULL;
+  }
+  tsb->sb.name = "Tmpfs";
+  tsb->sb.type = "tmpfs";
+  tsb->sb.read_inode = tmpfs_read_inode;
+  tsb->sb.sync_fs = NULL;
+  tsb->sb.put_super = NULL;
+  krwlock_init(&tsb->lock, &tmpfs_sb_lock_class);
+  // match ext2, where inode 2 is the root
+  tsb->next_ino = 2;
+  radix_tree_init(&tsb->inodes);
+  struct TmpfsInode *root = tmpfs_inode_alloc(tsb, VFS_MODE_DIR);
+  if (root == NULL) {
+    radix_tree_destroy(&tsb->inodes);
+    kfree(tsb);
+    return NULL;
+  }
+  root->nlink = 1;
+  tsb->sb.root_inode = (struct Inode *)root;
+  return (struct SuperBlock *)tsb;
+}
+
+#ifdef TMPFS_TEST
+#define TMPFS_TEST_LEN (3 * MMU_PAGE_SIZE + 123)
+#define TMPFS_TEST_HOLE_OFF (64 * MMU_PAGE_SIZE)
+
+void tmpfs_test() {
+  struct SuperBlock *sb = tmpfs_mount();
+  assert(sb != NULL && "mount should succeed");
+  struct Inode *root = sb->root_inode;
+  struct Inode *inode = root->create(root, "scratch", VFS_MODE_REG);
+  assert(inode != NULL && "create should succeed");
+  assert(root->create(root, "scratch", VFS_MODE_REG) == NULL &&
+         "duplicate names should be refused");
+  assert(sb->read_inode(sb, inode->ino) == inode &&
+         "inodes should be found by number");
+
+  // write then read back a pattern spanning several pages
+  char *buf = kmalloc(TMPFS_TEST_LEN);
+  for (size_t i = 0; i < TMPFS_TEST_LEN; ++i) {
+    buf[i] = (char)(i * 7);
+  }
+  struct File *file = inode->open(inode);
+  assert(file != NULL && "open should succeed");
+  assert(file->write(file, buf, TMPFS_TEST_LEN) == TMPFS_TEST_LEN &&
+         "write should be complete");
+  assert(inode->st_size == TMPFS_TEST_LEN && "write should extend the file");
+  memset(buf, 0, TMPFS_TEST_LEN);
+  file->lseek(file, 0);
+  assert(file->read(file, buf, TMPFS_TEST_LEN) == TMPFS_TEST_LEN &&
+         "read should be complete");
+  for (size_t i = 0; i < TMPFS_TEST_LEN; ++i) {
+    assert(buf[i] == (char)(i * 7) && "read should match written data");
+  }
+  assert(file->read(file, buf, 1) == 0 && "read at the end should be empty");
+
+  // writing past the end leaves a hole that reads as zeroes
+  char byte = 'x';
+  file->lseek(file, TMPFS_TEST_HOLE_OFF);
+  file->write(file, &byte, 1);
+  file->lseek(file, TMPFS_TEST_HOLE_OFF - TMPFS_TEST_LEN + 1);
+  assert(file->read(file, buf, TMPFS_TEST_LEN) == TMPFS_TEST_LEN &&
+         "hole should be readable");
+  for (size_t i = 0; i < TMPFS_TEST_LEN - 1; ++i) {
+    assert(buf[i] == 0 && "holes should read as zero");
+  }
+  assert(buf[TMPFS_TEST_LEN - 1] == 'x' && "data after hole should be kept");
+
+  // writes through a mapping should be visible to read
+  char *mapped = ADDR_SPACE_RESERVED_GROWTH_BASE;
+  assert(file->mmap(file, mapped) && "mmap should succeed");
+  assert(mapped[TMPFS_TEST_HOLE_OFF] == 'x' && "mapping should see file");
+  mapped[1] = 'y';
+  file->lseek(file, 1);
+  file->read(file, &byte, 1);
+  assert(byte == 'y' && "file should see mapping");
+
+  // file stays alive until it's closed
+  assert(root->unlink(root, "scratch") && "unlink should succeed");
+  assert(!root->unlink(root, "scratch") && "unlink should only work once");
+  assert(sb->read_inode(sb, inode->ino) == inode &&
+         "open files should outlive their name");
+  ino_t ino = inode->ino;
+  file->close(&file);
+  assert(file == NULL && "close should clear the file");
+  assert(sb->read_inode(sb, ino) == NULL && "closed file should be freed");
+  // its pages are still mapped though, and have to stay put
+  assert(mapped[TMPFS_TEST_HOLE_OFF] == 'x' && "mapped pages should be kept");
+
+  kfree(buf);
+  printk("tmpfs test passed.\n");
+}
+#endif
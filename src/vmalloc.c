@@ -0,0 +1,557 @@
+#include "vmalloc.h"
+#include "alignment.h"
+#include "cpu.h"
+#include "meminfo.h"
+#include "page_allocator.h"
+#include "page_table.h"
+#include "printk.h"
+#include "radix_tree.h"
+#include "slab.h"
+#include "smolassert.h"
+#include "spinlock.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VMALLOC_START ((uintptr_t)ADDR_SPACE_KERNEL_HEAP_BASE)
+#define VMALLOC_END ((uintptr_t)ADDR_SPACE_RESERVED_GROWTH_BASE)
+// left unmapped after every area so overruns fault instead of landing in
+// the next one
+#define VMALLOC_GUARD_SIZE MMU_PAGE_SIZE
+
+// free address space, kept in a treap ordered by start address where every
+// node also knows the largest range below it, which makes first fit a
+// single walk down the tree
+struct VmFreeRange {
+  uintptr_t start;
+  size_t size;
+  size_t max_size;
+  uint32_t priority;
+  struct VmFreeRange *left;
+  struct VmFreeRange *right;
+};
+
+struct VmArea {
+  uintptr_t start;
+  // without the guard page
+  size_t size;
+  // 2 MiB pages mapped at the start of the area
+  size_t huge_pages;
+};
+
+static struct VmFreeRange *free_root = NULL;
+static size_t num_free_ranges = 0;
+// page index from VMALLOC_START -> struct VmArea
+static struct RadixTree areas;
+// the trees are shared by every CPU, the public entry points hold this
+// while they're in them and no longer: backing an area allocates frames and
+// page tables, which can go into reclaim. The trees' own nodes still come
+// from the slab with it held, so no shrinker may vfree
+static struct Spinlock vmalloc_lock = SPINLOCK_INIT;
+static struct KmemCache *range_cache;
+static struct KmemCache *area_cache;
+static uint32_t priority_state = 2463534242u;
+
+static uint32_t next_priority() {
+  priority_state ^= priority_state << 13;
+  priority_state ^= priority_state >> 17;
+  priority_state ^= priority_state << 5;
+  return priority_state;
+}
+
+static inline size_t max_size(struct VmFreeRange *node) {
+  return node == NULL ? 0 : node->max_size;
+}
+
+static void update(struct VmFreeRange *node) {
+  node->max_size = node->size;
+  if (max_size(node->left) > node->max_size) {
+    node->max_size = max_size(node->left);
+  }
+  if (max_size(node->right) > node->max_size) {
+    node->max_size = max_size(node->right);
+  }
+}
+
+// splits into the ranges starting before key and the rest
+static void split(struct VmFreeRange *node, uintptr_t key,
+                  struct VmFreeRange **left, struct VmFreeRange **right) {
+  if (node == NULL) {
+    *left = *right = NULL;
+  } else if (node->start < key) {
+    split(node->right, key, &node->right, right);
+    update(node);
+    *left = node;
+  } else {
+    split(node->left, key, left, &node->left);
+    update(node);
+    *right = node;
+  }
+}
+
+static struct VmFreeRange *merge(struct VmFreeRange *left,
+                                 struct VmFreeRange *right) {
+  if (left == NULL) {
+    return right;
+  }
+  if (right == NULL) {
+    return left;
+  }
+  if (left->priority > right->priority) {
+    left->right = merge(left->right, right);
+    update(left);
+    return left;
+  }
+  right->left = merge(left, right->left);
+  update(right);
+  return right;
+}
+
+static void range_insert(struct VmFreeRange *node) {
+  struct VmFreeRange *left, *right;
+  node->left = node->right = NULL;
+  node->max_size = node->size;
+  split(free_root, node->start, &left, &right);
+  free_root = merge(merge(left, node), right);
+  num_free_ranges += 1;
+}
+
+static struct VmFreeRange *range_remove(uintptr_t start) {
+  struct VmFreeRange *left, *mid, *right;
+  split(free_root, start, &left, &right);
+  split(right, start + 1, &mid, &right);
+  free_root = merge(left, right);
+  if (mid != NULL) {
+    num_free_ranges -= 1;
+  }
+  return mid;
+}
+
+// the free range with the highest start below addr, or the lowest start
+// above it
+static struct VmFreeRange *range_neighbour(uintptr_t addr, bool after) {
+  struct VmFreeRange *best = NULL;
+  struct VmFreeRange *node = free_root;
+  while (node != NULL) {
+    if (after ? node->start > addr : node->start < addr) {
+      best = node;
+      node = after ? node->left : node->right;
+    } else {
+      node = after ? node->right : node->left;
+    }
+  }
+  return best;
+}
+
+static uintptr_t range_alloc(size_t size) {
+  if (max_size(free_root) < size) {
+    return 0;
+  }
+  // lowest address that fits, keeps the heap packed towards its base
+  struct VmFreeRange *node = free_root;
+  while (true) {
+    if (max_size(node->left) >= size) {
+      node = node->left;
+    } else if (node->size >= size) {
+      break;
+    } else {
+      node = node->right;
+    }
+  }
+  uintptr_t start = node->start;
+  range_remove(start);
+  if (node->size > size) {
+    node->start += size;
+    node->size -= size;
+    range_insert(node);
+  } else {
+    kmem_cache_free(range_cache, node);
+  }
+  return start;
+}
+
+static void range_free(uintptr_t start, size_t size) {
+  struct VmFreeRange *node = NULL;
+  struct VmFreeRange *prev = range_neighbour(start, false);
+  if (prev != NULL && prev->start + prev->size == start) {
+    node = range_remove(prev->start);
+    start = node->start;
+    size += node->size;
+  }
+  struct VmFreeRange *next = range_neighbour(start, true);
+  if (next != NULL && start + size == next->start) {
+    next = range_remove(next->start);
+    size += next->size;
+    if (node == NULL) {
+      node = next;
+    } else {
+      kmem_cache_free(range_cache, next);
+    }
+  }
+  if (node == NULL) {
+    node = kmem_cache_alloc(range_cache);
+    if (node == NULL) {
+      printk("vmalloc: leaking %lx-%lx, no memory to track it\n", start,
+             start + size);
+      return;
+    }
+    node->priority = next_priority();
+  }
+  node->start = start;
+  node->size = size;
+  range_insert(node);
+}
+
+// over-allocates by the alignment and gives the slack on both ends back
+static uintptr_t range_alloc_aligned(size_t size, size_t align) {
+  if (align <= MMU_PAGE_SIZE) {
+    return range_alloc(size);
+  }
+  size_t padded = size + align - MMU_PAGE_SIZE;
+  uintptr_t start = range_alloc(padded);
+  if (start == 0) {
+    return 0;
+  }
+  uintptr_t aligned = align_pointer(start, align, true);
+  if (aligned > start) {
+    range_free(start, aligned - start);
+  }
+  if (aligned + size < start + padded) {
+    range_free(aligned + size, start + padded - aligned - size);
+  }
+  return aligned;
+}
+
+static inline uint64_t area_key(uintptr_t start) {
+  return (start - VMALLOC_START) / MMU_PAGE_SIZE;
+}
+
+static void mark_available_callback(void *virt_addr, struct PTEntry *entry,
+                                    void *arg) {
+  entry->available1 = (uint8_t)true;
+}
+
+// lets the page fault handler back [start, start + size) on first touch
+static bool make_available(uintptr_t start, size_t size) {
+  if (!page_table_walk((struct PageEntry *)get_current_page_table(),
+                       (void *)start, (void *)(start + size), true,
+                       &mark_available_callback, NULL)) {
+    MMU_free_pages((void *)start, size / MMU_PAGE_SIZE);
+    return false;
+  }
+  return true;
+}
+
+// the first 2 MiB chunks of the area each get a single page for as long as
+// whole blocks can be had, the rest is demand paged
+static bool make_available_huge(struct VmArea *area) {
+  struct PageEntry *table = (struct PageEntry *)get_current_page_table();
+  struct TlbBatch batch;
+  tlb_batch_init(&batch);
+  uintptr_t addr = area->start;
+  uintptr_t end = area->start + area->size;
+  while (addr + MMU_HUGE_PAGE_SIZE <= end) {
+    void *block = MMU_pf_try_alloc_order(MMU_HUGE_PAGE_ORDER);
+    if (block == NULL) {
+      break;
+    }
+    memset(block, 0, MMU_HUGE_PAGE_SIZE);
+    if (!page_table_map_huge(table, (void *)addr, block, &batch)) {
+      MMU_pf_free_order(block, MMU_HUGE_PAGE_ORDER);
+      break;
+    }
+    MEMINFO_add(MEMSTAT_HEAP_RESIDENT, 1l << MMU_HUGE_PAGE_ORDER);
+    area->huge_pages += 1;
+    addr += MMU_HUGE_PAGE_SIZE;
+  }
+  tlb_batch_flush(&batch);
+  return addr == end || make_available(addr, end - addr);
+}
+
+// gives back everything backing the area, huge pages and demand paged ones
+static void release_area(struct VmArea *area) {
+  struct PageEntry *table = (struct PageEntry *)get_current_page_table();
+  struct TlbBatch batch;
+  tlb_batch_init(&batch);
+  for (size_t i = 0; i < area->huge_pages; ++i) {
+    void *addr = (void *)(area->start + i * MMU_HUGE_PAGE_SIZE);
+    void *block = page_table_unmap_huge(table, addr, &batch);
+    assert(block != NULL && "vmalloc lost a 2 MiB page");
+    MMU_pf_free_order(block, MMU_HUGE_PAGE_ORDER);
+    MEMINFO_add(MEMSTAT_HEAP_RESIDENT, -(1l << MMU_HUGE_PAGE_ORDER));
+  }
+  tlb_batch_flush(&batch);
+  area->huge_pages = 0;
+  MMU_free_pages((void *)area->start, area->size / MMU_PAGE_SIZE);
+}
+
+void vmalloc_init() {
+  range_cache =
+      kmem_cache_create("vmap_range", sizeof(struct VmFreeRange), 0, NULL);
+  area_cache = kmem_cache_create("vmap_area", sizeof(struct VmArea), 0, NULL);
+  assert(range_cache != NULL && area_cache != NULL &&
+         "Out of memory for vmalloc caches");
+  radix_tree_init(&areas);
+  struct VmFreeRange *all = kmem_cache_alloc(range_cache);
+  assert(all != NULL && "Out of memory for the vmalloc area");
+  all->start = VMALLOC_START;
+  all->size = VMALLOC_END - VMALLOC_START;
+  all->priority = next_priority();
+  range_insert(all);
+}
+
+void *vmalloc(size_t size) { return vmalloc_flags(size, 0); }
+
+// gives the range and its slot back once nothing is mapped in it any more
+static void area_unreserve(struct VmArea *area) {
+  spin_lock(&vmalloc_lock);
+  radix_tree_delete(&areas, area_key(area->start));
+  range_free(area->start, area->size + VMALLOC_GUARD_SIZE);
+  spin_unlock(&vmalloc_lock);
+}
+
+static void area_destroy(struct VmArea *area) {
+  release_area(area);
+  MEMINFO_add(MEMSTAT_VMALLOC_PAGES, -(long)(area->size / MMU_PAGE_SIZE));
+  area_unreserve(area);
+  kmem_cache_free(area_cache, area);
+}
+
+void *vmalloc_flags(size_t size, int flags) {
+  if (size == 0) {
+    return NULL;
+  }
+  size = align_pointer(size, MMU_PAGE_SIZE, true);
+  struct VmArea *area = kmem_cache_alloc(area_cache);
+  if (area == NULL) {
+    return NULL;
+  }
+  bool huge = (flags & VMALLOC_HUGE) && size >= MMU_HUGE_PAGE_SIZE;
+  area->size = size;
+  area->huge_pages = 0;
+  spin_lock(&vmalloc_lock);
+  area->start = range_alloc_aligned(size + VMALLOC_GUARD_SIZE,
+                                    huge ? MMU_HUGE_PAGE_SIZE : MMU_PAGE_SIZE);
+  if (area->start != 0 &&
+      !radix_tree_insert(&areas, area_key(area->start), area)) {
+    range_free(area->start, size + VMALLOC_GUARD_SIZE);
+    area->start = 0;
+  }
+  spin_unlock(&vmalloc_lock);
+  if (area->start == 0) {
+    kmem_cache_free(area_cache, area);
+    return NULL;
+  }
+  // the range and its slot are ours now. Backing them allocates page tables
+  // and frames, which can go into reclaim, so that's done unlocked
+  if (!(huge ? make_available_huge(area)
+             : make_available(area->start, size))) {
+    release_area(area);
+    area_unreserve(area);
+    kmem_cache_free(area_cache, area);
+    return NULL;
+  }
+  MEMINFO_add(MEMSTAT_VMALLOC_PAGES, size / MMU_PAGE_SIZE);
+  // walking the 2 MiB pages would split them, they're backed already anyway
+  size_t huge_size = area->huge_pages * MMU_HUGE_PAGE_SIZE;
+  if ((flags & VMALLOC_POPULATE) &&
+      !MMU_populate_pages((void *)(area->start + huge_size),
+                          (size - huge_size) / MMU_PAGE_SIZE)) {
+    area_destroy(area);
+    return NULL;
+  }
+  return (void *)area->start;
+}
+
+void vfree(void *addr) {
+  if (addr == NULL) {
+    return;
+  }
+  spin_lock(&vmalloc_lock);
+  struct VmArea *area = radix_tree_lookup(&areas, area_key((uintptr_t)addr));
+  spin_unlock(&vmalloc_lock);
+  assert(area != NULL && "vfree of an address vmalloc didn't hand out");
+  area_destroy(area);
+}
+
+size_t vmalloc_size(void *addr) {
+  spin_lock(&vmalloc_lock);
+  struct VmArea *area = radix_tree_lookup(&areas, area_key((uintptr_t)addr));
+  size_t size = area == NULL ? 0 : area->size;
+  spin_unlock(&vmalloc_lock);
+  return size;
+}
+
+// takes extra bytes of address space right after the area's guard page, the
+// guard moves up over them once they're backed
+static bool area_reserve_growth(struct VmArea *area, size_t extra) {
+  uintptr_t guard_end = area->start + area->size + VMALLOC_GUARD_SIZE;
+  struct VmFreeRange *next = range_neighbour(guard_end - 1, true);
+  if (next == NULL || next->start != guard_end || next->size < extra) {
+    return false;
+  }
+  range_remove(guard_end);
+  if (next->size > extra) {
+    next->start += extra;
+    next->size -= extra;
+    range_insert(next);
+  } else {
+    kmem_cache_free(range_cache, next);
+  }
+  return true;
+}
+
+bool vmalloc_grow(void *addr, size_t size) {
+  spin_lock(&vmalloc_lock);
+  struct VmArea *area = radix_tree_lookup(&areas, area_key((uintptr_t)addr));
+  assert(area != NULL && "vmalloc_grow of an address vmalloc didn't hand out");
+  size = align_pointer(size, MMU_PAGE_SIZE, true);
+  size_t old_size = area->size;
+  bool reserved = size > old_size && area_reserve_growth(area, size - old_size);
+  spin_unlock(&vmalloc_lock);
+  if (size <= old_size) {
+    return true;
+  }
+  if (!reserved) {
+    return false;
+  }
+  size_t extra = size - old_size;
+  if (!make_available(area->start + old_size, extra)) {
+    spin_lock(&vmalloc_lock);
+    range_free(area->start + old_size + VMALLOC_GUARD_SIZE, extra);
+    spin_unlock(&vmalloc_lock);
+    return false;
+  }
+  spin_lock(&vmalloc_lock);
+  area->size = size;
+  spin_unlock(&vmalloc_lock);
+  MEMINFO_add(MEMSTAT_VMALLOC_PAGES, extra / MMU_PAGE_SIZE);
+  return true;
+}
+
+size_t vmalloc_num_free_ranges() { return num_free_ranges; }
+
+#ifdef VMALLOC_TEST
+#define VMALLOC_TEST_SLOTS 256
+#define VMALLOC_TEST_ROUNDS 2000000
+#define VMALLOC_TEST_MAX_PAGES 64
+static uint8_t *test_areas[VMALLOC_TEST_SLOTS];
+static size_t test_sizes[VMALLOC_TEST_SLOTS];
+
+static void test_check(size_t slot) {
+  // a range handed out twice would have had its tags overwritten
+  assert(test_areas[slot][0] == (uint8_t)slot &&
+         test_areas[slot][test_sizes[slot] - 1] == (uint8_t)slot &&
+         "vmalloc areas overlap");
+  assert(vmalloc_size(test_areas[slot]) >= test_sizes[slot] &&
+         "vmalloc lost an area's size");
+}
+
+void vmalloc_test() {
+  uint64_t state = 88172645463325252lu;
+  size_t ranges_before = num_free_ranges;
+  size_t reserved_before = MEMINFO_get(MEMSTAT_VMALLOC_PAGES);
+  size_t num_grown = 0;
+  for (int round = 0; round < VMALLOC_TEST_ROUNDS; ++round) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    size_t slot = state % VMALLOC_TEST_SLOTS;
+    uint8_t *area = test_areas[slot];
+    if (area == NULL) {
+      size_t size = (1 + (state >> 8) % VMALLOC_TEST_MAX_PAGES) *
+                        MMU_PAGE_SIZE -
+                    (state >> 20) % MMU_PAGE_SIZE;
+      area = vmalloc(size);
+      assert(area != NULL && "vmalloc failed during the churn test");
+      area[0] = area[size - 1] = (uint8_t)slot;
+      test_areas[slot] = area;
+      test_sizes[slot] = size;
+    } else if ((state >> 8) % 4 == 0) {
+      test_check(slot);
+      size_t size = test_sizes[slot] + (1 + (state >> 12) % 8) * MMU_PAGE_SIZE;
+      if (vmalloc_grow(area, size)) {
+        area[size - 1] = (uint8_t)slot;
+        test_sizes[slot] = size;
+        num_grown += 1;
+      }
+    } else {
+      test_check(slot);
+      vfree(area);
+      test_areas[slot] = NULL;
+    }
+  }
+  for (size_t slot = 0; slot < VMALLOC_TEST_SLOTS; ++slot) {
+    if (test_areas[slot] != NULL) {
+      test_check(slot);
+      vfree(test_areas[slot]);
+      test_areas[slot] = NULL;
+    }
+  }
+  assert(num_free_ranges == ranges_before &&
+         "Freed ranges should coalesce back to where they started");
+  assert(MEMINFO_get(MEMSTAT_VMALLOC_PAGES) == reserved_before &&
+         "vmalloc accounting drifted");
+  printk("vmalloc test passed: %d rounds, %lu grown in place\n",
+         VMALLOC_TEST_ROUNDS, num_grown);
+}
+#endif
+
+#ifdef VMALLOC_BENCH
+#define VMALLOC_BENCH_SIZE (16lu << 20)
+
+// writes one byte to every page of a fresh area in order, timing the
+// allocation along with the touches so populating up front isn't free
+static void bench_touch(const char *name, int flags, size_t fault_around) {
+  MMU_set_fault_around(fault_around);
+  size_t faults = MMU_num_faults();
+  uint64_t start = rdtsc();
+  uint8_t *area = vmalloc_flags(VMALLOC_BENCH_SIZE, flags);
+  assert(area != NULL && "Benchmark ran out of memory");
+  for (size_t offset = 0; offset < VMALLOC_BENCH_SIZE;
+       offset += MMU_PAGE_SIZE) {
+    area[offset] = 1;
+  }
+  uint64_t cycles = rdtsc() - start;
+  vfree(area);
+  printk("vmalloc bench (%s): %lu faults, %lu cycles, %lu cycles/page\n",
+         name, MMU_num_faults() - faults, cycles,
+         cycles / (VMALLOC_BENCH_SIZE / MMU_PAGE_SIZE));
+}
+
+#define VMALLOC_BENCH_RANDOM_SIZE (64lu << 20)
+#define VMALLOC_BENCH_RANDOM_READS 4000000
+
+// reads words all over an area much bigger than the TLB reaches with 4 KiB
+// pages, so most reads miss it
+static void bench_random(const char *name, int flags) {
+  uint64_t *area = vmalloc_flags(VMALLOC_BENCH_RANDOM_SIZE, flags);
+  assert(area != NULL && "Benchmark ran out of memory");
+  size_t num_words = VMALLOC_BENCH_RANDOM_SIZE / sizeof(*area);
+  uint64_t state = 88172645463325252lu, sum = 0;
+  uint64_t start = rdtsc();
+  for (int i = 0; i < VMALLOC_BENCH_RANDOM_READS; ++i) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    sum += area[state % num_words];
+  }
+  uint64_t cycles = rdtsc() - start;
+  assert(sum == 0 && "Fresh vmalloc pages should read as zero");
+  struct VmArea *info = radix_tree_lookup(&areas, area_key((uintptr_t)area));
+  printk("vmalloc bench (random reads, %s): %lu 2M pages, %lu cycles/read\n",
+         name, info->huge_pages, cycles / VMALLOC_BENCH_RANDOM_READS);
+  vfree(area);
+}
+
+void vmalloc_bench() {
+  bench_touch("demand paged", 0, 1);
+  bench_touch("fault-around", 0, MMU_FAULT_AROUND_PAGES);
+  bench_touch("populated", VMALLOC_POPULATE, MMU_FAULT_AROUND_PAGES);
+  MMU_set_fault_around(MMU_FAULT_AROUND_PAGES);
+  bench_random("4K pages", VMALLOC_POPULATE);
+  bench_random("2M pages", VMALLOC_HUGE);
+}
+#endif